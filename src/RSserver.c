@@ -119,6 +119,11 @@ server_t *create_server(int port, const char *localSocketName, int localSocketMo
 
 	reuse = 1; /* enable socket address reusage */
 	setsockopt(ss, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+#ifdef SO_REUSEPORT
+	/* all sockets sharing the port must have SO_REUSEPORT set before bind() */
+	if ((flags & SRV_REUSEPORT) && !localSocketName)
+		setsockopt(ss, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuse, sizeof(reuse));
+#endif
 
 #ifdef unix
 	if (localSocketName) {
@@ -155,6 +160,36 @@ server_t *create_server(int port, const char *localSocketName, int localSocketMo
 	return srv;
 }
 
+/* used by additional listener processes so that each has its own socket
+   and the kernel distributes incoming connections among them */
+int server_reopen(server_t *srv) {
+#if defined unix && defined SO_REUSEPORT
+	struct sockaddr_storage sa;
+	socklen_t sl = sizeof(sa);
+	int ss, reuse = 1;
+
+	if (srv->unix_socket || !(srv->flags & SRV_REUSEPORT) ||
+		getsockname(srv->ss, (SA*) &sa, &sl))
+		return -1;
+	ss = socket(((SA*) &sa)->sa_family, SOCK_STREAM, 0);
+	if (ss == -1)
+		return -1;
+	setsockopt(ss, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+	setsockopt(ss, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuse, sizeof(reuse));
+	if (bind(ss, (SA*) &sa, sl) || listen(ss, LISTENQ)) {
+		closesocket(ss);
+		return -1;
+	}
+	rm_active_srv_socket(srv->ss);
+	closesocket(srv->ss);
+	srv->ss = ss;
+	add_active_srv_socket(ss);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
 void server_fin(void *x) {
 	server_t *srv = (server_t*) x;
 	if (srv) {
@@ -3,11 +3,22 @@
 
 #include "Rsrv.h"
 
+#ifdef WIN32
+#ifndef RS_IOVEC_DEFINED
+#define RS_IOVEC_DEFINED 1
+struct iovec { void *iov_base; size_t iov_len; };
+#endif
+#else
+#include <sys/uio.h>
+#endif
+
 /* this is a voluntary standart flag to request TLS support */
 #define SRV_TLS       0x0800
 
 /* these flags are global and respected by the default socket server */
 #define SRV_IPV6      0x1000 /* use IPv6 */
+#define SRV_REUSEPORT 0x2000 /* allow other listening sockets on the same port
+							    (SO_REUSEPORT) - see server_reopen() */
 #define SRV_LOCAL     0x4000 /* bind to local loopback interface only */
 #define SRV_KEEPALIVE 0x8000 /* enable keep-alive - note that this is really
 							    a client option sice inheritance is not
@@ -20,6 +31,7 @@ typedef void (*work_fn_t)(void *par);
 typedef int  (*send_fn_t)(args_t *arg, int rsp, size_t len, const void *buf);
 typedef ssize_t (*buf_fn_t) (args_t *arg, void *buf, size_t len);
 typedef ssize_t (*cbuf_fn_t) (args_t *arg, const void *buf, size_t len);
+typedef ssize_t (*vbuf_fn_t) (args_t *arg, const struct iovec *iov, int iovcnt);
 typedef int  (*fork_fn_t) (args_t *arg);
 
 /* definition of a server */
@@ -33,6 +45,8 @@ typedef struct server {
 	cbuf_fn_t send;       /* direct send */
 	buf_fn_t  recv;       /* direct receive */
     fork_fn_t fork;       /* fork */
+	vbuf_fn_t sendv;      /* optional gather send (may be NULL), must be
+							 replaced or cleared along with send */
 	struct server *parent;/* parent server - used only by multi-layer servers */
 } server_t;
 
@@ -43,6 +57,9 @@ typedef struct server {
 server_t *create_server(int port, const char *localSocketName, int localSocketMode, int flags);
 void accepted_server(server_t *srv, int cs); /* performs additional tasks on client socket (eg SO_KEEPALIVE) */
 int add_server(server_t *srv);
+/* replaces the listening socket of a SRV_REUSEPORT server by a new one
+   bound to the same address. Returns 0 on success */
+int server_reopen(server_t *srv);
 int rm_server(server_t *srv);
 
 /* server stacks */
@@ -56,6 +73,7 @@ void release_server_stack(server_stack_t *s);
 void server_fin(void *x);
 ssize_t server_recv(args_t *arg, void *buf, size_t len);
 ssize_t server_send(args_t *arg, const void *buf, size_t len);
+ssize_t server_sendv(args_t *arg, const struct iovec *iov, int iovcnt);
 
 void stop_server_loop(void);
 void serverLoop(void);
@@ -73,6 +73,26 @@ the use of DT_LARGE/XT_LARGE.
    socket <unix-socket-name> [none]
    maxinbuf <size in kB> [262144 = 256MB]
    maxsendbuf <size in kB> [0 = no limit]
+   qap.zerocopy enable|disable [disable]
+   qap.stream.min <size in bytes> [1048576] (decode larger assignments while reading, 0 = disabled)
+   qap.compress disable|enable|<level 1-9> [disable] (enable = level 6)
+   qap.compress.min <size in bytes> [4096]
+   qap.copy.threads <n> [0 = disabled]
+   qap.copy.min <size in bytes> [1048576]
+   prefork <n> [0 = disabled] (unix only, number of idle QAP1 children to keep)
+   listeners <n> [1] (unix with SO_REUSEPORT only, processes accepting on each TCP port)
+   child.reuse <n> [0 = disabled] (max. connections per pre-forked QAP1 child)
+   child.reuse.mem <MB> [0 = no limit] (max. memory growth of a reused child)
+   qap.mux.port <port> [none] (unix only, non-forking QAP1 server, eval/assign/batch/prepare only)
+   max.children <n> [0 = no limit] (unix only, max. number of children per server process)
+   max.queue <n> [0] (connections waiting for a child beyond max.children, others are refused)
+   max.queue.timeout <seconds> [30] (queued connections waiting longer are refused)
+   fork.gc enable|disable [disable] (unix only, full garbage collection before forking children)
+   fork.readonly <size in kB> [0 = disabled] (move large vectors in the global env to read-only memory)
+   zygote enable|disable [disable] (unix only, accept in a separate process that passes connections to R)
+   rsa.key <file> [none = generated by the server]
+   rsa.rotate <seconds> [0 = never] (unix only, interval to replace the generated RSA key)
+   parse.cache <n> [256] (number of parsed eval strings cached per process, 0 = disabled)
    
    cachepwd no|yes|indefinitely
  
@@ -200,6 +220,10 @@ typedef int socklen_t;
 #ifdef FORKED
 #include <sys/wait.h>
 #include <signal.h>
+#include <sys/resource.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
 #endif
 #ifdef ERROR
 #undef ERROR
@@ -221,6 +245,8 @@ extern __declspec(dllimport) int R_SignalHandlers;
 #include "Rsrv.h"
 #include "qap_encode.h"
 #include "qap_decode.h"
+#include "rsmap.h"
+#include "iptrie.h"
 #include "ulog.h"
 #include "md5.h"
 /* we don't bother with sha1.h so this is the declaration */
@@ -229,6 +255,9 @@ void sha1hash(const char *buf, int len, unsigned char hash[20]);
 #ifdef HAVE_CRYPT_H
 #include <crypt.h>
 #endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 #if R_VERSION >= R_Version(2,9,0)
 #include <R_ext/Rdynload.h>
 #endif
@@ -303,6 +332,9 @@ struct args {
     int ucix;
 #ifdef unix
     struct sockaddr_un su;
+#endif
+#ifdef HAVE_IPV6
+    struct sockaddr_in6 sa6; /* peer address on IPv6 servers (instead of sa) */
 #endif
 	char res[128]; /* reserved space for server-specific fields */
 };
@@ -340,6 +372,36 @@ static int close_all_io = 0; /* if enabled all I/O is re-directed to /dev/null
 
 static server_stack_t *background_servers = 0; /* used if servers are run in the background of the current session */
 
+#define PREFORK_MAX 256 /* maximal number of idle pre-forked children */
+static int prefork_size = 0;  /* number of idle pre-forked QAP1 children to keep, 0 = disabled */
+static int prefork_child = 0; /* set in a pre-forked child until it gets a connection */
+static int prefork_pipe[2] = { -1, -1 }; /* pre-forked children report accepted connections to the master */
+static int child_reuse = 0;     /* max. number of connections served by a pre-forked QAP1 child, 0 = one */
+static long child_reuse_mem = 0; /* max. memory growth (in kB) of a reused child, 0 = no limit */
+static int child_reusable = 0;  /* set in a pre-forked child serving a connection it may survive */
+
+#define LISTENERS_MAX 64 /* maximal number of listener processes */
+static int listeners = 1;   /* number of processes accepting on each TCP port (SO_REUSEPORT) */
+static int is_listener = 0; /* index of an additional listener process, 0 in the master */
+
+static int mux_port = -1; /* port of the multiplexed (non-forking) QAP1 server */
+
+static int zygote = 0;      /* accept connections in a separate process and only fork in the server */
+static int zygote_fd = -1;  /* datagram socket between the acceptor and the server (zygote) */
+static int is_acceptor = 0; /* set in the acceptor process */
+
+static int max_children = 0;       /* max. number of children of the server loop, 0 = no limit */
+static int max_queue = 0;          /* max. number of accepted connections waiting for a child */
+static int max_queue_timeout = 30; /* max. time (in seconds) a connection may wait in the queue */
+
+static int fork_gc = 0;          /* collect garbage in the server before children are forked */
+static size_t fork_readonly = 0; /* min. size of vectors moved to read-only memory before forking, 0 = disabled */
+
+static int parse_cache_max = 256; /* max. number of parsed eval strings cached per process, 0 = disabled */
+
+static int sig_pipe[2] = { -1, -1 }; /* self-pipe used by signal handlers to wake up the server loop */
+static int ev_fd = -1; /* epoll descriptor of the server loop */
+
 static int oob_allowed = 0; /* this flag is set once handshake is done such that OOB messages are permitted */
 static int oob_context_prefix = 0; /* if set, context is prepended in OOB
 									  messages sent by Rserve itself */
@@ -380,10 +442,22 @@ int global_srv_flags = 0;
 
 static char *http_user, *https_user, *ws_user;
 
-static char **allowed_ips = 0;
+static iptrie_t *allowed_peers = 0; /* "allow" list, NULL = all peers are allowed */
+
+/* wakes up the server loop, safe to use in signal handlers */
+static void wake_server_loop(void) {
+#ifdef unix
+	if (sig_pipe[1] != -1) {
+		int se = errno;
+		if (write(sig_pipe[1], "", 1) < 1) {} /* if the pipe is full the loop is woken up anyway */
+		errno = se;
+	}
+#endif
+}
 
 void stop_server_loop(void) {
 	active = 0;
+	wake_server_loop();
 }
 
 #include "rsdebug.h"
@@ -912,11 +986,192 @@ static int getpid(void) {
 }
 #endif
 
+/* message compression (CMD_COMPRESSED): 0 = disabled, otherwise
+   the zlib compression level. Bodies shorter than compress_min
+   are always sent uncompressed. */
+static int compress_level = 0;
+static size_t compress_min = 4096;
+
+#ifdef HAVE_ZLIB
+/* zlib counts in uInt so large buffers are fed in chunks */
+#define Z_CHUNK (1024 * 1024 * 1024)
+
+/* deflate sink for compressed responses: collects the compressed
+   stream behind an 8-byte length prefix in zbuf which is kept for
+   the following responses. The output is limited to max bytes
+   (including the prefix) if max is not 0 */
+typedef struct qap1_zsink {
+	z_stream zs;
+	char *buf;
+	size_t size, max;
+} qap1_zsink_t;
+
+/* compression buffers up to this size are kept between responses */
+#define ZBUF_KEEP (1024 * 1024)
+
+static char *zbuf;
+static size_t zbuf_size;
+
+/* starts a sink on zbuf. Returns 0 on success, -1 on error */
+static int QAP1_zsink_init(qap1_zsink_t *zk, size_t max) {
+	memset(zk, 0, sizeof(*zk));
+	if (!zbuf) {
+		if (!(zbuf = (char*) malloc(65536)))
+			return -1;
+		zbuf_size = 65536;
+	}
+	if (deflateInit(&zk->zs, compress_level) != Z_OK)
+		return -1;
+	zk->buf = zbuf;
+	zk->size = zbuf_size;
+	zk->max = max;
+	zk->zs.next_out = (Bytef*) zk->buf + 8;
+	return 0;
+}
+
+/* ends the sink, the buffer is released if it grew beyond ZBUF_KEEP */
+static void QAP1_zsink_done(qap1_zsink_t *zk) {
+	deflateEnd(&zk->zs);
+	if (zk->size > ZBUF_KEEP) {
+		free(zk->buf);
+		zbuf = 0;
+		zbuf_size = 0;
+	} else {
+		zbuf = zk->buf;
+		zbuf_size = zk->size;
+	}
+}
+
+/* feeds len bytes into the sink, finishing the stream if flush is
+   Z_FINISH. Returns 0 on success, -1 on error */
+static int QAP1_zsink_put(qap1_zsink_t *zk, const void *buf, size_t len, int flush) {
+	size_t in_left = len;
+	int zr;
+	zk->zs.next_in = (Bytef*) buf;
+	zk->zs.avail_in = 0;
+	while (1) {
+		if (flush == Z_NO_FLUSH && !in_left && !zk->zs.avail_in)
+			return 0;
+		if (!zk->zs.avail_in && in_left) {
+			zk->zs.avail_in = (in_left > Z_CHUNK) ? Z_CHUNK : in_left;
+			in_left -= zk->zs.avail_in;
+		}
+		if (!zk->zs.avail_out) {
+			size_t used = (char*) zk->zs.next_out - zk->buf;
+			size_t lim = (zk->max && zk->max < zk->size) ? zk->max : zk->size;
+			if (used == lim) {
+				size_t ns = zk->size * 2;
+				char *nb;
+				if (used == zk->max) return -1; /* doesn't fit */
+				if (zk->max && ns > zk->max) ns = zk->max;
+				if (!(nb = (char*) realloc(zk->buf, ns))) return -1;
+				zk->buf = nb;
+				zk->size = lim = ns;
+				zk->zs.next_out = (Bytef*) nb + used;
+			}
+			zk->zs.avail_out = (lim - used > Z_CHUNK) ? Z_CHUNK : (lim - used);
+		}
+		zr = deflate(&zk->zs, in_left ? Z_NO_FLUSH : flush);
+		if (zr == Z_STREAM_END) return 0;
+		if (zr != Z_OK) return -1;
+	}
+}
+
+static ssize_t QAP1_stream_deflate(void *ctx, const void *buf, size_t len) {
+	return QAP1_zsink_put((qap1_zsink_t*) ctx, buf, len, Z_NO_FLUSH) ? -1 : (ssize_t) len;
+}
+
+/* inflate a CMD_COMPRESSED body of length len whose uncompressed
+   length must be below max (unless max is 0). On success returns 0,
+   *dst is a new buffer holding the uncompressed body (with 8 spare
+   bytes at the end as expected by the parameter parser), *dsize its
+   allocated size and *dlen the body length. Otherwise returns the
+   ERR_.. code to send back. */
+static int QAP1_inflate(const char *src, size_t len, size_t max, char **dst, size_t *dsize, size_t *dlen) {
+	z_stream zs;
+	size_t ul, in_left, out_left;
+	char *ub;
+	int zr;
+	if (len < 8)
+		return ERR_inv_par;
+	ul = (size_t) (unsigned int) ptoi(((const unsigned int*) src)[0]);
+#ifdef __LP64__
+	ul |= ((size_t) (unsigned int) ptoi(((const unsigned int*) src)[1])) << 32;
+#else
+	if (((const unsigned int*) src)[1])
+		return ERR_data_overflow;
+#endif
+	if (max && ul >= max)
+		return ERR_data_overflow;
+	*dsize = (ul | 0x1fffL) + 1L; /* use 8kB granularity as the input buffer */
+	if (!(ub = (char*) malloc(*dsize + 8)))
+		return ERR_out_of_mem;
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit(&zs) != Z_OK) {
+		free(ub);
+		return ERR_out_of_mem;
+	}
+	in_left = len - 8;
+	out_left = ul;
+	zs.next_in = (Bytef*) src + 8;
+	zs.next_out = (Bytef*) ub;
+	while (1) {
+		if (!zs.avail_in && in_left) {
+			zs.avail_in = (in_left > Z_CHUNK) ? Z_CHUNK : in_left;
+			in_left -= zs.avail_in;
+		}
+		if (!zs.avail_out && out_left) {
+			zs.avail_out = (out_left > Z_CHUNK) ? Z_CHUNK : out_left;
+			out_left -= zs.avail_out;
+		}
+		zr = inflate(&zs, Z_NO_FLUSH);
+		if (zr == Z_STREAM_END) break;
+		/* Z_BUF_ERROR means no progress: truncated or longer than declared */
+		if (zr != Z_OK) {
+			inflateEnd(&zs);
+			free(ub);
+			return ERR_inv_par;
+		}
+	}
+	inflateEnd(&zs);
+	if ((size_t) ((char*) zs.next_out - ub) != ul) {
+		free(ub);
+		return ERR_inv_par;
+	}
+	*dst = ub;
+	*dlen = ul;
+	return 0;
+}
+#endif
+
+static ssize_t QAP1_stream_sendv(void *ctx, struct iovec *iov, int iovcnt); /* forward decl */
+
 /* send a response including the data part */
 int Rserve_QAP1_send_resp(args_t *arg, int rsp, size_t len, const void *buf) {
 	server_t *srv = arg->srv;
 	struct phdr ph;
 	size_t i = 0;
+#ifdef HAVE_ZLIB
+	if ((QAP_ext & QAPX_COMPRESS) && !(rsp & CMD_COMPRESSED) && len >= compress_min && len > 8) {
+		/* the compressed body must not be longer than the original */
+		qap1_zsink_t zk;
+		if (!QAP1_zsink_init(&zk, len)) {
+			if (!QAP1_zsink_put(&zk, buf, len, Z_FINISH)) {
+				int res;
+				((unsigned int*) zk.buf)[0] = itop((unsigned int) len);
+#ifdef __LP64__
+				((unsigned int*) zk.buf)[1] = itop((unsigned int) (len >> 32));
+#else
+				((unsigned int*) zk.buf)[1] = 0;
+#endif
+				res = Rserve_QAP1_send_resp(arg, rsp | CMD_COMPRESSED, (char*) zk.zs.next_out - zk.buf, zk.buf);
+				QAP1_zsink_done(&zk);
+				return res;
+			}
+			QAP1_zsink_done(&zk);
+		}
+	}
+#endif
 	/* do not tag OOB with CMD_RESP */
 	if (!(rsp & CMD_OOB)) rsp |= CMD_RESP;
     ph.cmd = itop(rsp);	
@@ -955,7 +1210,16 @@ int Rserve_QAP1_send_resp(args_t *arg, int rsp, size_t len, const void *buf) {
 		}
 	}
 #endif
-    
+
+	if (srv->sendv && len <= max_sio_chunk) { /* header and body in one call */
+		struct iovec iov[2];
+		iov[0].iov_base = (char*) &ph;
+		iov[0].iov_len = sizeof(ph);
+		iov[1].iov_base = (char*) buf;
+		iov[1].iov_len = len;
+		return (QAP1_stream_sendv(arg, iov, len ? 2 : 1) < 0) ? -1 : 0;
+	}
+
     if (srv->send(arg, (char*)&ph, sizeof(ph)) < 0)
 		return -1;
 	
@@ -969,6 +1233,240 @@ int Rserve_QAP1_send_resp(args_t *arg, int rsp, size_t len, const void *buf) {
 	return 0;
 }
 
+#ifdef FORKED
+/* Pipelined QAP1 requests
+
+   Children serving plain (non-TLS) QAP1 connections read ahead: a
+   receive of less than QAP1_RBUF_SIZE bytes fetches whatever the
+   client has sent so far, so requests sent without waiting for the
+   responses are taken from memory without further recv() calls. While
+   more input is buffered the TCP socket is corked, so the responses to
+   such a batch leave in as few packets as possible, the cork is removed
+   before the child waits for input again. Responses are sent in the
+   order of the requests and carry their msg.id. */
+#define QAP1_RBUF_SIZE 65536
+
+static char *qap1_rbuf;
+static size_t qap1_rpos, qap1_rlen; /* unread input is qap1_rbuf[rpos..rlen) */
+static int qap1_corked;
+
+static void qap1_cork(args_t *arg, int on) {
+	if (qap1_corked == on)
+		return;
+	qap1_corked = on;
+#ifdef TCP_CORK
+	if (!arg->srv->unix_socket)
+		setsockopt(arg->s, IPPROTO_TCP, TCP_CORK, (const char*) &on, sizeof(on));
+#endif
+}
+
+static ssize_t qap1_recv(args_t *arg, void *buf, size_t len) {
+	size_t avail = qap1_rlen - qap1_rpos;
+	if (avail < len && len < QAP1_RBUF_SIZE) {
+		/* refill - short reads are completed so they cannot split a header */
+		if (avail && qap1_rpos)
+			memmove(qap1_rbuf, qap1_rbuf + qap1_rpos, avail);
+		qap1_rpos = 0;
+		qap1_rlen = avail;
+		qap1_cork(arg, 0); /* the client may be waiting for our responses */
+		while (qap1_rlen < len) {
+			ssize_t n = recv(arg->s, qap1_rbuf + qap1_rlen, QAP1_RBUF_SIZE - qap1_rlen, 0);
+			if (n < 1) {
+				if (!qap1_rlen)
+					return n;
+				break;
+			}
+			qap1_rlen += n;
+		}
+		avail = qap1_rlen;
+	}
+	if (!avail) { /* large reads go directly to the caller */
+		qap1_cork(arg, 0);
+		return recv(arg->s, buf, len, 0);
+	}
+	if (len > avail)
+		len = avail;
+	memcpy(buf, qap1_rbuf + qap1_rpos, len);
+	qap1_rpos += len;
+	qap1_cork(arg, (qap1_rpos < qap1_rlen) ? 1 : 0);
+	return (ssize_t) len;
+}
+
+/* enables pipelining on a new connection */
+static void qap1_pipeline(args_t *arg) {
+	if (!qap1_rbuf && !(qap1_rbuf = (char*) malloc(QAP1_RBUF_SIZE)))
+		return;
+	qap1_rpos = qap1_rlen = 0;
+	qap1_corked = 0;
+	arg->srv->recv = qap1_recv;
+}
+
+/* discards buffered input when the connection goes away (detached sessions) */
+static void qap1_drop(void) {
+	qap1_rpos = qap1_rlen = 0;
+	qap1_corked = 0;
+}
+
+/* ends pipelining before CMD_switch replaces the I/O methods, fails if
+   the client has already sent more (plain) input */
+static int qap1_unpipeline(args_t *arg) {
+	if (arg->srv->recv != qap1_recv)
+		return 0;
+	if (qap1_rpos < qap1_rlen)
+		return -1;
+	qap1_cork(arg, 0);
+	qap1_drop();
+	return 0;
+}
+#endif
+
+static ssize_t QAP1_stream_send(void *ctx, const void *buf, size_t len) {
+	args_t *arg = (args_t*) ctx;
+	size_t i = 0;
+	while (i < len) {
+		ssize_t rs = arg->srv->send(arg, (char*)buf + i, (len - i > max_sio_chunk) ? max_sio_chunk : (len - i));
+		if (rs < 1)
+			return -1;
+		i += rs;
+	}
+	return (ssize_t) len;
+}
+
+static ssize_t QAP1_stream_sendv(void *ctx, struct iovec *iov, int iovcnt) {
+	args_t *arg = (args_t*) ctx;
+	size_t total = 0;
+	while (iovcnt > 0) {
+		ssize_t rs = arg->srv->sendv(arg, iov, iovcnt);
+		if (rs < 1)
+			return -1;
+		total += rs;
+		/* skip what was sent and adjust the first partially sent segment */
+		while (iovcnt > 0 && (size_t) rs >= iov->iov_len) {
+			rs -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0 && rs > 0) {
+			iov->iov_base = (char*) iov->iov_base + rs;
+			iov->iov_len -= rs;
+		}
+	}
+	return (ssize_t) total;
+}
+
+/* prepares qs for streaming x through the (bounded) buffer cbuf of
+   size cbuf_size and returns the encoded size of x. The node sizes
+   are kept in qs, so QAP1_send_sized() doesn't have to walk the object
+   again. Returns -1 if x cannot be encoded, qs is released in that case */
+static rlen_t QAP1_size_sexp(args_t *arg, qap_stream_t *qs, SEXP x, char *cbuf, rlen_t cbuf_size) {
+	rlen_t sl;
+	QAP_stream_init(qs, cbuf, cbuf_size, QAP1_stream_send, arg);
+	/* if the server supports gather send then vector payloads are sent
+	   straight from R memory without copying */
+	if (arg->srv->sendv)
+		QAP_stream_sendv(qs, QAP1_stream_sendv);
+	sl = QAP_stream_size(qs, x);
+	if (sl < 0)
+		QAP_stream_free(qs);
+	return sl;
+}
+
+/* sends a response with a DT_SEXP body by streaming x (of size sl as
+   returned by QAP1_size_sexp()) through the stream buffer and releases
+   qs. Returns 0 on success, -1 if nothing was sent and -2 if sending
+   failed (the connection is no longer usable). */
+static int QAP1_send_sized(args_t *arg, int rsp, qap_stream_t *qs, SEXP x, rlen_t sl) {
+	struct phdr ph;
+	rlen_t len;
+	unsigned int dh[2];
+	int dhl = 4;
+
+	/* DT_SEXP parameter header */
+	if (sl > 0xfffff0) {
+		dh[0] = itop(SET_PAR(DT_SEXP | DT_LARGE, sl & 0xffffff));
+		dh[1] = itop(sl >> 24);
+		dhl = 8;
+	} else
+		dh[0] = itop(SET_PAR(DT_SEXP, sl));
+	len = sl + dhl;
+
+#ifdef HAVE_ZLIB
+	/* compressed responses are deflated chunk by chunk into memory,
+	   so only the compressed body has to be held as a whole */
+	if ((QAP_ext & QAPX_COMPRESS) && len >= compress_min) {
+		qap1_zsink_t zk;
+		if (!QAP1_zsink_init(&zk, 0)) {
+			int res;
+			/* re-target the sized stream at the sink */
+			qs->send = QAP1_stream_deflate;
+			qs->sendv = 0;
+			qs->ctx = &zk;
+			if (QAP_stream_put(qs, dh, dhl) ||
+				QAP_stream_store(qs, x) ||
+				QAP_stream_flush(qs) ||
+				QAP1_zsink_put(&zk, 0, 0, Z_FINISH)) {
+				QAP1_zsink_done(&zk);
+				QAP_stream_free(qs);
+				return -1;
+			}
+			QAP_stream_free(qs);
+			((unsigned int*) zk.buf)[0] = itop((unsigned int) len);
+#ifdef __LP64__
+			((unsigned int*) zk.buf)[1] = itop((unsigned int) (len >> 32));
+#else
+			((unsigned int*) zk.buf)[1] = 0;
+#endif
+			ulog("QAP1: compressed streamed response %ld -> %ld bytes", (long) len, (long) ((char*) zk.zs.next_out - zk.buf));
+			res = Rserve_QAP1_send_resp(arg, rsp | CMD_COMPRESSED, (char*) zk.zs.next_out - zk.buf, zk.buf);
+			QAP1_zsink_done(&zk);
+			return res ? -2 : 0;
+		}
+	}
+#endif
+
+	if (!(rsp & CMD_OOB)) rsp |= CMD_RESP;
+	ph.cmd = itop(rsp);
+	ph.len = itop(len);
+#ifdef __LP64__
+	ph.res = itop(len >> 32);
+#else
+	ph.res = 0;
+#endif
+	ph.msg_id = (int) arg->msg_id;
+	ulog("QAP1: streaming response 0x%08x, length %ld, msg.id 0x%x", ph.cmd, (long) len, ph.msg_id);
+#ifdef RSERV_DEBUG
+	printf("OUT.sendSEXP\nHEAD ");
+	printDump(&ph,sizeof(ph));
+	printf("BODY (streamed, %ld bytes in chunks of %ld)\n", (long) len, (long) qs->buf_size);
+#endif
+
+	if (QAP_stream_put(qs, &ph, sizeof(ph)) ||
+		QAP_stream_put(qs, dh, dhl) ||
+		QAP_stream_store(qs, x) ||
+		QAP_stream_flush(qs)) {
+		QAP_stream_free(qs);
+		ulog("ERROR: failed to stream response");
+		return -2;
+	}
+	QAP_stream_free(qs);
+	return 0;
+}
+
+/* send a response with a DT_SEXP body by streaming the encoded SEXP
+   through the (bounded) buffer cbuf of size cbuf_size, so the encoded
+   object never has to fit into memory as a whole. Only valid for
+   servers that use Rserve_QAP1_send_resp since it writes directly
+   to srv->send. Returns 0 on success, -1 if the object could not be
+   sized (nothing was sent) and -2 if sending failed (the connection
+   is no longer usable). */
+int Rserve_QAP1_send_sexp(args_t *arg, int rsp, SEXP x, char *cbuf, rlen_t cbuf_size) {
+	qap_stream_t qs;
+	rlen_t sl = QAP1_size_sexp(arg, &qs, x, cbuf, cbuf_size);
+	if (sl < 0)
+		return -1;
+	return QAP1_send_sized(arg, rsp, &qs, x, sl);
+}
+
 /* initial ID string */
 char *IDstring="Rsrv0103QAP1\r\n\r\n--------------\r\n";
 
@@ -980,6 +1478,14 @@ int usePlain = 0;
 /* max. size of the input buffer (per connection) */
 size_t maxInBuf = 256 * (1024 * 1024); /* default is 256MB */
 
+/* if set, large numeric vectors in CMD_set/assignSEXP are not copied
+   but reference the input buffer which is then handed over to R */
+static int zerocopy_decode = 0;
+
+/* CMD_set/assignSEXP payloads of at least this size are decoded while
+   they are read instead of being loaded into the input buffer, 0 = never */
+static size_t stream_assign_min = 1048576;
+
 /* if non-zero then the password file is loaded before client su so it can be unreadable by the clients */
 int cache_pwd = 0;
 char *pwd_cache;
@@ -1034,6 +1540,8 @@ static int random_uid_low = 32768, random_uid_high = 65530;
 static int use_idle_callback = 0;
 
 #ifdef HAVE_RSA
+static int rsa_key_file = 0; /* set if the key was loaded from rsa.key */
+static int rsa_rotate = 0;   /* interval (in seconds) to replace a generated key, 0 = never */
 static int rsa_load_key(const char *buf);
 #endif
 
@@ -1057,6 +1565,7 @@ static int chkres1(const char *cmd, int res) {
 
 static int performConfig(int when) {
 	int fail = 0;
+	QAP_seq_max = maxInBuf; /* expanded sequences are bounded like input */
 	if (oob_console && !enable_oob) {
 		RSEprintf("WARNING: oob.console is enabled, but oob is disabled, that won't work - disabling console\n");
 		oob_console = 0;
@@ -1175,6 +1684,11 @@ static int setConfig(const char *c, const char *p) {
 		use_msg_id = conf_is_true(p);
 		return 1;
 	}
+	if (!strcmp(c, "parse.cache")) {
+		int n = satoi(p);
+		parse_cache_max = (n > 0) ? n : 0;
+		return 1;
+	}
 	if (!strcmp(c, "remote")) {
 		localonly = !conf_is_true(p);
 		return 1;
@@ -1206,6 +1720,95 @@ static int setConfig(const char *c, const char *p) {
 		switch_qap_tls = conf_is_true(p);
 		return 1;
 	}
+	if (!strcmp(c, "qap.zerocopy")) {
+		zerocopy_decode = conf_is_true(p);
+		return 1;
+	}
+	if (!strcmp(c, "qap.stream.min")) {
+		long sm = atol(p);
+		stream_assign_min = (sm > 0) ? ((size_t) sm) : 0;
+		return 1;
+	}
+	if (!strcmp(c, "qap.compress")) {
+#ifdef HAVE_ZLIB
+		if (*p >= '1' && *p <= '9' && !p[1])
+			compress_level = *p - '0';
+		else
+			compress_level = conf_is_true(p) ? 6 : 0;
+#else
+		if (conf_is_true(p) || (*p >= '1' && *p <= '9'))
+			RSEprintf("WARNING: qap.compress specified but compression is not supported in this build!\n");
+#endif
+		return 1;
+	}
+	if (!strcmp(c, "qap.compress.min")) {
+		long cm = atol(p);
+		compress_min = (cm < 64) ? 64 : ((size_t) cm);
+		return 1;
+	}
+	if (!strcmp(c, "qap.copy.threads")) {
+		int ct = atoi(p);
+#ifdef WITH_THREADS
+		QAP_copy_threads = (ct < 0) ? 0 : ((ct > QAP_COPY_MAX_THREADS) ? QAP_COPY_MAX_THREADS : ct);
+#else
+		if (ct > 1)
+			RSEprintf("WARNING: qap.copy.threads specified but threads are not supported in this build!\n");
+#endif
+		return 1;
+	}
+	if (!strcmp(c, "qap.copy.min")) {
+		long cm = atol(p);
+		QAP_copy_min = (cm < 65536) ? 65536 : ((rlen_t) cm);
+		return 1;
+	}
+	if (!strcmp(c, "prefork")) {
+		int pf = atoi(p);
+#ifdef FORKED
+		prefork_size = (pf < 0) ? 0 : ((pf > PREFORK_MAX) ? PREFORK_MAX : pf);
+#else
+		if (pf > 0)
+			RSEprintf("WARNING: prefork specified but forking is not supported in this build!\n");
+#endif
+		return 1;
+	}
+	if (!strcmp(c, "child.reuse")) {
+		int cr = atoi(p);
+#ifdef FORKED
+		child_reuse = (cr > 1) ? cr : 0;
+#else
+		if (cr > 1)
+			RSEprintf("WARNING: child.reuse specified but forking is not supported in this build!\n");
+#endif
+		return 1;
+	}
+	if (!strcmp(c, "child.reuse.mem")) {
+		long cm = atol(p);
+		child_reuse_mem = (cm > 0) ? (cm * 1024L) : 0;
+		return 1;
+	}
+	if (!strcmp(c, "listeners")) {
+		int ln = atoi(p);
+#if defined FORKED && defined SO_REUSEPORT
+		listeners = (ln < 1) ? 1 : ((ln > LISTENERS_MAX) ? LISTENERS_MAX : ln);
+		if (listeners > 1)
+			global_srv_flags |= SRV_REUSEPORT;
+		else
+			global_srv_flags &= ~ SRV_REUSEPORT;
+#else
+		if (ln > 1)
+			RSEprintf("WARNING: listeners specified but SO_REUSEPORT is not supported in this build!\n");
+#endif
+		return 1;
+	}
+	if (!strcmp(c, "zygote")) {
+#ifdef FORKED
+		zygote = conf_is_true(p);
+#else
+		if (conf_is_true(p))
+			RSEprintf("WARNING: zygote specified but forking is not supported in this build!\n");
+#endif
+		return 1;
+	}
 	if (!strcmp(c, "qap.oc") || !strcmp(c, "rserve.oc")) {
 		qap_oc = conf_is_true(p);
 		return 1;
@@ -1376,12 +1979,23 @@ static int setConfig(const char *c, const char *p) {
 					buf[n] = 0;
 					if (rsa_load_key(buf) == -1)
 						RSEprintf("ERROR: not a valid RSA private key in '%s'\n", p);
+					else
+						rsa_key_file = 1;
 				} else RSEprintf("ERROR: cannot allocate memory for the RSA key\n");
 				fclose(f);
 			} else RSEprintf("ERROR: cannot open rsa.key file '%s'\n", p);
 		}
 #else
 		RSEprintf("WARNING: rsa.key specified but RSA is not supported in this build!\n");
+#endif
+		return 1;
+	}
+	if (!strcmp(c, "rsa.rotate")) {
+#ifdef HAVE_RSA
+		int n = atoi(p);
+		rsa_rotate = (n > 0) ? n : 0;
+#else
+		RSEprintf("WARNING: rsa.rotate specified but RSA is not supported in this build!\n");
 #endif
 		return 1;
 	}
@@ -1392,6 +2006,45 @@ static int setConfig(const char *c, const char *p) {
 		}
 		return 1;
 	}
+	if (!strcmp(c, "max.children")) {
+#ifdef FORKED
+		int n = satoi(p);
+		max_children = (n > 0) ? n : 0;
+#else
+		RSEprintf("WARNING: max.children specified but forking is not supported in this build!\n");
+#endif
+		return 1;
+	}
+	if (!strcmp(c, "max.queue")) {
+		int n = satoi(p);
+		max_queue = (n > 0) ? n : 0;
+		return 1;
+	}
+	if (!strcmp(c, "max.queue.timeout")) {
+		int n = satoi(p);
+		max_queue_timeout = (n > 0) ? n : 0;
+		return 1;
+	}
+	if (!strcmp(c, "fork.gc")) {
+		fork_gc = conf_is_true(p);
+		return 1;
+	}
+	if (!strcmp(c, "fork.readonly")) {
+		int n = satoi(p);
+		fork_readonly = (n > 0) ? (((size_t) n) * 1024) : 0;
+		return 1;
+	}
+	if (!strcmp(c, "qap.mux.port")) {
+#ifdef unix
+		if (*p) {
+			int np = satoi(p);
+			if (np > 0) mux_port = np;
+		}
+#else
+		RSEprintf("WARNING: qap.mux.port specified but multiplexed connections are not supported in this build!\n");
+#endif
+		return 1;
+	}
 	if (!strcmp(c,"https.port") || !strcmp(c, "http.tls.port")) {
 		if (*p) {
 			int np = satoi(p);
@@ -1506,20 +2159,14 @@ static int setConfig(const char *c, const char *p) {
 	}
 #endif
 	if (!strcmp(c,"allow") && *p) {
-		char **l;
-		if (!allowed_ips) {
-			allowed_ips = (char**) malloc(sizeof(char*)*128);
-			*allowed_ips = 0;
-		}
-		l = allowed_ips;
-		while (*l) l++;
-		if (l - allowed_ips >= 127) {
-			RSEprintf("WARNING: Maximum of allowed IPs (127) exceeded, ignoring 'allow %s'\n", p);
+		/* the list is created even if the entry is invalid, so only listed peers are allowed */
+		if (!allowed_peers && !(allowed_peers = iptrie_new())) {
+			RSEprintf("ERROR: cannot allocate the list of allowed peers\n");
+			return -1;
+		}
+		if (iptrie_add(allowed_peers, p)) {
+			RSEprintf("WARNING: invalid address or prefix, ignoring 'allow %s'\n", p);
 			return -1;
-		} else {
-			*l = strdup(p);
-			l++;
-			*l = 0;
 		}
 		return 1;
 	}
@@ -1697,7 +2344,14 @@ static int loadConfig(const char *fn)
    therefore we start with a small buffer and allocate more if necessary
 */
 
-static size_t inBuf = 32768; /* 32kB should be ok unless CMD_assign sends large data */
+#define initInBuf 32768
+static size_t inBuf = initInBuf; /* 32kB should be ok unless CMD_assign sends large data */
+
+static void free_in_buf(SEXP ref) {
+	void *p = R_ExternalPtrAddr(ref);
+	if (p) free(p);
+	R_ClearExternalPtr(ref);
+}
 
 /* static buffer size used for file transfer.
    The user is still free to allocate its own size  */
@@ -1710,6 +2364,12 @@ static int lastChild;
 static void sigHandler(int i) {
     if (i==SIGTERM || i==SIGHUP)
 		active = 0;
+	wake_server_loop();
+}
+
+/* children are reaped by the server loop, we only need to wake it up */
+static void chldHandler(int i) {
+	wake_server_loop();
 }
 
 static void brkHandler(int i) {
@@ -1719,6 +2379,7 @@ static void brkHandler(int i) {
 	Rprintf("Caught break signal, shutting down Rserve.\n");
 #endif
     active = 0;
+	wake_server_loop();
     /* kill(getpid(), SIGUSR1); */
 }
 #endif
@@ -1763,6 +2424,211 @@ SEXP parseExps(char *s, int exps, ParseStatus *status) {
     return pr;
 }
 
+/* Parse cache ("parse.cache")
+
+   Strings of CMD_eval/CMD_voidEval are parsed through a per-process
+   LRU cache keyed by the text and the string encoding, so clients
+   sending the same expressions over and over only pay for parsing
+   once. The parsed expressions are kept in the slots of a preserved
+   list, entry i uses slot i. Expressions registered with CMD_prepare
+   are kept in a separate list of the connection (at most PREPARED_MAX),
+   the handle is the 1-based index in that list. */
+
+#define PCACHE_MAX_TEXT 65536 /* longer strings are not cached */
+#define PREPARED_MAX     1024 /* prepared expressions per connection */
+
+#ifdef USE_ENCODING
+#define PCACHE_ENC ((int) string_encoding)
+#else
+#define PCACHE_ENC 0
+#endif
+
+typedef struct pcache_ent {
+	unsigned int hash;
+	int enc;   /* string_encoding the text was parsed with */
+	int parts;
+	char *text;
+	struct pcache_ent *hnext, *prev, *next;
+} pcache_ent_t;
+
+static pcache_ent_t *pcache_ent, **pcache_hash, *pcache_head, *pcache_tail;
+static int pcache_len, pcache_hsize;
+static SEXP pcache_store;
+static double pcache_hits, pcache_misses;
+
+typedef struct prepared {
+	SEXP exps; /* preserved list of prepared expressions */
+	int len;
+} prepared_t;
+
+/* prepared expressions of the connection being served */
+static prepared_t qap1_prepared, *prepared = &qap1_prepared;
+
+static unsigned int pcache_hash_str(const char *s, size_t len) {
+	unsigned int h = 2166136261u; /* FNV-1a */
+	while (len--)
+		h = (h ^ (unsigned char) *(s++)) * 16777619u;
+	return h;
+}
+
+static int pcache_init(void) {
+	pcache_hsize = 64;
+	while (pcache_hsize < parse_cache_max * 2)
+		pcache_hsize <<= 1;
+	pcache_ent = (pcache_ent_t*) calloc(parse_cache_max, sizeof(pcache_ent_t));
+	pcache_hash = (pcache_ent_t**) calloc(pcache_hsize, sizeof(pcache_ent_t*));
+	if (!pcache_ent || !pcache_hash) {
+		free(pcache_ent);
+		free(pcache_hash);
+		pcache_ent = 0;
+		pcache_hash = 0;
+		return -1;
+	}
+	R_PreserveObject(pcache_store = allocVector(VECSXP, parse_cache_max));
+	return 0;
+}
+
+static void pcache_unlink(pcache_ent_t *e) {
+	if (e->prev) e->prev->next = e->next; else pcache_head = e->next;
+	if (e->next) e->next->prev = e->prev; else pcache_tail = e->prev;
+}
+
+static void pcache_push(pcache_ent_t *e) {
+	e->prev = 0;
+	e->next = pcache_head;
+	if (pcache_head) pcache_head->prev = e; else pcache_tail = e;
+	pcache_head = e;
+}
+
+/* like parseString(), but uses the parse cache. The result may be
+   shared with later calls, so it must not be modified. It must be
+   protected by the caller like any other result since subsequent
+   parses can evict it from the cache */
+SEXP parseStringCached(const char *s, int *parts, ParseStatus *status) {
+	size_t len = strlen(s);
+	unsigned int h;
+	int enc = PCACHE_ENC;
+	pcache_ent_t *e, **b;
+	SEXP xp;
+
+	if (parse_cache_max < 1 || len > PCACHE_MAX_TEXT || (!pcache_ent && pcache_init()))
+		return parseString(s, parts, status);
+	h = pcache_hash_str(s, len);
+	b = pcache_hash + (h & (pcache_hsize - 1));
+	for (e = *b; e; e = e->hnext)
+		if (e->hash == h && e->enc == enc && !strcmp(e->text, s)) {
+			pcache_hits++;
+			if (e != pcache_head) {
+				pcache_unlink(e);
+				pcache_push(e);
+			}
+			*parts = e->parts;
+			*status = PARSE_OK;
+			return VECTOR_ELT(pcache_store, e - pcache_ent);
+		}
+	pcache_misses++;
+	xp = PROTECT(parseString(s, parts, status));
+	if (*status == PARSE_OK) {
+		char *text = (char*) malloc(len + 1);
+		if (text) {
+			if (pcache_len < parse_cache_max)
+				e = pcache_ent + pcache_len++;
+			else { /* evict the least recently used entry */
+				pcache_ent_t **pe = pcache_hash + (pcache_tail->hash & (pcache_hsize - 1));
+				e = pcache_tail;
+				while (*pe != e) pe = &((*pe)->hnext);
+				*pe = e->hnext;
+				pcache_unlink(e);
+				free(e->text);
+			}
+			memcpy(text, s, len + 1);
+			e->text = text;
+			e->hash = h;
+			e->enc = enc;
+			e->parts = *parts;
+			e->hnext = *b;
+			*b = e;
+			pcache_push(e);
+			SET_VECTOR_ELT(pcache_store, e - pcache_ent, xp);
+		}
+	}
+	UNPROTECT(1);
+	return xp;
+}
+
+/* drops all prepared expressions of a connection */
+static void prepared_clear(prepared_t *p) {
+	if (p->exps)
+		R_ReleaseObject(p->exps);
+	p->exps = 0;
+	p->len = 0;
+}
+
+/* CMD_prepare: parses s and returns the handle of the expressions,
+   0 if the parse failed (see status) or -1 if the connection has
+   PREPARED_MAX expressions already. The same text yields the same
+   handle as long as it is in the parse cache */
+static int prepare_exps(const char *s, ParseStatus *status) {
+	int parts = 0, i;
+	SEXP xp = PROTECT(parseStringCached(s, &parts, status));
+	if (*status != PARSE_OK) {
+		UNPROTECT(1);
+		return 0;
+	}
+	for (i = 0; i < prepared->len; i++)
+		if (VECTOR_ELT(prepared->exps, i) == xp) {
+			UNPROTECT(1);
+			return i + 1;
+		}
+	if (prepared->len >= PREPARED_MAX) {
+		UNPROTECT(1);
+		return -1;
+	}
+	if (!prepared->exps || prepared->len == LENGTH(prepared->exps)) {
+		SEXP np = allocVector(VECSXP, prepared->exps ? LENGTH(prepared->exps) * 2 : 16);
+		R_PreserveObject(np);
+		for (i = 0; i < prepared->len; i++)
+			SET_VECTOR_ELT(np, i, VECTOR_ELT(prepared->exps, i));
+		if (prepared->exps)
+			R_ReleaseObject(prepared->exps);
+		prepared->exps = np;
+	}
+	SET_VECTOR_ELT(prepared->exps, prepared->len++, xp);
+	UNPROTECT(1);
+	return prepared->len;
+}
+
+/* returns the expressions of a CMD_prepare handle or NULL if invalid */
+static SEXP prepared_exps(int handle) {
+	return (handle > 0 && handle <= prepared->len) ? VECTOR_ELT(prepared->exps, handle - 1) : 0;
+}
+
+/* evaluates parsed expressions in env, stops at the first error.
+   Returns the value of the last one */
+static SEXP eval_exps(SEXP xp, SEXP env, int *Rerror) {
+	SEXP val = R_NilValue;
+	int bi = 0;
+	*Rerror = 0;
+	if (TYPEOF(xp) != EXPRSXP)
+		return R_tryEval(xp, env, Rerror);
+	while (bi < LENGTH(xp) && !*Rerror)
+		val = R_tryEval(VECTOR_ELT(xp, bi++), env, Rerror);
+	return val;
+}
+
+/* R API: parse cache statistics of the current process */
+SEXP Rserve_parse_stats(void) {
+	const char *nam[] = { "entries", "max.entries", "prepared", "hits", "misses", "" };
+	SEXP res = mkNamed(REALSXP, nam);
+	double *v = REAL(res);
+	v[0] = pcache_len;
+	v[1] = parse_cache_max;
+	v[2] = prepared->len;
+	v[3] = pcache_hits;
+	v[4] = pcache_misses;
+	return res;
+}
+
 void voidEval(const char *cmd) {
     ParseStatus stat;
     int Rerror;
@@ -1809,14 +2675,163 @@ void voidEval(const char *cmd) {
     return;
 }
 
-#define sendRespData(A, C, L, D) srv->send_resp(A, C, L, D)
-#define sendResp(A,C) srv->send_resp(A, C, 0, 0)
-
-struct sockaddr_in session_peer_sa;
-SOCKET session_socket;
-unsigned char session_key[32];
+/* CMD_batch (see Rsrv.h) */
 
-/* detach session and setup everything such that in can be resumed at some point */
+typedef struct batch_par {
+	int type;
+	size_t len;
+	char *ptr;
+} batch_par_t;
+
+/* reads the parameter at *c (not beyond end) into p and advances *c,
+   returns 0 if there is no valid parameter */
+static int batch_next(char **c, char *end, batch_par_t *p) {
+	unsigned int phead;
+	size_t hs = 4;
+	if (*c + 4 > end || !(phead = ptoi(*((unsigned int*) *c))))
+		return 0;
+	p->type = PAR_TYPE(phead);
+	p->len = PAR_LEN(phead);
+	if (p->type & DT_LARGE) {
+		if (*c + 8 > end)
+			return 0;
+		hs = 8;
+		p->len |= ((size_t) (unsigned int) ptoi(((unsigned int*) *c)[1])) << 24;
+		p->type ^= DT_LARGE;
+	}
+	if (p->len > (size_t) (end - *c) - hs)
+		return 0;
+	p->ptr = *c + hs;
+	*c = p->ptr + p->len;
+	return 1;
+}
+
+/* reads one sub-command with its parameters, returns 0 if malformed */
+static int batch_item(char **c, char *end, int *cmd, batch_par_t *par) {
+	batch_par_t p;
+	if (!batch_next(c, end, &p) || p.type != DT_INT || p.len < 4)
+		return 0;
+	*cmd = ptoi(*((unsigned int*) p.ptr));
+	switch (*cmd) {
+	case CMD_voidEval:
+	case CMD_eval:
+		return batch_next(c, end, par) && (par[0].type == DT_STRING || par[0].type == DT_SEXP);
+	case CMD_setSEXP:
+	case CMD_assignSEXP:
+		return batch_next(c, end, par) && par[0].type == DT_STRING &&
+			batch_next(c, end, par + 1) && (par[1].type == DT_STRING || par[1].type == DT_SEXP);
+	}
+	return 0;
+}
+
+/* decodes a DT_STRING or DT_SEXP parameter, returns NULL on failure */
+static SEXP batch_value(batch_par_t *p) {
+	SEXP val;
+	if (p->type == DT_SEXP) {
+		unsigned int *sptr = (unsigned int*) p->ptr;
+		return QAP_decode(&sptr);
+	}
+	val = PROTECT(allocVector(STRSXP, 1));
+	SET_STRING_ELT(val, 0, mkRChar(p->ptr));
+	UNPROTECT(1);
+	return val;
+}
+
+/* runs all sub-commands of a CMD_batch payload in env. Returns the
+   list of results with the "status" attribute or NULL if the payload
+   is malformed, in which case nothing is run */
+static SEXP QAP1_batch(char *buf, size_t len, SEXP env) {
+	char *c = buf, *end = buf + len;
+	batch_par_t fl, par[2];
+	SEXP res, st;
+	int flags, cmd, n = 0, i, failed = 0;
+
+	if (!batch_next(&c, end, &fl) || fl.type != DT_INT || fl.len < 4)
+		return 0;
+	flags = ptoi(*((unsigned int*) fl.ptr));
+	/* validate all items first */
+	while (c < end && ptoi(*((unsigned int*) c))) {
+		if (!batch_item(&c, end, &cmd, par))
+			return 0;
+		n++;
+	}
+
+	res = PROTECT(allocVector(VECSXP, n));
+	st = PROTECT(allocVector(INTSXP, n));
+	c = fl.ptr + fl.len;
+	for (i = 0; i < n; i++) {
+		int code = 0, Rerror = 0;
+		batch_item(&c, end, &cmd, par);
+		if (failed && !(flags & BATCH_CONTINUE)) {
+			INTEGER(st)[i] = NA_INTEGER;
+			continue;
+		}
+		if (cmd == CMD_eval || cmd == CMD_voidEval) {
+			SEXP val = R_NilValue;
+			if (par[0].type == DT_SEXP) {
+				SEXP x = batch_value(par);
+				if (!x)
+					code = ERR_inv_par;
+				else {
+					PROTECT(x);
+					val = R_tryEval(x, env, &Rerror);
+					UNPROTECT(1);
+				}
+			} else {
+				ParseStatus stat;
+				int j = 0;
+				SEXP xp = PROTECT(parseStringCached(par[0].ptr, &j, &stat));
+				if (stat != 1)
+					code = stat;
+				else
+					val = eval_exps(xp, env, &Rerror);
+				UNPROTECT(1);
+			}
+			if (Rerror)
+				code = ((Rerror < 0) ? Rerror : -Rerror) & 127;
+			else if (!code && cmd == CMD_eval && val)
+				SET_VECTOR_ELT(res, i, val);
+		} else { /* CMD_setSEXP, CMD_assignSEXP */
+			SEXP sym = 0, val;
+			if (cmd == CMD_assignSEXP) {
+				ParseStatus stat;
+				sym = parseExps(par[0].ptr, 1, &stat);
+				if (stat != 1)
+					code = stat;
+				else {
+					if (TYPEOF(sym) == EXPRSXP && LENGTH(sym) > 0)
+						sym = VECTOR_ELT(sym, 0);
+					if (TYPEOF(sym) != SYMSXP)
+						code = ERR_inv_par;
+				}
+			} else
+				sym = install(par[0].ptr);
+			if (!code) {
+				PROTECT(sym);
+				if (!(val = batch_value(par + 1)))
+					code = ERR_inv_par;
+				else
+					defineVar(sym, val, env);
+				UNPROTECT(1);
+			}
+		}
+		INTEGER(st)[i] = code;
+		if (code)
+			failed = 1;
+	}
+	setAttrib(res, install("status"), st);
+	UNPROTECT(2);
+	return res;
+}
+
+#define sendRespData(A, C, L, D) srv->send_resp(A, C, L, D)
+#define sendResp(A,C) srv->send_resp(A, C, 0, 0)
+
+struct sockaddr_in session_peer_sa;
+SOCKET session_socket;
+unsigned char session_key[32];
+
+/* detach session and setup everything such that in can be resumed at some point */
 int detach_session(args_t *arg) {
     SAIN ssa;
 	SOCKET s = arg->s;
@@ -1885,6 +2900,9 @@ int detach_session(args_t *arg) {
 	memcpy(dsr.key, session_key, 32);							
 	
 	sendRespData(arg, RESP_OK, 3*sizeof(int)+32, &dsr);
+#ifdef FORKED
+	qap1_drop();
+#endif
 	closesocket(s);
 #ifdef RSERV_DEBUG
 	printf("session: detached, closing connection.\n");
@@ -1946,6 +2964,161 @@ typedef struct child_process {
 
 child_process_t *children;
 
+#ifdef FORKED
+static int nchildren; /* number of entries in children */
+
+/* the server loop keeps track of its children for admission control (max.children) */
+static void child_add(pid_t pid) {
+	child_process_t *cp = (child_process_t*) malloc(sizeof(child_process_t));
+	if (!cp) return;
+	cp->pid = pid;
+	cp->prev = 0;
+	cp->next = children;
+	if (children) children->prev = cp;
+	children = cp;
+	nchildren++;
+}
+
+/* returns 1 if pid was a tracked child */
+static int child_remove(pid_t pid) {
+	child_process_t *cp = children;
+	while (cp && cp->pid != pid)
+		cp = cp->next;
+	if (!cp) return 0;
+	if (cp->prev) cp->prev->next = cp->next; else children = cp->next;
+	if (cp->next) cp->next->prev = cp->prev;
+	free(cp);
+	nchildren--;
+	return 1;
+}
+
+/* forked processes don't own the children of their parent */
+static void child_forget_all(void) {
+	while (children) {
+		child_process_t *cp = children;
+		children = cp->next;
+		free(cp);
+	}
+	nchildren = 0;
+}
+
+static int children_full(void) {
+	return (max_children > 0 && nchildren >= max_children) ? 1 : 0;
+}
+#endif
+
+/* memory of the current process in kB: resident, proportional (Pss),
+   shared and private as reported by /proc/self/smaps_rollup (or smaps
+   on kernels before 4.14). Returns 0 on success, -1 if unavailable */
+static int proc_mem(long *rss, long *pss, long *shared, long *priv) {
+#ifdef __linux__
+	char line[256];
+	FILE *f = fopen("/proc/self/smaps_rollup", "r");
+	if (!f && !(f = fopen("/proc/self/smaps", "r")))
+		return -1;
+	*rss = *pss = *shared = *priv = 0;
+	/* smaps has one block per mapping, so we simply add them all up */
+	while (fgets(line, sizeof(line), f)) {
+		char *c = strchr(line, ':');
+		long kb;
+		if (!c || sscanf(c + 1, "%ld", &kb) != 1)
+			continue;
+		*c = 0;
+		if (!strcmp(line, "Rss"))
+			*rss += kb;
+		else if (!strcmp(line, "Pss"))
+			*pss += kb;
+		else if (!strncmp(line, "Shared_", 7))
+			*shared += kb;
+		else if (!strncmp(line, "Private_", 8))
+			*priv += kb;
+	}
+	fclose(f);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+static void ulog_proc_mem(const char *who) {
+	long rss, pss, shared, priv;
+	if (ulog_enabled() && !proc_mem(&rss, &pss, &shared, &priv))
+		ulog("INFO: %s %d memory: rss %ld kB, pss %ld kB, shared %ld kB, private %ld kB",
+			 who, (int) getpid(), rss, pss, shared, priv);
+}
+
+/* R API: memory of the current process (see proc_mem) */
+SEXP Rserve_memory_stats(void) {
+	const char *nam[] = { "rss", "pss", "shared", "private", "" };
+	SEXP res = mkNamed(REALSXP, nam);
+	long v[4];
+	int i;
+	if (proc_mem(v, v + 1, v + 2, v + 3))
+		for (i = 0; i < 4; i++) REAL(res)[i] = NA_REAL;
+	else
+		for (i = 0; i < 4; i++) REAL(res)[i] = (double) v[i];
+	return res;
+}
+
+#ifdef FORKED
+/* moves large vectors in x (recursing into lists) to read-only memory,
+   returns the (possibly new) object */
+static SEXP map_readonly(SEXP x, int depth, long *moved) {
+	if (TYPEOF(x) == VECSXP) {
+		R_xlen_t i, n = XLENGTH(x);
+		if (depth < 16)
+			for (i = 0; i < n; i++) {
+				SEXP e = VECTOR_ELT(x, i), m = map_readonly(e, depth + 1, moved);
+				if (m != e)
+					SET_VECTOR_ELT(x, i, m);
+			}
+		return x;
+	}
+	{
+		SEXP m = RS_map_copy(x, fork_readonly);
+		if (m != x)
+			(*moved)++;
+		return m;
+	}
+}
+
+/* prepares the heap of the server before children are forked ("fork.gc",
+   "fork.readonly"): large vectors are moved to read-only mappings which
+   stay shared by all children and a full collection leaves the remaining
+   objects in the oldest generation, so the children's minor collections
+   don't touch (and thus un-share) their pages */
+static void prepare_fork_heap(void) {
+	if (fork_readonly) {
+		SEXP nm = PROTECT(R_lsInternal(R_GlobalEnv, TRUE));
+		long moved = 0;
+		int i;
+		for (i = 0; i < LENGTH(nm); i++) {
+			SEXP sym = install(CHAR(STRING_ELT(nm, i))), val, m;
+			if (R_BindingIsActive(sym, R_GlobalEnv) || R_BindingIsLocked(sym, R_GlobalEnv))
+				continue;
+			val = findVarInFrame(R_GlobalEnv, sym);
+			if (TYPEOF(val) == PROMSXP)
+				continue;
+			PROTECT(val);
+			m = map_readonly(val, 0, &moved);
+			if (m != val) {
+				PROTECT(m);
+				defineVar(sym, m, R_GlobalEnv);
+				UNPROTECT(1);
+			}
+			UNPROTECT(1);
+		}
+		UNPROTECT(1);
+		ulog("INFO: moved %ld vector(s) to read-only memory", moved);
+	}
+	/* R needs repeated collections to promote survivors to the oldest generation */
+	R_gc();
+	R_gc();
+	R_gc();
+	ulog_proc_mem("server");
+}
+#endif
+
 /* handling of the password file - we emulate stdio API but allow both
    file and buffer back-ends transparently */
 typedef struct pwdf {
@@ -2040,6 +3213,10 @@ static int send_oob_sexp(int cmd, SEXP exp) {
 			/* first we have 4 bytes of a header saying this is an encoded SEXP, then comes the SEXP */
 			char *sxh = sendbuf + 8;
 			char *tail = (char*)QAP_storeSEXP((unsigned int*)sxh, exp, rs);
+			if (!tail) {
+				free(sendbuf);
+				Rf_error("Unable to encode R object");
+			}
 
 			/* set type to DT_SEXP and correct length */
 			if ((tail - sxh) > 0xfffff0) { /* we must use the "long" format */
@@ -2213,6 +3390,8 @@ static SEXP Rserve_oobMsg_(SEXP exp, SEXP code, int throw_error) {
 				/* FIXME: we should use R allocation for orb since it will leak if there is an error in any allocation in decoding --- but we can't do the before reading since it would fail to read the stream in case of an error - so we're stuck a bit ... */
 				res = QAP_decode(&hi);
 				free(orb);
+				if (!res && throw_error)
+					Rf_error("invalid object in OOB msg response");
 				return res;
 			}
 		}
@@ -2246,26 +3425,16 @@ int RS_fork(args_t *arg) {
 void finishBackgroundServerLoop(void);
 static void restore_signal_handlers(void); /* forward decl */
 
-/* return 0 if the child was prepared. Returns the result of fork() is forked and this is the parent */
-int Rserve_prepare_child(args_t *args) {
-#ifdef FORKED  
-	long rseed = random();
-
-    rseed ^= time(0);
-
-	if (is_child) return 0; /* this is a no-op if we are already a child
-							   FIXME: thould this be an error ? */
-
-    if ((lastChild = RS_fork(args)) != 0) { /* parent/master part */
-		int forkErrno = errno; //grab errno close to source before it can be changed by other failures
-		/* close the connection socket - the child has it already */
-		closesocket(args->s);
-		if (lastChild == -1)
-			RSEprintf("WARNING: fork() failed in Rserve_prepare_child(): %s\n",strerror(forkErrno));
-		return lastChild;
-    }
+#ifdef FORKED
+static void mux_drop(void); /* forward decl */
+#ifdef HAVE_RSA
+static void keygen_drop(void); /* forward decl */
+#endif
 
-	/* child part */
+/* child part of Rserve_prepare_child() that doesn't depend on the connection.
+   It runs right after fork() for regular children, but ahead of time
+   (before accept()) for pre-forked children */
+static void child_init(long rseed) {
 	if (background_servers) /* backgroud servers cannot be processed the child */
 		finishBackgroundServerLoop(); /* this implies restore_signal_handlers */
 	else
@@ -2278,17 +3447,85 @@ int Rserve_prepare_child(args_t *args) {
 	srandom(rseed);
     
     parentPID = getppid();
-    close_all_srv_sockets(); /* close all server sockets - this includes arg->ss */
+	if (prefork_pipe[0] != -1) { /* only the master reads from the pool pipe */
+		close(prefork_pipe[0]);
+		prefork_pipe[0] = -1;
+	}
+	/* the server loop descriptors belong to the master */
+	if (ev_fd != -1) {
+		close(ev_fd);
+		ev_fd = -1;
+	}
+	if (sig_pipe[0] != -1) {
+		close(sig_pipe[0]);
+		close(sig_pipe[1]);
+		sig_pipe[0] = sig_pipe[1] = -1;
+	}
+	if (zygote_fd != -1) { /* only used between the acceptor and the server */
+		close(zygote_fd);
+		zygote_fd = -1;
+	}
+#ifdef HAVE_RSA
+	keygen_drop(); /* the current RSA key is all we need */
+#endif
+	mux_drop(); /* multiplexed connections are served by the parent */
+	child_forget_all();
 	ulog("INFO: new child process %d (parent %d)", (int) getpid(), (int) parentPID);
 
+	performConfig(SU_CLIENT);
+}
+
+/* connection-specific part of Rserve_prepare_child(). A child that may be
+   recycled (child.reuse) keeps the pool sockets and pipe for the next connection */
+static void child_attach(args_t *args, int recyclable) {
+	if (!recyclable) {
+		close_all_srv_sockets(); /* close all server sockets - this includes arg->ss */
+		if (prefork_pipe[1] != -1) {
+			close(prefork_pipe[1]);
+			prefork_pipe[1] = -1;
+		}
+	}
+
 #ifdef CAN_TCP_NODELAY
     {
      	int opt = 1;
         setsockopt(args->s, IPPROTO_TCP, TCP_NODELAY, (const char*) &opt, sizeof(opt));
     }
 #endif
+}
+#endif
 
-	performConfig(SU_CLIENT);
+/* return 0 if the child was prepared. Returns the result of fork() is forked and this is the parent */
+int Rserve_prepare_child(args_t *args) {
+#ifdef FORKED  
+	long rseed = random();
+
+    rseed ^= time(0);
+
+	if (is_child) {
+		if (!prefork_child)
+			return 0; /* this is a no-op if we are already a child
+						 FIXME: thould this be an error ? */
+		/* pre-forked child: child_init() was already done by prefork_run() */
+		prefork_child = 0;
+		/* only plain QAP1 children are recycled, see child_recycle() */
+		child_reusable = (child_reuse && !(args->srv->flags & SRV_QAP_OC)) ? 1 : 0;
+	} else {
+		if ((lastChild = RS_fork(args)) != 0) { /* parent/master part */
+			int forkErrno = errno; //grab errno close to source before it can be changed by other failures
+			/* close the connection socket - the child has it already */
+			closesocket(args->s);
+			if (lastChild == -1)
+				RSEprintf("WARNING: fork() failed in Rserve_prepare_child(): %s\n",strerror(forkErrno));
+			else if (!background_servers) /* reaped by the server loop */
+				child_add(lastChild);
+			return lastChild;
+		}
+
+		/* child part */
+		child_init(rseed);
+	}
+	child_attach(args, child_reusable);
 
 #endif
 
@@ -2715,6 +3952,8 @@ char *get_workdir(void) {
 
 static void setup_workdir(void) {
 #ifdef unix
+	if (is_child && child_workdir) /* already done in a pre-forked child */
+		return;
     if (workdir) {
 		if (chdir(workdir) && mkdir(workdir, wdt_mode)) {}
 		/* we override umask for the top-level
@@ -3041,6 +4280,8 @@ void Rserve_OCAP_connected(void *thp) {
 
 	setup_workdir();
 
+	QAP_ext = 0; /* OCAP clients cannot negotiate extensions */
+
 	/* setup TLS if desired */
 	if ((args->srv->flags & SRV_TLS) && shared_tls(0)) {
 		char cn[256];
@@ -3145,20 +4386,24 @@ void Rserve_OCAP_connected(void *thp) {
 			char *tail = (char*)QAP_storeSEXP((unsigned int*)sxh, oc, rs);
 			
 			UNPROTECT(1);
-			/* set type to DT_SEXP and correct length */
-			if ((tail - sxh) > 0xfffff0) { /* we must use the "long" format */
-				rlen_t ll = tail - sxh;
-				((unsigned int*)rt->buf)[0] = itop(SET_PAR(DT_SEXP | DT_LARGE, ll & 0xffffff));
-				((unsigned int*)rt->buf)[1] = itop(ll >> 24);
-				sendhead = rt->buf;
-			} else {
-				sendhead = rt->buf + 4;
-				((unsigned int*)rt->buf)[1] = itop(SET_PAR(DT_SEXP,tail - sxh));
-			}
+			if (!tail) /* cannot encode the object */
+				sendResp(args, SET_STAT(RESP_ERR, ERR_out_of_mem));
+			else {
+				/* set type to DT_SEXP and correct length */
+				if ((tail - sxh) > 0xfffff0) { /* we must use the "long" format */
+					rlen_t ll = tail - sxh;
+					((unsigned int*)rt->buf)[0] = itop(SET_PAR(DT_SEXP | DT_LARGE, ll & 0xffffff));
+					((unsigned int*)rt->buf)[1] = itop(ll >> 24);
+					sendhead = rt->buf;
+				} else {
+					sendhead = rt->buf + 4;
+					((unsigned int*)rt->buf)[1] = itop(SET_PAR(DT_SEXP,tail - sxh));
+				}
 #ifdef RSERV_DEBUG
-			printf("stored SEXP; length=%ld (incl. DT_SEXP header)\n",(long) (tail - sendhead));
+				printf("stored SEXP; length=%ld (incl. DT_SEXP header)\n",(long) (tail - sendhead));
 #endif
-			sendRespData(args, CMD_OCinit, tail - sendhead, sendhead);
+				sendRespData(args, CMD_OCinit, tail - sendhead, sendhead);
+			}
 		}
 	}
 
@@ -3234,6 +4479,15 @@ ssize_t server_send(args_t *arg, const void *buf, size_t len) {
 	return send(arg->s, buf, len, 0);
 }
 
+ssize_t server_sendv(args_t *arg, const struct iovec *iov, int iovcnt) {
+#ifdef WIN32
+	/* no writev() - just send the first segment, callers have to handle partial sends anyway */
+	return send(arg->s, iov->iov_base, iov->iov_len, 0);
+#else
+	return writev(arg->s, iov, iovcnt);
+#endif
+}
+
 SEXP Rserve_kill_compute(SEXP sSig) {
 #ifdef unix
 	int sig = asInteger(sSig);
@@ -3269,6 +4523,7 @@ SEXP Rserve_fork_compute(SEXP sExp) {
 		srv->fin       = server_fin;
 		srv->recv      = server_recv;
 		srv->send      = server_send;
+		srv->sendv     = server_sendv;
 		srv->ss        = -1;
 
 		close(fd[0]);
@@ -3355,9 +4610,12 @@ SEXP Rserve_fork_compute(SEXP sExp) {
 				sptr = ibuf + ((par_t & DT_LARGE) ? 2 : 1);
 				/* FIXME: we're not checking the size?!? */
 				res = QAP_decode(&sptr);
-				ulog("INFO: OCAP compute fork result successfully decoded");
 				free(buf);
-				return res;
+				if (res) {
+					ulog("INFO: OCAP compute fork result successfully decoded");
+					return res;
+				}
+				ulog("ERROR: cannot decode the result of the forked compute process");
 			}
 		}
 		ulog("ERROR: Invalid response from forked compute process");
@@ -3776,6 +5034,36 @@ int OCAP_iteration(qap_runtime_t *rt, struct phdr *oob_hdr) {
 				if (Rerror) {
 					sendResp(args, SET_STAT(RESP_ERR, (Rerror < 0) ? Rerror : -Rerror));
 					return 1;
+				} else if (srv->send_resp == Rserve_QAP1_send_resp) {
+					/* size the result once and stream it through the buffer,
+					   so no buffer has to hold the whole encoded object */
+					qap_stream_t qs;
+					rlen_t rs = QAP1_size_sexp(args, &qs, exp, rt->buf, rt->buf_size);
+					int sr;
+					if (rs < 0) { /* just in case there is encoding error */
+						sendResp(args, SET_STAT(RESP_ERR, ERR_inv_par));
+						return 1;
+					}
+#ifdef RSERV_DEBUG
+					printf("result storage size = %ld bytes (buffer %ld bytes)\n",(long)rs, (long)rt->buf_size);
+#endif
+					if (maxSendBufSize && rs + 4160L > rt->buf_size && rs + 4160L > maxSendBufSize) {
+						unsigned int osz = (rs > 0xffffffff) ? 0xffffffff : rs;
+						osz = itop(osz);
+						QAP_stream_free(&qs);
+						ulog("WARNING: object too big to send");
+						sendRespData(args, SET_STAT(RESP_ERR, ERR_object_too_big), 4, &osz);
+						return 1;
+					}
+					sr = QAP1_send_sized(args, RESP_OK, &qs, exp, rs);
+					if (eval_result) UNPROTECT(1); /* exp / eval_result */
+					if (sr == -1)
+						sendResp(args, SET_STAT(RESP_ERR, ERR_out_of_mem));
+					else if (sr == -2) { /* partial response, the connection is unusable */
+						closesocket(s);
+						args->s = -1;
+						return 0;
+					}
 				} else {
 					char *sendhead = 0;
 					size_t tempSB = 0;
@@ -3844,20 +5132,24 @@ int OCAP_iteration(qap_runtime_t *rt, struct phdr *oob_hdr) {
 						char *sxh = rt->buf + 8;
 						char *tail = (char*)QAP_storeSEXP((unsigned int*)sxh, exp, rs);
 						
-						/* set type to DT_SEXP and correct length */
-						if ((tail - sxh) > 0xfffff0) { /* we must use the "long" format */
-							rlen_t ll = tail - sxh;
-							((unsigned int*)rt->buf)[0] = itop(SET_PAR(DT_SEXP | DT_LARGE, ll & 0xffffff));
-							((unsigned int*)rt->buf)[1] = itop(ll >> 24);
-							sendhead = rt->buf;
-						} else {
-							sendhead = rt->buf + 4;
-							((unsigned int*)rt->buf)[1] = itop(SET_PAR(DT_SEXP,tail - sxh));
-						}
+						if (!tail) /* cannot encode the object */
+							sendResp(args, SET_STAT(RESP_ERR, ERR_out_of_mem));
+						else {
+							/* set type to DT_SEXP and correct length */
+							if ((tail - sxh) > 0xfffff0) { /* we must use the "long" format */
+								rlen_t ll = tail - sxh;
+								((unsigned int*)rt->buf)[0] = itop(SET_PAR(DT_SEXP | DT_LARGE, ll & 0xffffff));
+								((unsigned int*)rt->buf)[1] = itop(ll >> 24);
+								sendhead = rt->buf;
+							} else {
+								sendhead = rt->buf + 4;
+								((unsigned int*)rt->buf)[1] = itop(SET_PAR(DT_SEXP,tail - sxh));
+							}
 #ifdef RSERV_DEBUG
-						printf("stored SEXP; length=%ld (incl. DT_SEXP header)\n",(long) (tail - sendhead));
+							printf("stored SEXP; length=%ld (incl. DT_SEXP header)\n",(long) (tail - sendhead));
 #endif
-						sendRespData(args, RESP_OK, tail - sendhead, sendhead);
+							sendRespData(args, RESP_OK, tail - sendhead, sendhead);
+						}
 						if (tempSB) { /* if this is just a temporary sendbuffer then shrink it back to normal */
 #ifdef RSERV_DEBUG
 							printf("Releasing temporary sendbuf and restoring old size of %ld bytes.\n", (long) rt->buf_size);
@@ -3893,8 +5185,153 @@ int OCAP_iteration(qap_runtime_t *rt, struct phdr *oob_hdr) {
 	return 0;
 }
 
+/* Streaming assignments ("qap.stream.min")
+
+   Large CMD_setSEXP/CMD_assignSEXP payloads are not loaded into the
+   input buffer, the object is decoded as it is read from the
+   connection (see QAP_decode_stream), so the upload only needs as
+   much memory as the resulting object. Only authenticated connections
+   stream. The payload is not limited by maxinbuf, only parts of the
+   object that have to be buffered (e.g. names and large character
+   vectors) are. Values other than DT_SEXP are left to the buffered
+   path. */
+
+typedef struct stream_src {
+	args_t *a;
+	size_t left;  /* bytes of the message that have not been read yet */
+	int broken;   /* set if the connection failed */
+} stream_src_t;
+
+static int stream_src_read(void *ctx, void *buf, rlen_t len) {
+	stream_src_t *src = (stream_src_t*) ctx;
+	server_t *srv = src->a->srv;
+	char *c = (char*) buf;
+	if (len > src->left)
+		return -1;
+	while (len > 0) {
+		int n = srv->recv(src->a, c, (len > max_sio_chunk) ? max_sio_chunk : len);
+		if (n < 1) {
+			src->broken = 1;
+			return -1;
+		}
+		c += n;
+		len -= n;
+		src->left -= n;
+	}
+	return 0;
+}
+
+/* reads and discards the rest of the message */
+static int stream_src_drain(stream_src_t *src) {
+	char tmp[8192];
+	while (src->left && !src->broken)
+		stream_src_read(src, tmp, (src->left > sizeof(tmp)) ? sizeof(tmp) : src->left);
+	return src->broken ? -1 : 0;
+}
+
+#define STREAM_FALLBACK 1 /* see QAP1_stream_assign() */
+
+/* reads a CMD_setSEXP/CMD_assignSEXP payload of plen bytes from the
+   connection and performs the assignment. Returns 0 on success, the
+   error code to send or -1 if the connection is broken. If the value
+   is not a DT_SEXP nothing is assigned and STREAM_FALLBACK is returned,
+   *pre is then set to the pre_len bytes of the payload that have been
+   read already (allocated with malloc) */
+static int QAP1_stream_assign(args_t *a, int cmd, size_t plen, char **pre, size_t *pre_len) {
+	stream_src_t src;
+	unsigned int ph[2];
+	char *hd, *name;
+	size_t nl, hl;
+	int code = 0, pt;
+	rlen_t pl;
+	SEXP sym = 0, val;
+
+	src.a = a;
+	src.left = plen;
+	src.broken = 0;
+	/* name of the symbol */
+	if (stream_src_read(&src, ph, 4))
+		return stream_src_drain(&src) ? -1 : ERR_inv_par;
+	nl = PAR_LEN(ptoi(ph[0]));
+	if (PAR_TYPE(ptoi(ph[0])) != DT_STRING || nl > src.left)
+		return stream_src_drain(&src) ? -1 : ERR_inv_par;
+	/* hd keeps everything up to the value header for the fallback */
+	if (!(hd = (char*) malloc(nl + 13)))
+		return stream_src_drain(&src) ? -1 : ERR_out_of_mem;
+	memcpy(hd, ph, 4);
+	name = hd + 4;
+	if (stream_src_read(&src, name, nl)) {
+		free(hd);
+		return -1;
+	}
+	hl = nl + 4;
+
+	/* header of the value */
+	pt = 0;
+	pl = 0;
+	if (!stream_src_read(&src, hd + hl, 4)) {
+		memcpy(ph, hd + hl, 4);
+		hl += 4;
+		pt = PAR_TYPE(ptoi(ph[0]));
+		pl = PAR_LEN(ptoi(ph[0]));
+		if (pt == (DT_SEXP | DT_LARGE)) {
+			pt = 0;
+			if (!stream_src_read(&src, hd + hl, 4)) {
+				memcpy(ph + 1, hd + hl, 4);
+				hl += 4;
+				pl |= ((rlen_t) (unsigned int) ptoi(ph[1])) << 24;
+				pt = DT_SEXP;
+			}
+		}
+	}
+	if (src.broken) {
+		free(hd);
+		return -1;
+	}
+	if (pt != DT_SEXP || pl > src.left) {
+		*pre = hd;
+		*pre_len = hl;
+		return STREAM_FALLBACK;
+	}
+	name[nl] = 0;
+#ifdef RSERV_DEBUG
+	printf(">>CMD_set/assignREXP (%s, REXP) streamed, %ld bytes\n", name, (long) plen);
+#endif
+	if (cmd == CMD_assignSEXP) {
+		ParseStatus stat;
+		sym = parseExps(name, 1, &stat);
+		if (stat != 1)
+			code = stat;
+		else if (TYPEOF(sym) == EXPRSXP && LENGTH(sym) > 0)
+			sym = VECTOR_ELT(sym, 0);
+	} else
+		sym = install(name);
+	free(hd);
+
+	/* the object */
+	if (!code) {
+		PROTECT(sym);
+		val = QAP_decode_stream(stream_src_read, &src, pl, maxInBuf);
+		if (!val)
+			code = ERR_inv_par;
+		else {
+			PROTECT(val);
+			defineVar(sym, val, R_GlobalEnv);
+			UNPROTECT(1);
+		}
+		UNPROTECT(1);
+	}
+	if (stream_src_drain(&src))
+		return -1;
+	return code;
+}
+
 /* working thread/function. the parameter is of the type struct args* */
 /* This server function implements the Rserve QAP1 protocol */
+#ifdef FORKED
+static int child_recycle(void);
+#endif
+
 void Rserve_QAP1_connected(void *thp) {
     SOCKET s;
     struct args *a = (struct args*)thp;
@@ -3905,6 +5342,7 @@ void Rserve_QAP1_connected(void *thp) {
     int process;
 	int rn;
 	int uses_tls = 0;
+	int conn_lost = 0; /* set if a response could only be sent partially */
     ParseStatus stat;
     char *sendbuf;
     size_t sendBufSize;
@@ -3913,6 +5351,9 @@ void Rserve_QAP1_connected(void *thp) {
     int Rerror;
     int authed=0;
     int unaligned=0;
+    int scode;
+    char *pre = 0; /* payload read ahead by QAP1_stream_assign() */
+    size_t pre_len = 0;
 #ifdef HAS_CRYPT
     char salt[5];
 #endif
@@ -3954,6 +5395,10 @@ void Rserve_QAP1_connected(void *thp) {
 
 	setup_workdir();
 
+	QAP_ext = 0; /* extensions are per-connection */
+	prepared = &qap1_prepared;
+	prepared_clear(prepared);
+
     sendBufSize = sndBS;
     sendbuf = (char*) malloc(sendBufSize);
 #ifdef RSERV_DEBUG
@@ -3976,6 +5421,10 @@ void Rserve_QAP1_connected(void *thp) {
 		}
 		uses_tls = 1;
 	}
+#ifdef FORKED
+	else if (srv->recv == server_recv || srv->recv == qap1_recv)
+		qap1_pipeline(a);
+#endif
 
 	{
 		strcpy(buf,IDstring);
@@ -4002,6 +5451,13 @@ void Rserve_QAP1_connected(void *thp) {
 			memcpy(ep, "TLS\n", 4);
 		}
 #endif
+#ifdef HAVE_ZLIB
+		if (compress_level) {
+			char *ep = buf + 16;
+			while (ep < buf + 28 && *ep != '-') ep += 4;
+			if (ep < buf + 28) memcpy(ep, "CMzl", 4);
+		}
+#endif
 #ifdef RSERV_DEBUG
 		printf("sending ID string.\n");
 #endif
@@ -4015,7 +5471,7 @@ void Rserve_QAP1_connected(void *thp) {
 		SEXP eval_result = 0;
 		size_t plen = 0;
 		SEXP pp = R_NilValue; /* packet payload (as a raw vector) for special commands */
-		int msg_id;
+		int msg_id, compressed;
 		Rerror = 0;
 #ifdef RSERV_DEBUG
 		printf("\nheader read result: %d\n", rn);
@@ -4023,6 +5479,8 @@ void Rserve_QAP1_connected(void *thp) {
 #endif
 		ph.len = ptoi(ph.len);
 		ph.cmd = ptoi(ph.cmd);
+		compressed = (ph.cmd & CMD_COMPRESSED) ? 1 : 0;
+		ph.cmd &= ~CMD_COMPRESSED;
 #ifdef __LP64__
 		ph.res = ptoi(ph.res);
 		plen = (unsigned int) ph.len;
@@ -4077,6 +5535,29 @@ void Rserve_QAP1_connected(void *thp) {
 				if (rn > 0) i += rn;
 				if (i >= plen || rn < 1) break;
 			}
+			if (compressed && i >= plen) {
+				int zerr = ERR_unavailable;
+#ifdef HAVE_ZLIB
+				char *ub;
+				size_t ul, us;
+				if (compress_level && !(zerr = QAP1_inflate(pbuf, plen, maxInBuf, &ub, &us, &ul))) {
+					pp = allocVector(RAWSXP, ul);
+					memcpy(RAW(pp), ub, ul);
+					free(ub);
+				}
+#endif
+				if (zerr) {
+					sendResp(a, SET_STAT(RESP_ERR, zerr));
+					process = 1; ph.cmd = 0;
+				}
+			}
+		} else if (plen > 0 && !compressed && stream_assign_min && plen >= stream_assign_min &&
+				   (authed || !authReq) && (ph.cmd == CMD_setSEXP || ph.cmd == CMD_assignSEXP) &&
+				   (scode = QAP1_stream_assign(a, ph.cmd, plen, &pre, &pre_len)) != STREAM_FALLBACK) {
+			if (scode < 0) break; /* connection broken */
+			a->msg_id = msg_id;
+			sendResp(a, scode ? SET_STAT(RESP_ERR, scode) : RESP_OK);
+			process = 1; ph.cmd = 0;
 		} else if (plen > 0) {
 			unsigned int phead;
 			int parType = 0;
@@ -4106,7 +5587,13 @@ void Rserve_QAP1_connected(void *thp) {
 				printf("loading buffer (awaiting %ld bytes)\n",(long) plen);
 #endif
 				i = 0;
-				while ((rn = srv->recv(a, ((char*)buf) + i, (plen - i > max_sio_chunk) ? max_sio_chunk : (plen - i)))) {
+				if (pre) { /* already read by QAP1_stream_assign() */
+					memcpy(buf, pre, pre_len);
+					i = pre_len;
+					free(pre);
+					pre = 0;
+				}
+				while (i < plen && (rn = srv->recv(a, ((char*)buf) + i, (plen - i > max_sio_chunk) ? max_sio_chunk : (plen - i)))) {
 #ifdef RSERV_DEBUG
 					printf(" [2] rn = %d (i = %ld)\n", rn, (long) i);
 #endif
@@ -4126,6 +5613,24 @@ void Rserve_QAP1_connected(void *thp) {
 #endif
 
 				if (i < plen) break;
+
+				if (compressed) {
+					int zerr = ERR_unavailable;
+#ifdef HAVE_ZLIB
+					char *ub;
+					size_t ul, us;
+					if (compress_level && !(zerr = QAP1_inflate(buf, plen, maxInBuf, &ub, &us, &ul))) {
+						free(buf);
+						buf = ub;
+						inBuf = us;
+						plen = ul;
+					}
+#endif
+					if (zerr) {
+						sendResp(a, SET_STAT(RESP_ERR, zerr));
+						process = 1; ph.cmd = 0; plen = 0;
+					}
+				}
 				memset(buf + plen, 0, 8);
 		
 				unaligned = 0;
@@ -4169,7 +5674,12 @@ void Rserve_QAP1_connected(void *thp) {
 			} else {
 				RSEprintf("WARNING: discarding buffer because too big (awaiting %ld bytes)\n", (long)plen);
 				size_t i = plen, chk = (inBuf < max_sio_chunk) ? inBuf : max_sio_chunk;
-				while((rn = srv->recv(a, (char*)buf, (i < chk) ? i : chk))) {
+				if (pre) {
+					i -= pre_len;
+					free(pre);
+					pre = 0;
+				}
+				while(i > 0 && (rn = srv->recv(a, (char*)buf, (i < chk) ? i : chk))) {
 					if (rn > 0) i -= rn;
 					if (i < 1 || rn < 1) break;
 				}
@@ -4248,6 +5758,11 @@ void Rserve_QAP1_connected(void *thp) {
 			else {
 				c = (char*) parP[0];
 				if (!strcmp(c, "TLS")) {
+#ifdef FORKED
+					if (qap1_unpipeline(a))
+						sendResp(a, SET_STAT(RESP_ERR, ERR_inv_cmd));
+					else
+#endif
 					if (switch_qap_tls && shared_tls(0)) {
 						sendResp(a, RESP_OK);
 						add_tls(a, shared_tls(0), 1);
@@ -4410,6 +5925,11 @@ void Rserve_QAP1_connected(void *thp) {
 			sendResp(a, SET_STAT(RESP_ERR, ERR_unsupportedCmd));
 		}
 
+		if (ph.cmd == CMD_memStats) { /* sent back like an eval result */
+			process = 1;
+			eval_result = Rserve_memory_stats();
+		}
+
 		if (ph.cmd == CMD_setEncoding) { /* set string encoding */
 			process = 1;
 			if (pars<1 || parT[0] != DT_STRING) 
@@ -4430,6 +5950,22 @@ void Rserve_QAP1_connected(void *thp) {
 			}
 		}
 
+		if (ph.cmd == CMD_setQAPExt) { /* enable QAP extensions */
+			process = 1;
+			if (pars < 1 || parT[0] != DT_INT)
+				sendResp(a, SET_STAT(RESP_ERR, ERR_inv_par));
+			else {
+				unsigned int ext[2];
+				QAP_ext = ptoi(((unsigned int*)(parP[0]))[0]) & (QAPX_SEQ | QAPX_STR_DICT | (compress_level ? QAPX_COMPRESS : 0));
+#ifdef RSERV_DEBUG
+				printf(">>CMD_setQAPExt 0x%x\n", QAP_ext);
+#endif
+				ext[0] = itop(SET_PAR(DT_INT, sizeof(int)));
+				ext[1] = itop(QAP_ext);
+				sendRespData(a, RESP_OK, sizeof(ext), ext);
+			}
+		}
+
 		if (ph.cmd == CMD_setBufferSize) {
 			process = 1;
 			/* FIXME: configuration allows 64-bit numbers but CMD_setBufferSize does not */
@@ -4626,7 +6162,31 @@ void Rserve_QAP1_connected(void *thp) {
 								advance the pointer and don't care about the length */
 				case DT_SEXP:
 					sptr = ((unsigned int*)parP[1]) + boffs;
-					val = QAP_decode(&sptr);
+					if (zerocopy_decode && plen >= QAP_REF_MIN) {
+						int refs = 0;
+						SEXP owner = PROTECT(R_MakeExternalPtr(buf, R_NilValue, R_NilValue));
+						R_RegisterCFinalizer(owner, free_in_buf);
+						val = QAP_decode_ref(&sptr, inBuf, owner, &refs);
+						if (refs) { /* the input buffer now belongs to the decoded object */
+#ifdef RSERV_DEBUG
+							printf("  input buffer handed over to %d vector(s), allocating a new one\n", refs);
+#endif
+							inBuf = initInBuf;
+							buf = (char*) malloc(inBuf + 8);
+							if (!buf) {
+								RSEprintf("FATAL: out of memory while allocating input buffer\n");
+								sendResp(a, SET_STAT(RESP_ERR, ERR_out_of_mem));
+								free(sendbuf); free(sfbuf);
+								if (uses_tls) close_tls(a);
+								closesocket(s);
+								free(a);
+								return;
+							}
+						} else
+							R_ClearExternalPtr(owner);
+						UNPROTECT(1);
+					} else
+						val = QAP_decode(&sptr);
 					if (val == 0)
 						sendResp(a, SET_STAT(RESP_ERR, ERR_inv_par));
 					else {
@@ -4700,15 +6260,57 @@ void Rserve_QAP1_connected(void *thp) {
 			}
 		}
 
-		if (ph.cmd == CMD_voidEval || ph.cmd == CMD_eval || ph.cmd == CMD_detachedVoidEval) {
-			int is_large = (parT[0] & DT_LARGE) ? 1 : 0;
-			if (is_large) parT[0] ^= DT_LARGE;
+		if (ph.cmd == CMD_batch) {
 			process = 1;
-			if (pars < 1 || (parT[0] != DT_STRING && parT[0] != DT_SEXP))
+			if (!plen || !(eval_result = QAP1_batch(buf, plen, R_GlobalEnv)))
 				sendResp(a, SET_STAT(RESP_ERR, ERR_inv_par));
-			else if (parT[0] == DT_SEXP) {
-				unsigned int *sptr = ((unsigned int*)parP[0]) + is_large;
-				SEXP val = QAP_decode(&sptr);
+			a->msg_id = msg_id; /* just in case R-side used OOB */
+		}
+
+		if (ph.cmd == CMD_prepare) {
+			process = 1;
+			if (pars < 1 || parT[0] != DT_STRING)
+				sendResp(a, SET_STAT(RESP_ERR, ERR_inv_par));
+			else {
+				int h = prepare_exps((char*) parP[0], &stat);
+#ifdef RSERV_DEBUG
+				printf(">>CMD_prepare: handle %d, stat=%d\n", h, stat);
+#endif
+				if (h < 1)
+					sendResp(a, SET_STAT(RESP_ERR, h ? ERR_out_of_mem : stat));
+				else {
+					unsigned int hr[2];
+					hr[0] = itop(SET_PAR(DT_INT, sizeof(int)));
+					hr[1] = itop(h);
+					sendRespData(a, RESP_OK, sizeof(hr), hr);
+				}
+			}
+		}
+
+		if (ph.cmd == CMD_execPrepared) {
+			SEXP xp = 0;
+			process = 1;
+			if (pars < 1 || parT[0] != DT_INT || parL[0] < 4 || !(xp = prepared_exps(ptoi(((unsigned int*)(parP[0]))[0]))))
+				sendResp(a, SET_STAT(RESP_ERR, ERR_inv_par));
+			else {
+				eval_result = eval_exps(xp, R_GlobalEnv, &Rerror);
+				a->msg_id = msg_id; /* just in case R-side used OOB */
+				if (!Rerror && pars > 1 && parT[1] == DT_INT && parL[1] >= 4 && (ptoi(((unsigned int*)(parP[1]))[0]) & EXEC_VOID)) {
+					sendResp(a, RESP_OK);
+					eval_result = 0;
+				}
+			}
+		}
+
+		if (ph.cmd == CMD_voidEval || ph.cmd == CMD_eval || ph.cmd == CMD_detachedVoidEval) {
+			int is_large = (parT[0] & DT_LARGE) ? 1 : 0;
+			if (is_large) parT[0] ^= DT_LARGE;
+			process = 1;
+			if (pars < 1 || (parT[0] != DT_STRING && parT[0] != DT_SEXP))
+				sendResp(a, SET_STAT(RESP_ERR, ERR_inv_par));
+			else if (parT[0] == DT_SEXP) {
+				unsigned int *sptr = ((unsigned int*)parP[0]) + is_large;
+				SEXP val = QAP_decode(&sptr);
 				if (!val) {
 #ifdef RSERV_DEBUG
 					printf("  FAILED to decode SEXP parameter\n");
@@ -4731,7 +6333,7 @@ void Rserve_QAP1_connected(void *thp) {
 #ifdef RSERV_DEBUG
 				printf("parseString(\"%s\")\n",c);
 #endif
-				SEXP xp = parseString(c, &j, &stat);
+				SEXP xp = parseStringCached(c, &j, &stat);
 				PROTECT(xp);
 #ifdef RSERV_DEBUG
 				printf("buffer parsed, stat=%d, parts=%d\n", stat, j);
@@ -4791,7 +6393,34 @@ void Rserve_QAP1_connected(void *thp) {
 			} else {
 				if (ph.cmd == CMD_voidEval || ph.cmd == CMD_detachedVoidEval)
 					sendResp(a, RESP_OK);
-				else {
+				else if (srv->send_resp == Rserve_QAP1_send_resp) {
+					/* size the result once and stream it through the send buffer,
+					   so no buffer has to hold the whole encoded object */
+					qap_stream_t qs;
+					rlen_t rs = QAP1_size_sexp(a, &qs, exp, sendbuf, sendBufSize);
+#ifdef RSERV_DEBUG
+					printf("result storage size = %ld bytes\n",(long)rs);
+#endif
+					if (rs < 0 || (maxSendBufSize && rs + 4160L > sendBufSize && rs + 4160L > maxSendBufSize)) {
+						unsigned int osz = (rs > 0xffffffff) ? 0xffffffff : rs;
+						osz = itop(osz);
+						if (rs >= 0)
+							QAP_stream_free(&qs);
+#ifdef RSERV_DEBUG
+						if (rs < 0)
+							printf("ERROR: object encoding error\n");
+						else
+							printf("ERROR: object too big (sendBuf=%ld)\n", (long) sendBufSize);
+#endif
+						sendRespData(a, SET_STAT(RESP_ERR, ERR_object_too_big), 4, &osz);
+					} else {
+						int sr = QAP1_send_sized(a, RESP_OK, &qs, exp, rs);
+						if (sr == -1)
+							sendResp(a, SET_STAT(RESP_ERR, ERR_out_of_mem));
+						else if (sr == -2) /* partial response, the connection is unusable */
+							conn_lost = 1;
+					}
+				} else {
 					char *sendhead = 0;
 					int canProceed = 1;
 					/* check buffer size vs REXP size to avoid dangerous overflows
@@ -4859,20 +6488,24 @@ void Rserve_QAP1_connected(void *thp) {
 						char *sxh = sendbuf + 8;
 						tail = (char*)QAP_storeSEXP((unsigned int*)sxh, exp, rs);
 						
-						/* set type to DT_SEXP and correct length */
-						if ((tail - sxh) > 0xfffff0) { /* we must use the "long" format */
-							rlen_t ll = tail - sxh;
-							((unsigned int*)sendbuf)[0] = itop(SET_PAR(DT_SEXP | DT_LARGE, ll & 0xffffff));
-							((unsigned int*)sendbuf)[1] = itop(ll >> 24);
-							sendhead = sendbuf;
-						} else {
-							sendhead = sendbuf + 4;
-							((unsigned int*)sendbuf)[1] = itop(SET_PAR(DT_SEXP,tail - sxh));
-						}
+						if (!tail) /* cannot encode the object */
+							sendResp(a, SET_STAT(RESP_ERR, ERR_out_of_mem));
+						else {
+							/* set type to DT_SEXP and correct length */
+							if ((tail - sxh) > 0xfffff0) { /* we must use the "long" format */
+								rlen_t ll = tail - sxh;
+								((unsigned int*)sendbuf)[0] = itop(SET_PAR(DT_SEXP | DT_LARGE, ll & 0xffffff));
+								((unsigned int*)sendbuf)[1] = itop(ll >> 24);
+								sendhead = sendbuf;
+							} else {
+								sendhead = sendbuf + 4;
+								((unsigned int*)sendbuf)[1] = itop(SET_PAR(DT_SEXP,tail - sxh));
+							}
 #ifdef RSERV_DEBUG
-						printf("stored SEXP; length=%ld (incl. DT_SEXP header)\n",(long) (tail - sendhead));
+							printf("stored SEXP; length=%ld (incl. DT_SEXP header)\n",(long) (tail - sendhead));
 #endif
-						sendRespData(a, RESP_OK, tail - sendhead, sendhead);
+							sendRespData(a, RESP_OK, tail - sendhead, sendhead);
+						}
 						if (tempSB) { /* if this is just a temporary sendbuffer then shrink it back to normal */
 #ifdef RSERV_DEBUG
 							printf("Releasing temporary sendbuf and restoring old size of %ld bytes.\n", (long) sendBufSize);
@@ -4903,6 +6536,7 @@ void Rserve_QAP1_connected(void *thp) {
     respSt:
 
 		if (s == -1) { rn = 0; break; }
+		if (conn_lost) { rn = -1; break; }
 
 		if (!process)
 			sendResp(a, SET_STAT(RESP_ERR, ERR_inv_cmd));
@@ -4927,6 +6561,10 @@ void Rserve_QAP1_connected(void *thp) {
     printf("done.\n");
 #endif
 #ifdef FORKED
+	ulog_proc_mem("child");
+	/* a pre-forked child may take another connection after a clean disconnect */
+	if (!rn && child_recycle())
+		return;
     /* we should not return to the main loop, but terminate instead */
     exit(0);
 #endif
@@ -4939,7 +6577,7 @@ typedef void (*sig_fn_t)(int);
    to define our own value for "not set" */
 static void sig_not_set(int x) {}
 
-sig_fn_t old_HUP = sig_not_set, old_TERM = sig_not_set, old_INT = sig_not_set;
+sig_fn_t old_HUP = sig_not_set, old_TERM = sig_not_set, old_INT = sig_not_set, old_CHLD = sig_not_set;
 
 static void setup_signal_handlers(void) {
 #ifdef FORKED
@@ -4962,6 +6600,10 @@ static void restore_signal_handlers(void) {
 		signal(SIGINT, old_INT);
 		old_INT = sig_not_set;
 	}
+	if (old_CHLD != sig_not_set) {
+		signal(SIGCHLD, old_CHLD);
+		old_CHLD = sig_not_set;
+	}
 }
 #else
 static void setup_signal_handlers(void) {
@@ -4973,6 +6615,7 @@ static void restore_signal_handlers(void) {
 #define MAX_SERVERS 128
 static int servers;
 static server_t *server[MAX_SERVERS];
+static int servers_changed = 1; /* set if the server loop has to update its descriptors */
 
 int add_server(server_t *srv) {
 	if (!srv) return 0;
@@ -4981,6 +6624,7 @@ int add_server(server_t *srv) {
 		return 0;
 	}
 	server[servers++] = srv;
+	servers_changed = 1;
 #ifdef RSERV_DEBUG
 	printf("INFO: adding server %p (total %d servers)\n", (void*) srv, servers);
 #endif
@@ -4996,6 +6640,7 @@ int rm_server(server_t *srv) {
 			int j = i + 1;
 			while (j < servers) { server[j - 1] = server[j]; j++; }
 			servers--;
+			servers_changed = 1;
 		} else i++;
 	}
 	if (srv->fin) srv->fin(srv);
@@ -5016,32 +6661,61 @@ server_t *create_Rserve_QAP1(int flags) {
 		srv->fin       = server_fin;
 		srv->recv      = server_recv;
 		srv->send      = server_send;
+		srv->sendv     = server_sendv;
 		add_server(srv);
 		return srv;
 	}
 	return 0;
 }
 
+/* accepts a connection on srv, the peer address is stored in sa.
+   Returns the socket (or -1 on error) */
+static SOCKET accept_peer(server_t *srv, args_t *sa) {
+	socklen_t al;
+#ifdef unix
+	if (srv->unix_socket) {
+		al = sizeof(sa->su);
+		return accept(srv->ss, (SA*)&(sa->su), &al);
+	}
+#endif
+#ifdef HAVE_IPV6
+	if (srv->flags & SRV_IPV6) {
+		al = sizeof(sa->sa6);
+		return accept(srv->ss, (SA*)&(sa->sa6), &al);
+	}
+#endif
+	al = sizeof(sa->sa);
+	return accept(srv->ss, (SA*)&(sa->sa), &al);
+}
+
+/* check the peer address against the "allow" list, returns 1 if allowed */
+static int peer_allowed(server_t *srv, args_t *sa) {
+	if (!allowed_peers || srv->unix_socket)
+		return 1;
+#ifdef HAVE_IPV6
+	if (srv->flags & SRV_IPV6)
+		return iptrie_match(allowed_peers, sa->sa6.sin6_addr.s6_addr, 16);
+#endif
+	return iptrie_match(allowed_peers, (const unsigned char*) &(sa->sa.sin_addr), 4);
+}
+
 static void handle_server_event(void *which) {
 	server_t *srv = (server_t*) which;
-	socklen_t al;
 	struct args *sa;
 	int ss = srv->ss;
 	int succ = 0;
 	sa = (struct args*)malloc(sizeof(struct args));
 	memset(sa, 0, sizeof(struct args));
-	al = sizeof(sa->sa);
-#ifdef unix
-	if (srv->unix_socket) {
-		al = sizeof(sa->su);
-		sa->s = CF("accept", accept(ss, (SA*)&(sa->su), &al));
-	} else
-#endif
-		sa->s = CF("accept", accept(ss, (SA*)&(sa->sa), &al));
+	sa->s = CF("accept", accept_peer(srv, sa));
 	accepted_server(srv, sa->s);
 	sa->ucix = UCIX++;
 	sa->ss = ss;
 	sa->srv = srv;
+	if (!peer_allowed(srv, sa)) {
+		closesocket(sa->s);
+		free(sa);
+		return;
+	}
 	srv->connected(sa);
 	if (is_child) /* a child may not return */
 		exit(0);
@@ -5087,203 +6761,1949 @@ void finishBackgroundServerLoop(void) {
 	background_servers = 0;
 }
 
-void serverLoop(void) {
-    struct timeval timv;
-    int selRet = 0;
-    fd_set readfds;
+#ifndef Win32
+/* offer to run .Rserve.served after a connection was handed to a child */
+static void run_served_hook(void) {
+	SEXP fun, fsym = install(".Rserve.served");
+	int evalErr = 0;
+	fun = findVarInFrame(R_GlobalEnv, fsym);
+	if (Rf_isFunction(fun))
+		R_tryEval(lang1(fsym), R_GlobalEnv, &evalErr);
+}
+#endif
 
-	if (main_argv && tag_argv == 1 && strlen(main_argv[0]) >= 8) {
-		strcpy(main_argv[0] + strlen(main_argv[0]) - 8, "/RsrvSRV");
-		tag_argv = 2;
-	}
-	ulog("INFO: Rserve server loop started");
+/* only plain QAP1 servers (including TLS and OCAP) are served by the
+   prefork pool - servers with a custom fork() such as those switching
+   users per connection are always forked on accept() */
+static int prefork_server(server_t *srv) {
+	return (srv && srv->connected == Rserve_QAP1_connected && !srv->fork) ? 1 : 0;
+}
 
-    while(active && (servers || children)) { /* main serving loop */
-		int i;
-		int maxfd = 0;
 #ifdef FORKED
-		while (waitpid(-1, 0, WNOHANG) > 0);
+/* Pre-forked children ("prefork <n>")
+
+   The master keeps prefork_size idle children that have already done
+   everything that doesn't depend on the connection (child_init() and
+   setup_workdir()) and wait on the QAP1 listening sockets themselves.
+   A child that accepted a connection sends its pid through prefork_pipe
+   and the master forks a replacement while the child serves the client.
+   The master doesn't accept on pool sockets, so if all children are busy
+   new connections wait in the listen backlog until the pool is refilled. */
+static pid_t prefork_pids[PREFORK_MAX]; /* idle children */
+static int prefork_idle;
+static volatile int prefork_quit;
+
+static void prefork_sig_term(int sig) {
+	prefork_quit = 1;
+}
+
+/* state of a pre-forked child before its first connection (child.reuse) */
+static SEXP child_genv;      /* names and values of the global environment bindings */
+static long child_mem0;      /* memory use in kB */
+static uid_t child_uid;
+static gid_t child_gid;
+static int child_served;
+static struct {             /* I/O methods of the servers (CMD_switch replaces them) */
+	cbuf_fn_t send;
+	buf_fn_t  recv;
+	vbuf_fn_t sendv;
+} child_io[MAX_SERVERS];
+#ifdef USE_ENCODING
+static cetype_t child_encoding; /* configured string encoding */
 #endif
-		/* 500ms (used to be 10ms) - it shouldn't really matter since
-		   it's ok for us to sleep -- the timeout will only influence
-		   how often we collect terminated children and (maybe) how
-		   quickly we react to shutdown */
-		timv.tv_sec = 0; timv.tv_usec = 500000;
-		FD_ZERO(&readfds);
-		for (i = 0; i < servers; i++)
-			if (server[i])
-				{
-					int ss = server[i]->ss;
-					if (ss > maxfd)
-						maxfd = ss;
-					FD_SET(ss, &readfds);
-				}
-		
-		selRet = select(maxfd + 1, &readfds, 0, 0, &timv);
-
-		if (selRet > 0) {
-			for (i = 0; i < servers; i++) {
-				socklen_t al;
-				struct args *sa;
-				server_t *srv = server[i];
-				int ss = srv->ss;
-				int succ = 0;
-				if (server[i] && FD_ISSET(ss, &readfds)) {
-					/* sa is allocated here, and must be freed before the
-					   end of the iteration. The connected(sa) API function
-					   assumes ownership of sa so it MUST free the pointer
-					   even on error. Conversely, sa may NOT be used
-					   here once connected() was called.
-					   FIXME: we could change the semantics to not transfer
-					   ownership to avoid leaks in server implementations,
-					   but 1) it would require all implementations to change
-					   and 2) they may add nested structures to the payload
-					   which they control so those may still leak if we are
-					   responsible */
-					sa = (struct args*)malloc(sizeof(struct args));
-					memset(sa, 0, sizeof(struct args));
-					al = sizeof(sa->sa);
-#ifdef unix
-					if (server[i]->unix_socket) {
-						al = sizeof(sa->su);
-						sa->s = CF("accept", accept(ss, (SA*)&(sa->su), &al));
-					} else
+
+/* current memory use of the process in kB */
+static long child_mem(void) {
+	struct rusage ru;
+#ifdef __linux__
+	long sz, rss;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f) {
+		int n = fscanf(f, "%ld %ld", &sz, &rss);
+		fclose(f);
+		if (n == 2)
+			return rss * (sysconf(_SC_PAGESIZE) / 1024);
+	}
 #endif
-						sa->s = CF("accept", accept(ss, (SA*)&(sa->sa), &al));
-					accepted_server(srv, sa->s);
-					sa->ucix = UCIX++;
-					sa->ss = ss;
-					sa->srv = srv;
-					/*
-					  memset(sa->sk,0,16);
-					  sa->sfd=-1;
-					  #if defined SESSIONS && defined FORKED
-					  {
-					  int pd[2];
-					  if (!pipe(&pd)) {
-					  
-					  }
-					  }
-					  #endif
-					*/
-					if (allowed_ips && !srv->unix_socket && !use_ipv6) {
-						/* FIXME: IPv6 unsafe - filtering won't work on IPv6 addresses */
-						char **laddr = allowed_ips;
-						int allowed = 0;
-						while (*laddr)
-							if (sa->sa.sin_addr.s_addr == inet_addr(*(laddr++)))
-								{ allowed=1; break; }
-						if (allowed) {
-#ifdef RSERV_DEBUG
-							printf("INFO: accepted connection for server %p, calling connected\n", (void*) srv);
-#endif
-							srv->connected(sa);
-							succ = 1;
-#ifdef FORKED
-							/* when the child returns it means it's done (likely an error)
-							   but it is forked, so the only right thing to do is to exit */
-							if (is_child)
-								exit(2);
+	/* peak is the best we can do elsewhere */
+	if (getrusage(RUSAGE_SELF, &ru))
+		return 0;
+#ifdef __APPLE__
+	return ru.ru_maxrss / 1024; /* bytes on macOS */
+#else
+	return ru.ru_maxrss;
 #endif
-						} else {
-#ifdef RSERV_DEBUG
-							printf("INFO: peer is not on allowed IP list, closing connection\n");
+}
+
+static void child_snapshot(void) {
+	SEXP nm = PROTECT(R_lsInternal(R_GlobalEnv, TRUE));
+	SEXP val = PROTECT(allocVector(VECSXP, LENGTH(nm)));
+	int i;
+	for (i = 0; i < LENGTH(nm); i++)
+		SET_VECTOR_ELT(val, i, findVarInFrame(R_GlobalEnv, install(CHAR(STRING_ELT(nm, i)))));
+	R_PreserveObject(child_genv = list2(nm, val));
+	UNPROTECT(2);
+	child_mem0 = child_mem();
+	child_uid = getuid();
+	child_gid = getgid();
+	for (i = 0; i < servers; i++) {
+		child_io[i].send = server[i]->send;
+		child_io[i].recv = server[i]->recv;
+		child_io[i].sendv = server[i]->sendv;
+	}
+#ifdef USE_ENCODING
+	child_encoding = string_encoding;
 #endif
-							closesocket(sa->s);
-							free(sa);
-						}
-					} else { /* ---> remote enabled */
-#ifdef RSERV_DEBUG
-						printf("INFO: accepted connection for server %p, calling connected\n", (void*) srv);
+}
+
+/* called by a pre-forked QAP1 child after a clean disconnect: resets the
+   global environment and the working directory so the child can take
+   another connection. Returns 1 on success, 0 if the child has to exit
+   (connection limit, memory growth, user switched, master gone) */
+static int child_recycle(void) {
+	SEXP nm, val, call;
+	pid_t self = getpid();
+	int i, err = 0;
+
+	if (!child_reusable || !child_genv)
+		return 0;
+	child_reusable = 0;
+	/* per-connection users (auto.uid or authentication) must not be shared */
+	if (++child_served >= child_reuse || prefork_quit || getppid() != parentPID ||
+		random_uid || getuid() != child_uid || getgid() != child_gid)
+		return 0;
+
+	/* drop all bindings and restore those from before the first connection */
+	nm = PROTECT(R_lsInternal(R_GlobalEnv, TRUE));
+	call = PROTECT(lang3(install("rm"), nm, R_GlobalEnv));
+	SET_TAG(CDR(call), install("list"));
+	SET_TAG(CDDR(call), install("envir"));
+	R_tryEval(call, R_GlobalEnv, &err);
+	UNPROTECT(2);
+	nm = CAR(child_genv);
+	val = CADR(child_genv);
+	for (i = 0; i < LENGTH(nm); i++)
+		defineVar(install(CHAR(STRING_ELT(nm, i))), VECTOR_ELT(val, i), R_GlobalEnv);
+	prepared_clear(&qap1_prepared);
+	R_gc();
+	/* per-connection settings */
+	for (i = 0; i < servers; i++) {
+		server[i]->send = child_io[i].send;
+		server[i]->recv = child_io[i].recv;
+		server[i]->sendv = child_io[i].sendv;
+	}
+#ifdef USE_ENCODING
+	string_encoding = child_encoding;
 #endif
-						srv->connected(sa);
-						succ = 1;
-						if (is_child) /* same as above */
-							exit(2);
-					}
-#ifdef Win32
-				}
+
+	if (child_reuse_mem && child_mem() - child_mem0 > child_reuse_mem) {
+		ulog("INFO: child %d grew by %ld kB, not reusing", (int) self, child_mem() - child_mem0);
+		return 0;
+	}
+
+	if (child_workdir) { /* fresh working directory */
+		if (workdir && chdir(workdir)) {}
+		rm_rf(child_workdir);
+		mkdir(child_workdir, wd_mode);
+		if (chdir(child_workdir)) {}
+	}
+
+	prefork_child = 1;
+	/* let the master know that we are available again */
+	self = -self;
+	if (write(prefork_pipe[1], &self, sizeof(self)) != sizeof(self)) {}
+	ulog("INFO: child %d recycled (%d connections served)", (int) getpid(), child_served);
+	return 1;
+}
+
+/* runs in a new pool child: waits for a connection and serves it, never returns */
+static void prefork_run(long rseed, int ucix) {
+	void (*old_term)(int);
+	pid_t self = getpid();
+	args_t *sa = 0;
+
+	child_init(rseed);
+	prefork_child = 1;
+	setup_workdir();
+	if (child_reuse)
+		child_snapshot();
+	/* the master terminates idle children when it shuts down */
+	old_term = signal(SIGTERM, prefork_sig_term);
+
+	while (!prefork_quit && getppid() == parentPID) {
+		struct timeval tv;
+		fd_set rfds;
+		int i, maxfd = 0;
+
+		FD_ZERO(&rfds);
+		for (i = 0; i < servers; i++)
+			if (prefork_server(server[i])) {
+				if (server[i]->ss > maxfd)
+					maxfd = server[i]->ss;
+				FD_SET(server[i]->ss, &rfds);
 			}
+		/* wake up regularly to check whether the master is still around */
+		tv.tv_sec = 1; tv.tv_usec = 0;
+		if (select(maxfd + 1, &rfds, 0, 0, &tv) < 1)
+			continue;
+
+		for (i = 0; i < servers; i++) {
+			server_t *srv = server[i];
+			int fl;
+			if (!prefork_server(srv) || !FD_ISSET(srv->ss, &rfds))
+				continue;
+			if (!sa && !(sa = (args_t*) calloc(1, sizeof(args_t)))) {
+				RSEprintf("ERROR: cannot allocate connection structure in pre-forked child\n");
+				exit(1);
+			}
+			sa->s = accept_peer(srv, sa);
+			if (sa->s == -1) /* another child was faster - pool sockets are non-blocking */
+				continue;
+			/* some systems let the client socket inherit O_NONBLOCK */
+			if ((fl = fcntl(sa->s, F_GETFL)) != -1 && (fl & O_NONBLOCK))
+				fcntl(sa->s, F_SETFL, fl & ~O_NONBLOCK);
+			accepted_server(srv, sa->s);
+			sa->ucix = ucix;
+			sa->ss = srv->ss;
+			sa->srv = srv;
+			if (!peer_allowed(srv, sa)) {
+#ifdef RSERV_DEBUG
+				printf("INFO: peer is not on allowed IP list, closing connection\n");
+#endif
+				closesocket(sa->s);
+				memset(sa, 0, sizeof(args_t));
+				continue;
+			}
+			/* a recyclable child keeps handling SIGTERM so it can finish the connection */
+			if (!child_reuse)
+				signal(SIGTERM, old_term);
+			/* let the master know that we are taken */
+			if (write(prefork_pipe[1], &self, sizeof(self)) != sizeof(self)) {}
+#ifdef RSERV_DEBUG
+			printf("INFO: pre-forked child %d accepted connection for server %p, calling connected\n", (int) self, (void*) srv);
+#endif
+			srv->connected(sa);
+			sa = 0; /* owned by connected() */
+			/* connected() only returns to us for good if child_recycle() succeeded */
+			if (!prefork_child)
+				exit(2); /* same as in serverLoop() */
+			break;
 		}
-#else
-				}
-				if (succ) { /* if there was an actual connection, offer to run .Rserve.served */
-					SEXP fun, fsym = install(".Rserve.served");
-					int evalErr = 0;
-					fun = findVarInFrame(R_GlobalEnv, fsym);
-					if (Rf_isFunction(fun))
-                        R_tryEval(lang1(fsym), R_GlobalEnv, &evalErr);
-				}
-			} /* end loop over servers */
-		} /* end if (selRet > 0) */
-#endif
-    } /* end while(active) */
-    ulog("INFO: Rserve server loop end");
-}
+	}
 
-#ifndef STANDALONE_RSERVE
+	/* the master is gone or asked us to leave without a connection */
+	if (child_workdir) {
+		if (workdir && chdir(workdir)) {}
+		rmdir(child_workdir);
+	}
+	exit(0);
+}
 
-SEXP stop_Rserve(void) {
-	if (background_servers)
-		finishBackgroundServerLoop();
-	return ScalarLogical(TRUE);
+/* removes an idle child from the pool, returns 1 if it was there */
+static int prefork_remove(pid_t pid) {
+	int i;
+	for (i = 0; i < prefork_idle; i++)
+		if (prefork_pids[i] == pid) {
+			prefork_pids[i] = prefork_pids[--prefork_idle];
+			return 1;
+		}
+	return 0;
 }
 
-/* run Rserve inside R */
-SEXP run_Rserve(SEXP cfgFile, SEXP cfgPars, SEXP sBG) {
-	server_stack_t *ss;
-	int isBG = Rf_asInteger(sBG);
-	if (background_servers && !isBG)
-		Rf_error("Background servers and synchronous servers are mutually exclusive there are background servers running already.");
-	if (TYPEOF(cfgFile) == STRSXP && LENGTH(cfgFile) > 0) {
-		int i, n = LENGTH(cfgFile);
-		for (i = 0; i < n; i++)
-			loadConfig(CHAR(STRING_ELT(cfgFile, i)));
+/* forks children until the pool is full */
+static void prefork_fill(void) {
+	while (prefork_idle < prefork_size && !children_full()) {
+		long rseed = random() ^ time(0);
+		int ucix = UCIX++;
+		pid_t pid = fork();
+		if (pid == -1) {
+			RSEprintf("WARNING: fork() failed while filling the prefork pool: %s\n", strerror(errno));
+			return;
+		}
+		if (!pid)
+			prefork_run(rseed, ucix);
+		prefork_pids[prefork_idle++] = pid;
+		child_add(pid);
 	}
-	if (TYPEOF(cfgPars) == STRSXP && LENGTH(cfgPars) > 0) {
-		int i, n = LENGTH(cfgPars);
-		SEXP sNam = Rf_getAttrib(cfgPars, R_NamesSymbol);
-		if (TYPEOF(sNam) != STRSXP || LENGTH(sNam) != n)
-			Rf_error("invalid configuration parameters");
-		for (i = 0; i < n; i++) {
-			const char *key = CHAR(STRING_ELT(sNam, i));
-			const char *value = CHAR(STRING_ELT(cfgPars, i));
-			int res = setConfig(key, value);
-			if (res == 0)
-				Rf_warning("Unknown configuration setting `%s`, ignored.", key);
+}
+
+/* reads pids of children that accepted a connection (or negative pids
+   of recycled children), returns the number of connections */
+static int prefork_collect(void) {
+	pid_t pids[64];
+	int n, i, conns = 0;
+	while ((n = read(prefork_pipe[0], pids, sizeof(pids))) > 0)
+		for (i = 0; i < n / (int) sizeof(pid_t); i++) {
+			if (pids[i] < 0) { /* a recycled child is idle again (child.reuse) */
+				if (prefork_idle < prefork_size)
+					prefork_pids[prefork_idle++] = -pids[i];
+				else /* the pool was refilled meanwhile */
+					kill(-pids[i], SIGTERM);
+				continue;
+			}
+			prefork_remove(pids[i]);
+			conns++;
 		}
+	return conns;
+}
+
+/* sets up the pool for the current servers, returns 1 if it is active */
+static int prefork_start(void) {
+	int i, n = 0;
+	if (prefork_size < 1 || background_servers)
+		return 0;
+	for (i = 0; i < servers; i++)
+		if (prefork_server(server[i]))
+			n++;
+	if (!n)
+		return 0;
+	if (pipe(prefork_pipe)) {
+		RSEprintf("WARNING: cannot create prefork pool pipe, prefork disabled: %s\n", strerror(errno));
+		prefork_pipe[0] = prefork_pipe[1] = -1;
+		return 0;
 	}
+	fcntl(prefork_pipe[0], F_SETFL, fcntl(prefork_pipe[0], F_GETFL) | O_NONBLOCK);
+	/* idle children compete for connections so accept() must not block */
+	for (i = 0; i < servers; i++)
+		if (prefork_server(server[i])) {
+			int fl = fcntl(server[i]->ss, F_GETFL);
+			if (fl != -1)
+				fcntl(server[i]->ss, F_SETFL, fl | O_NONBLOCK);
+		}
+	ulog("INFO: prefork pool of %d children for %d server(s)", prefork_size, n);
+	prefork_fill();
+	return 1;
+}
 
-	if (src_list)
-		Rf_warning("server/eval configuration only applies to stand-alone Rserve and is ignored in run.Rserve().");
+/* terminates idle children, busy ones finish their connections */
+static void prefork_stop(void) {
+	int i;
+	for (i = 0; i < prefork_idle; i++)
+		kill(prefork_pids[i], SIGTERM);
+	prefork_idle = 0;
+	close(prefork_pipe[0]);
+	close(prefork_pipe[1]);
+	prefork_pipe[0] = prefork_pipe[1] = -1;
+}
+#endif
 
-	RSsrv_init();
-	/* FIXME: should we really do this ? setuid, chroot etc. are not meant to work inside R ... */
-	performConfig(SU_NOW);
+/* Server loop event backend
 
-	ss = create_server_stack();
+   The master waits for connections on the server sockets, for pool
+   notifications and for signals. epoll is used where available, select()
+   otherwise. SIGCHLD and the shutdown signals write into sig_pipe, so
+   children are reaped and shutdown is handled right away while an idle
+   master doesn't need to wake up at all. */
+#define EV_MAX_FDS (MAX_SERVERS + 2) /* max. number of events handled per wake-up */
 
-	if (enable_qap) {
-		server_t *srv = create_Rserve_QAP1((qap_oc ? SRV_QAP_OC : 0) | global_srv_flags);
-		if (!srv) {
-			release_server_stack(ss);
-			RSsrv_done();
-			Rf_error("Unable to start Rserve server");
-		}
-		ulog("INFO: started QAP1 server (%s)", qap_oc ? "OCAP" : "eval");
-		push_server(ss, srv);
+static int *ev_fds; /* registered descriptors */
+static int ev_nfds, ev_fds_size;
+
+static void ev_close(void) {
+#ifdef HAVE_SYS_EPOLL_H
+	if (ev_fd != -1) {
+		close(ev_fd);
+		ev_fd = -1;
 	}
+#endif
+	ev_nfds = 0;
+}
 
-	if (tls_port > 0) {
-		server_t *srv = create_Rserve_QAP1(SRV_TLS | (qap_oc ? SRV_QAP_OC : 0) | global_srv_flags);
-		if (!srv) {
-			release_server_stack(ss);
-			RSsrv_done();
-			Rf_error("Unable to start TLS/Rserve server");
+static void ev_open(void) {
+	ev_close();
+#ifdef HAVE_SYS_EPOLL_H
+	/* if this fails we silently fall back to select() */
+	ev_fd = epoll_create(EV_MAX_FDS);
+#endif
+}
+
+/* watch fd for reading, returns 0 on success */
+static int ev_add(int fd) {
+	if (ev_nfds >= ev_fds_size) {
+		int *nf = (int*) realloc(ev_fds, sizeof(int) * (ev_fds_size + EV_MAX_FDS));
+		if (!nf)
+			return -1;
+		ev_fds = nf;
+		ev_fds_size += EV_MAX_FDS;
+	}
+#ifdef HAVE_SYS_EPOLL_H
+	if (ev_fd != -1) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(ev_fd, EPOLL_CTL_ADD, fd, &ev))
+			return -1;
+	} else
+#endif
+#ifdef unix
+	if (fd >= FD_SETSIZE) /* select() cannot handle it */
+		return -1;
+#endif
+	ev_fds[ev_nfds++] = fd;
+	return 0;
+}
+
+static void ev_del(int fd) {
+	int i;
+#ifdef HAVE_SYS_EPOLL_H
+	if (ev_fd != -1) {
+		struct epoll_event ev; /* ignored, but old kernels require it */
+		epoll_ctl(ev_fd, EPOLL_CTL_DEL, fd, &ev);
+	}
+#endif
+	for (i = 0; i < ev_nfds; i++)
+		if (ev_fds[i] == fd) {
+			ev_fds[i] = ev_fds[--ev_nfds];
+			break;
 		}
-		ulog("INFO: started TLS server (%s)", qap_oc ? "OCAP" : "eval");
-		push_server(ss, srv);
+}
+
+/* waits for at most timeout ms (-1 = indefinitely), stores descriptors
+   ready for reading in ready and returns their number (-1 on error) */
+static int ev_wait(int *ready, int timeout) {
+	struct timeval timv;
+	fd_set readfds;
+	int i, n = 0, maxfd = 0;
+#ifdef HAVE_SYS_EPOLL_H
+	if (ev_fd != -1) {
+		struct epoll_event evs[EV_MAX_FDS];
+		n = epoll_wait(ev_fd, evs, EV_MAX_FDS, timeout);
+		for (i = 0; i < n; i++)
+			ready[i] = evs[i].data.fd;
+		return n;
+	}
+#endif
+	FD_ZERO(&readfds);
+	for (i = 0; i < ev_nfds; i++) {
+		if (ev_fds[i] > maxfd)
+			maxfd = ev_fds[i];
+		FD_SET(ev_fds[i], &readfds);
 	}
+	timv.tv_sec = timeout / 1000; timv.tv_usec = (timeout % 1000) * 1000;
+	if (select(maxfd + 1, &readfds, 0, 0, (timeout < 0) ? 0 : &timv) < 0)
+		return -1;
+	for (i = 0; i < ev_nfds && n < EV_MAX_FDS; i++)
+		if (FD_ISSET(ev_fds[i], &readfds))
+			ready[n++] = ev_fds[i];
+	return n;
+}
+
+#ifdef unix
+/* Multiplexed QAP1 server ("qap.mux.port <port>")
+
+   Connections to this server are not forked - the process running the
+   server loop serves all of them. Each connection has its own
+   evaluation environment (enclosed by the global environment) and
+   incoming messages are buffered without blocking until they are
+   complete, so many mostly idle clients don't need a process each.
+   Complete requests are executed one at a time in the order they
+   arrive, so a long evaluation delays all other connections. Only
+   eval, voidEval, setSEXP, assignSEXP, batch, prepare, execPrepared
+   and setQAPExt are supported and there is no authentication, hence
+   the server is meant for cheap, pure function calls from trusted
+   clients. Requests run under R_ToplevelExec() since the server
+   process must survive R errors, the connection that caused one is
+   closed. */
+typedef struct mux_conn {
+	args_t *a;
+	SEXP env;       /* evaluation environment of the connection */
+	char *buf;      /* input buffer (size + 8 bytes allocated) */
+	size_t len, size;
+	int qap_ext;    /* QAP extensions negotiated by the connection */
+	prepared_t prepared; /* expressions registered with CMD_prepare */
+	int busy;       /* set while a request of the connection is processed */
+} mux_conn_t;
+
+#define MUX_INBUF 8192 /* initial input buffer size */
+#define MUX_SNDTIMEO 10 /* send timeout (in seconds) - a stalled client blocks all others */
+
+static mux_conn_t **mux_conns; /* connections indexed by their socket */
+static int mux_conns_size;
+static char *mux_sbuf; /* send buffer shared by all connections */
+
+static mux_conn_t *mux_conn(int fd) {
+	return (fd >= 0 && fd < mux_conns_size) ? mux_conns[fd] : 0;
+}
+
+static void mux_input(int fd);
+
+static void mux_input_handler(void *data) {
+	mux_input(((mux_conn_t*) data)->a->s);
+}
+
+/* watches the connection, using R's input handlers if the servers run in the background */
+static int mux_watch(mux_conn_t *mc) {
+	if (background_servers) {
+		InputHandler *ih = addInputHandler(R_InputHandlers, mc->a->s, &mux_input_handler, 9);
+		if (!ih)
+			return -1;
+		ih->userData = mc;
+		return 0;
+	}
+	return ev_add(mc->a->s);
+}
+
+static void mux_unwatch(mux_conn_t *mc) {
+	if (background_servers) {
+		InputHandler *ih = getInputHandler(R_InputHandlers, mc->a->s);
+		if (ih)
+			removeInputHandler(&R_InputHandlers, ih);
+	} else
+		ev_del(mc->a->s);
+}
+
+/* re-registers all connections after the server loop descriptors were re-created */
+static void mux_watch_all(void) {
+	int i;
+	for (i = 0; i < mux_conns_size; i++)
+		if (mux_conns[i] && ev_add(i)) {
+			RSEprintf("WARNING: cannot watch multiplexed connection %d, closing it\n", i);
+			closesocket(i);
+			R_ReleaseObject(mux_conns[i]->env);
+			free(mux_conns[i]->buf);
+			free(mux_conns[i]->a);
+			free(mux_conns[i]);
+			mux_conns[i] = 0;
+		}
+}
+
+static void mux_close(int fd) {
+	mux_conn_t *mc = mux_conn(fd);
+	if (!mc) return;
+	mux_unwatch(mc);
+	mux_conns[fd] = 0;
+	closesocket(fd);
+	R_ReleaseObject(mc->env);
+	prepared_clear(&mc->prepared);
+	free(mc->buf);
+	free(mc->a);
+	free(mc);
+}
+
+/* closes all connections without touching R - used in forked processes
+   which must not serve the connections of their parent */
+static void mux_drop(void) {
+	int i;
+	for (i = 0; i < mux_conns_size; i++)
+		if (mux_conns[i]) {
+			closesocket(i);
+			free(mux_conns[i]->buf);
+			free(mux_conns[i]->a);
+			free(mux_conns[i]);
+			mux_conns[i] = 0;
+		}
+}
+
+/* makes room for at least need bytes of input, returns 0 on success */
+static int mux_reserve(mux_conn_t *mc, size_t need) {
+	char *nb;
+	size_t ns;
+	if (need <= mc->size)
+		return 0;
+	ns = (need | 0x1fffL) + 1L; /* use 8kB granularity */
+	if (!(nb = (char*) realloc(mc->buf, ns + 8)))
+		return -1;
+	mc->buf = nb;
+	mc->size = ns;
+	return 0;
+}
+
+static void mux_connected(void *thp) {
+	args_t *a = (args_t*) thp;
+	mux_conn_t *mc;
+	SEXP env;
+	int err = 0, s = a->s;
+	server_t *srv = a->srv;
+
+	if (s >= mux_conns_size) {
+		int ns = (s | 0xff) + 1;
+		mux_conn_t **nc = (mux_conn_t**) realloc(mux_conns, sizeof(mux_conn_t*) * ns);
+		if (!nc) {
+			closesocket(s);
+			free(a);
+			return;
+		}
+		memset(nc + mux_conns_size, 0, sizeof(mux_conn_t*) * (ns - mux_conns_size));
+		mux_conns = nc;
+		mux_conns_size = ns;
+	}
+	if (!mux_sbuf && !(mux_sbuf = (char*) malloc(sndBS))) {
+		closesocket(s);
+		free(a);
+		return;
+	}
+	mc = (mux_conn_t*) calloc(1, sizeof(mux_conn_t));
+	if (!mc || !(mc->buf = (char*) malloc(MUX_INBUF + 8))) {
+		RSEprintf("ERROR: cannot allocate buffers for a multiplexed connection\n");
+		if (mc) free(mc);
+		closesocket(s);
+		free(a);
+		return;
+	}
+	mc->size = MUX_INBUF;
+	mc->a = a;
+	env = R_tryEval(PROTECT(lang1(install("new.env"))), R_GlobalEnv, &err);
+	UNPROTECT(1);
+	if (err || !env || TYPEOF(env) != ENVSXP) {
+		RSEprintf("ERROR: cannot create the environment of a multiplexed connection\n");
+		free(mc->buf);
+		free(mc);
+		closesocket(s);
+		free(a);
+		return;
+	}
+	R_PreserveObject(mc->env = env);
+	if (mux_watch(mc)) {
+		RSEprintf("WARNING: cannot watch multiplexed connection %d, closing it\n", s);
+		R_ReleaseObject(env);
+		free(mc->buf);
+		free(mc);
+		closesocket(s);
+		free(a);
+		return;
+	}
+	mux_conns[s] = mc;
+
+	{
+		struct timeval tv;
+		tv.tv_sec = MUX_SNDTIMEO;
+		tv.tv_usec = 0;
+		setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char*) &tv, sizeof(tv));
+	}
+#ifdef CAN_TCP_NODELAY
+	{
+		int opt = 1;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*) &opt, sizeof(opt));
+	}
+#endif
+	a->flags |= F_OUT_BIN;
+	ulog("INFO: multiplexed connection %d accepted", s);
+	if (srv->send(a, IDstring, 32) < 32)
+		mux_close(s);
+}
+
+/* a request of a multiplexed connection, see mux_exec() */
+typedef struct mux_req {
+	mux_conn_t *mc;
+	int cmd, pars, parT[2];
+	size_t parL[2];
+	void *parP[2];
+	char *buf;
+	size_t plen;
+	int res;        /* non-zero if the connection has to be closed */
+} mux_req_t;
+
+/* runs a request - called via R_ToplevelExec() since R errors must
+   not escape into the server loop */
+static void mux_exec(void *data) {
+	mux_req_t *r = (mux_req_t*) data;
+	mux_conn_t *mc = r->mc;
+	args_t *a = mc->a;
+	server_t *srv = a->srv;
+	int cmd = r->cmd, pars = r->pars, *parT = r->parT, Rerror = 0, res = 0;
+	size_t *parL = r->parL, plen = r->plen;
+	void **parP = r->parP;
+	char *buf = r->buf, *c;
+	SEXP eval_result = 0;
+	ParseStatus stat;
+
+	switch (cmd) {
+	case CMD_setQAPExt:
+		if (pars < 1 || parT[0] != DT_INT || parL[0] < 4)
+			res = sendResp(a, SET_STAT(RESP_ERR, ERR_inv_par));
+		else {
+			unsigned int ext[2];
+			mc->qap_ext = ptoi(((unsigned int*)(parP[0]))[0]) & (QAPX_SEQ | QAPX_STR_DICT | (compress_level ? QAPX_COMPRESS : 0));
+			ext[0] = itop(SET_PAR(DT_INT, sizeof(int)));
+			ext[1] = itop(mc->qap_ext);
+			res = sendRespData(a, RESP_OK, sizeof(ext), ext);
+		}
+		break;
+
+	case CMD_setSEXP:
+	case CMD_assignSEXP:
+		if (pars < 2 || parT[0] != DT_STRING || (parT[1] != DT_STRING && parT[1] != DT_SEXP))
+			res = sendResp(a, SET_STAT(RESP_ERR, ERR_inv_par));
+		else {
+			SEXP sym = 0, val;
+			c = (char*) parP[0];
+			if (cmd == CMD_assignSEXP) {
+				sym = parseExps(c, 1, &stat);
+				if (stat != 1) {
+					res = sendResp(a, SET_STAT(RESP_ERR, stat));
+					break;
+				}
+				if (TYPEOF(sym) == EXPRSXP && LENGTH(sym) > 0)
+					sym = VECTOR_ELT(sym, 0);
+				if (TYPEOF(sym) != SYMSXP) { /* e.g. "x[1]" or "1" */
+					res = sendResp(a, SET_STAT(RESP_ERR, ERR_inv_par));
+					break;
+				}
+			}
+			PROTECT(sym ? sym : R_NilValue);
+			if (parT[1] == DT_STRING) {
+				PROTECT(val = allocVector(STRSXP, 1));
+				SET_STRING_ELT(val, 0, mkRChar((char*)(parP[1])));
+			} else {
+				unsigned int *sptr = (unsigned int*) parP[1];
+				val = QAP_decode(&sptr);
+				PROTECT(val ? val : R_NilValue);
+			}
+			if (!val)
+				res = sendResp(a, SET_STAT(RESP_ERR, ERR_inv_par));
+			else {
+				defineVar(sym ? sym : install(c), val, mc->env);
+				res = sendResp(a, RESP_OK);
+			}
+			UNPROTECT(2);
+		}
+		break;
+
+	case CMD_batch:
+		if (!(eval_result = QAP1_batch(buf, plen, mc->env)))
+			res = sendResp(a, SET_STAT(RESP_ERR, ERR_inv_par));
+		else {
+			PROTECT(eval_result);
+			res = Rserve_QAP1_send_sexp(a, RESP_OK, eval_result, mux_sbuf, sndBS);
+			if (res == -1)
+				res = sendResp(a, SET_STAT(RESP_ERR, ERR_object_too_big));
+			UNPROTECT(1);
+		}
+		break;
+
+	case CMD_prepare:
+		if (pars < 1 || parT[0] != DT_STRING)
+			res = sendResp(a, SET_STAT(RESP_ERR, ERR_inv_par));
+		else {
+			int h = prepare_exps((char*) parP[0], &stat);
+			if (h < 1)
+				res = sendResp(a, SET_STAT(RESP_ERR, h ? ERR_out_of_mem : stat));
+			else {
+				unsigned int hr[2];
+				hr[0] = itop(SET_PAR(DT_INT, sizeof(int)));
+				hr[1] = itop(h);
+				res = sendRespData(a, RESP_OK, sizeof(hr), hr);
+			}
+		}
+		break;
+
+	case CMD_execPrepared:
+		{
+			SEXP xp = 0;
+			if (pars < 1 || parT[0] != DT_INT || parL[0] < 4 || !(xp = prepared_exps(ptoi(((unsigned int*)(parP[0]))[0]))))
+				res = sendResp(a, SET_STAT(RESP_ERR, ERR_inv_par));
+			else {
+				eval_result = eval_exps(xp, mc->env, &Rerror);
+				if (Rerror)
+					res = sendResp(a, SET_STAT(RESP_ERR, (Rerror < 0) ? Rerror : -Rerror));
+				else if (pars > 1 && parT[1] == DT_INT && parL[1] >= 4 && (ptoi(((unsigned int*)(parP[1]))[0]) & EXEC_VOID))
+					res = sendResp(a, RESP_OK);
+				else {
+					PROTECT(eval_result);
+					res = Rserve_QAP1_send_sexp(a, RESP_OK, eval_result, mux_sbuf, sndBS);
+					if (res == -1)
+						res = sendResp(a, SET_STAT(RESP_ERR, ERR_object_too_big));
+					UNPROTECT(1);
+				}
+			}
+		}
+		break;
+
+	case CMD_eval:
+	case CMD_voidEval:
+		if (pars < 1 || (parT[0] != DT_STRING && parT[0] != DT_SEXP))
+			res = sendResp(a, SET_STAT(RESP_ERR, ERR_inv_par));
+		else if (parT[0] == DT_SEXP) {
+			unsigned int *sptr = (unsigned int*) parP[0];
+			SEXP val = QAP_decode(&sptr);
+			if (!val)
+				res = sendResp(a, SET_STAT(RESP_ERR, ERR_inv_par));
+			else {
+				PROTECT(val);
+				eval_result = R_tryEval(val, mc->env, &Rerror);
+				UNPROTECT(1);
+			}
+		} else {
+			int j = 0;
+			SEXP xp = PROTECT(parseStringCached((char*) parP[0], &j, &stat));
+			if (stat != 1)
+				res = sendResp(a, SET_STAT(RESP_ERR, stat));
+			else if (TYPEOF(xp) == EXPRSXP && LENGTH(xp) > 0) {
+				int bi = 0;
+				while (bi < LENGTH(xp)) {
+					Rerror = 0;
+					eval_result = R_tryEval(VECTOR_ELT(xp, bi++), mc->env, &Rerror);
+					if (Rerror) break;
+				}
+			} else
+				eval_result = R_tryEval(xp, mc->env, &Rerror);
+			UNPROTECT(1);
+		}
+		if (Rerror)
+			res = sendResp(a, SET_STAT(RESP_ERR, (Rerror < 0) ? Rerror : -Rerror));
+		else if (eval_result) {
+			if (cmd == CMD_voidEval)
+				res = sendResp(a, RESP_OK);
+			else {
+				PROTECT(eval_result);
+				res = Rserve_QAP1_send_sexp(a, RESP_OK, eval_result, mux_sbuf, sndBS);
+				if (res == -1) /* could not be encoded - the connection is still fine */
+					res = sendResp(a, SET_STAT(RESP_ERR, ERR_object_too_big));
+				UNPROTECT(1);
+			}
+		}
+		break;
+
+	default:
+		res = sendResp(a, SET_STAT(RESP_ERR, ERR_unsupportedCmd));
+	}
+	r->res = res;
+}
+
+/* processes one complete request, returns -1 if the connection has to be closed */
+static int mux_process(mux_conn_t *mc, int cmd, char *buf, size_t plen) {
+	args_t *a = mc->a;
+	server_t *srv = a->srv;
+	char *ub = 0, *c = buf;
+	mux_req_t r;
+
+	if (cmd & CMD_COMPRESSED) {
+		int zerr = ERR_unavailable;
+#ifdef HAVE_ZLIB
+		size_t us, ul;
+		if (compress_level && !(zerr = QAP1_inflate(buf, plen, maxInBuf, &ub, &us, &ul))) {
+			buf = c = ub;
+			plen = ul;
+			memset(buf + plen, 0, 8);
+		}
+#endif
+		if (zerr)
+			return sendResp(a, SET_STAT(RESP_ERR, zerr)) ? -1 : 0;
+		cmd &= ~CMD_COMPRESSED;
+	}
+
+	/* parameters (no command needs more than two) */
+	r.pars = 0;
+	while (r.pars < 2 && c + 4 <= buf + plen) {
+		unsigned int phead = ptoi(*((unsigned int*)c));
+		size_t headSize = 4, parLen;
+		int parType;
+		if (!phead) break;
+		parType = PAR_TYPE(phead);
+		parLen = PAR_LEN(phead);
+		if (parType & DT_LARGE) {
+			if (c + 8 > buf + plen) break;
+			headSize += 4;
+			parLen |= ((size_t)((unsigned int)ptoi(*(unsigned int*)(c + 4)))) << 24;
+			parType ^= DT_LARGE;
+		}
+		if (parLen > (size_t) (buf + plen - c) - headSize) {
+			if (ub) free(ub);
+			return sendResp(a, SET_STAT(RESP_ERR, ERR_inv_par)) ? -1 : 0;
+		}
+		r.parT[r.pars] = parType;
+		r.parL[r.pars] = parLen;
+		r.parP[r.pars] = c + headSize;
+		r.pars++;
+		c += parLen + headSize;
+	}
+
+	r.mc = mc;
+	r.cmd = cmd;
+	r.buf = buf;
+	r.plen = plen;
+	r.res = -1;
+	QAP_ext = mc->qap_ext;
+	prepared = &mc->prepared;
+	if (!R_ToplevelExec(mux_exec, &r))
+		ulog("ERROR: R error while processing a request of multiplexed connection %d, closing it", a->s);
+	QAP_ext = 0;
+	prepared = &qap1_prepared;
+	if (ub) free(ub);
+	return r.res ? -1 : 0;
+}
+
+/* reads what is available on the connection and processes all complete requests */
+static void mux_input(int fd) {
+	mux_conn_t *mc = mux_conn(fd);
+	server_t *srv;
+	ssize_t n;
+
+	if (!mc || mc->busy) /* requests of a connection are never nested */
+		return;
+	srv = mc->a->srv;
+	if (mc->size - mc->len < 1024 && mux_reserve(mc, mc->len + MUX_INBUF)) {
+		mux_close(fd);
+		return;
+	}
+	n = recv(fd, mc->buf + mc->len, mc->size - mc->len, MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if (n < 1) { /* closed by the client or failed */
+		ulog("INFO: multiplexed connection %d closed", fd);
+		mux_close(fd);
+		return;
+	}
+	mc->len += n;
+
+	mc->busy = 1;
+	while (mc->len >= sizeof(struct phdr)) {
+		struct phdr *ph = (struct phdr*) mc->buf;
+		size_t plen = (unsigned int) ptoi(ph->len);
+		int cmd = ptoi(ph->cmd), res;
+		char *pl = mc->buf + sizeof(struct phdr), tail[8];
+#ifdef __LP64__
+		plen |= ((size_t) (unsigned int) ptoi(ph->res)) << 32;
+#endif
+		mc->a->msg_id = use_msg_id ? ph->msg_id : 0;
+		if (maxInBuf && plen >= maxInBuf) {
+			RSEprintf("WARNING: closing multiplexed connection %d, request too big (%ld bytes)\n", fd, (long) plen);
+			sendResp(mc->a, SET_STAT(RESP_ERR, ERR_data_overflow));
+			mux_close(fd);
+			return;
+		}
+		if (mc->len < sizeof(struct phdr) + plen) { /* incomplete - wait for more */
+			if (mux_reserve(mc, sizeof(struct phdr) + plen)) {
+				sendResp(mc->a, SET_STAT(RESP_ERR, ERR_out_of_mem));
+				mux_close(fd);
+				return;
+			}
+			break;
+		}
+		ulog("QAP1/mux: connection %d, CMD 0x%08x, length %ld, msg.id 0x%x",
+			 fd, cmd, (long) plen, mc->a->msg_id);
+		/* the parameter parser expects zeros behind the payload, the
+		   buffer may already hold the next request there */
+		memcpy(tail, pl + plen, 8);
+		memset(pl + plen, 0, 8);
+		res = mux_process(mc, cmd, pl, plen);
+		memcpy(pl + plen, tail, 8);
+		if (res) {
+			mux_close(fd);
+			return;
+		}
+		mc->len -= sizeof(struct phdr) + plen;
+		if (mc->len)
+			memmove(mc->buf, pl + plen, mc->len);
+	}
+	mc->busy = 0;
+	/* don't keep large buffers around for idle connections */
+	if (!mc->len && mc->size > MUX_INBUF * 8) {
+		char *nb = (char*) realloc(mc->buf, MUX_INBUF + 8);
+		if (nb) {
+			mc->buf = nb;
+			mc->size = MUX_INBUF;
+		}
+	}
+}
+
+server_t *create_Rserve_QAP1_mux(int flags) {
+	server_t *srv;
+	if (authReq || qap_oc) {
+		RSEprintf("WARNING: qap.mux.port supports neither authentication nor OCAP mode, the multiplexed server is not started\n");
+		return 0;
+	}
+	if (use_ipv6) flags |= SRV_IPV6;
+	if (localonly) flags |= SRV_LOCAL;
+	srv = create_server(mux_port, 0, 0, flags);
+	if (srv) {
+		srv->connected = mux_connected;
+		srv->send_resp = Rserve_QAP1_send_resp;
+		srv->fin       = server_fin;
+		srv->recv      = server_recv;
+		srv->send      = server_send;
+		srv->sendv     = server_sendv;
+		add_server(srv);
+		return srv;
+	}
+	return 0;
+}
+#else
+#define mux_watch_all()
+#define mux_conn(X) 0
+#define mux_drop()
+#endif
+
+#if defined FORKED && defined HAVE_RSA
+/* RSA key pool
+
+   Unless rsa.key is specified, the server key for CMD_keyReq is
+   generated by a helper process forked when the server loop starts
+   (4096-bit keys take up to several seconds), so children inherit a
+   ready key instead of generating one for each connection. Children
+   forked before the first key arrives still generate their own.
+   With "rsa.rotate <s>" the helper keeps RSA_POOL spare keys ready
+   and the current key is replaced by one of them every s seconds.
+   The requests (one byte per key) and the keys (DER-encoded) are
+   datagrams on a socket pair, so each key is one message. */
+#define RSA_POOL 2
+
+static pid_t keygen_pid;
+static int keygen_fd = -1;
+static int keygen_pending;     /* keys requested but not received yet */
+static RSA *rsa_pool[RSA_POOL];
+static int rsa_pool_len;
+static time_t rsa_since;       /* time the current key was put in use */
+
+static void keygen_run(int fd) {
+	char c;
+	restore_signal_handlers();
+	while (recv(fd, &c, 1, 0) == 1) {
+		RSA *key = RSA_generate_key0(4096, 65537);
+		unsigned char *pt = (unsigned char*) rsa_buf;
+		int n;
+		if (!key)
+			break;
+		n = i2d_RSAPrivateKey(key, 0);
+		if (n < 1 || n > sizeof(rsa_buf)) {
+			RSA_free(key);
+			break;
+		}
+		i2d_RSAPrivateKey(key, &pt);
+		RSA_free(key);
+		if (send(fd, rsa_buf, n, 0) != n)
+			break;
+	}
+	_exit(0);
+}
+
+/* requests keys until the current key and the pool are covered */
+static void keygen_request(void) {
+	int want = (rsa_srv_key ? 0 : 1) + (rsa_rotate ? RSA_POOL : 0);
+	char c = 1;
+	while (keygen_fd != -1 && rsa_pool_len + keygen_pending < want &&
+		   send(keygen_fd, &c, 1, MSG_DONTWAIT) == 1)
+		keygen_pending++;
+}
+
+static void keygen_start(void) {
+	int sv[2];
+	pid_t pid;
+	if (rsa_key_file) {
+		if (rsa_rotate && !is_listener)
+			RSEprintf("WARNING: rsa.rotate only applies to generated keys, the rsa.key key is used as-is\n");
+		return;
+	}
+	if (rsa_srv_key && !rsa_rotate)
+		return;
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv)) {
+		RSEprintf("WARNING: cannot create the RSA key generator socket: %s\n", strerror(errno));
+		return;
+	}
+	if ((pid = fork()) == -1) {
+		RSEprintf("WARNING: fork() failed for the RSA key generator: %s\n", strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return;
+	}
+	if (!pid) {
+		close(sv[0]);
+		keygen_run(sv[1]);
+	}
+	close(sv[1]);
+	keygen_fd = sv[0];
+	keygen_pid = pid;
+	rsa_since = time(0);
+	servers_changed = 1;
+	keygen_request();
+}
+
+/* drops the generator (the process is not waited for) */
+static void keygen_close(void) {
+	if (keygen_pid)
+		kill(keygen_pid, SIGTERM);
+	keygen_pid = 0;
+	if (keygen_fd != -1) {
+		close(keygen_fd);
+		keygen_fd = -1;
+		servers_changed = 1;
+	}
+	keygen_pending = 0;
+}
+
+/* used by processes forked from the server: the generator and the
+   spare keys belong to the server, only the current key is kept */
+static void keygen_drop(void) {
+	if (keygen_fd != -1) {
+		close(keygen_fd);
+		keygen_fd = -1;
+	}
+	keygen_pid = 0;
+	keygen_pending = 0;
+	while (rsa_pool_len)
+		RSA_free(rsa_pool[--rsa_pool_len]);
+}
+
+static void keygen_gone(pid_t pid) {
+	if (keygen_pid && pid == keygen_pid)
+		keygen_pid = 0;
+}
+
+static void keygen_receive(void) {
+	const unsigned char *ptr = (const unsigned char*) rsa_buf;
+	RSA *key = 0;
+	int n = recv(keygen_fd, rsa_buf, sizeof(rsa_buf), MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n > 0)
+		key = d2i_RSAPrivateKey(NULL, &ptr, n);
+	if (!key) {
+		ulog("WARNING: RSA key generator failed%s", rsa_srv_key ? ", keeping the current key" : "");
+		keygen_close();
+		return;
+	}
+	keygen_pending--;
+	if (!rsa_srv_key) {
+		rsa_srv_key = key;
+		rsa_since = time(0);
+		ulog("INFO: RSA key generated");
+	} else if (rsa_pool_len < RSA_POOL)
+		rsa_pool[rsa_pool_len++] = key;
+	else
+		RSA_free(key);
+	if (!rsa_rotate && !keygen_pending) /* nothing left to generate */
+		keygen_close();
+}
+
+/* replaces the current key once it is rsa.rotate seconds old and
+   returns the time (in ms) until the next rotation, -1 if none is due */
+static int keygen_rotate(void) {
+	time_t now, left;
+	if (!rsa_rotate || !rsa_srv_key || !rsa_pool_len)
+		return -1;
+	now = time(0);
+	if (now - rsa_since >= rsa_rotate) {
+		RSA_free(rsa_srv_key);
+		rsa_srv_key = rsa_pool[0];
+		memmove(rsa_pool, rsa_pool + 1, sizeof(RSA*) * --rsa_pool_len);
+		rsa_since = now;
+		ulog("INFO: RSA key rotated");
+		keygen_request();
+		if (!rsa_pool_len)
+			return -1;
+	}
+	left = rsa_since + rsa_rotate - now;
+	/* long intervals don't fit in int milliseconds, wake up daily then */
+	if (left > 86400)
+		left = 86400;
+	return (int) left * 1000;
+}
+
+static void keygen_stop(void) {
+	pid_t pid = keygen_pid;
+	keygen_close();
+	if (pid)
+		waitpid(pid, 0, 0);
+}
+#endif
+
+/* registers all descriptors the master is waiting on */
+static void ev_setup(int pool) {
+	int i, watch_srv = servers; /* server sockets accepted on by this process */
+	ev_open();
+#ifdef unix
+	if (sig_pipe[0] != -1)
+		ev_add(sig_pipe[0]);
+#endif
+#ifdef FORKED
+	if (pool)
+		ev_add(prefork_pipe[0]);
+	if (zygote_fd != -1) {
+		ev_add(zygote_fd);
+		if (!is_acceptor) /* the acceptor accepts for us */
+			watch_srv = 0;
+	}
+#ifdef HAVE_RSA
+	if (keygen_fd != -1)
+		ev_add(keygen_fd);
+#endif
+#endif
+	for (i = 0; i < watch_srv; i++)
+		if (server[i] && !(pool && prefork_server(server[i])) && /* pool servers are served by the children */
+			ev_add(server[i]->ss))
+			RSEprintf("WARNING: cannot watch server socket %d, its connections will not be served\n", server[i]->ss);
+	mux_watch_all();
+	servers_changed = 0;
+}
+
+#ifdef FORKED
+/* Additional listener processes ("listeners <n>")
+
+   The master forks n - 1 listeners when the server loop starts. Each
+   re-opens the TCP server sockets with SO_REUSEPORT so the kernel
+   distributes connections among the master and the listeners, and
+   then runs its own server loop (including its own prefork pool), so
+   accept() and fork() are no longer serialized in a single process.
+   Unix sockets are served by the master only. A listener that crashes
+   is replaced, a listener that stops (e.g., due to CMD_shutdown
+   handled by one of its children) shuts the whole server down. */
+static pid_t listener_pids[LISTENERS_MAX];
+
+static void listener_run(int id) {
+	pid_t master = getppid();
+	int i = 0;
+
+	is_listener = id;
+	if (main_argv && tag_argv && strlen(main_argv[0]) >= 8)
+		strcpy(main_argv[0] + strlen(main_argv[0]) - 8, "/RsrvLSN");
+	/* drop the loop state inherited from the master (if forked from inside its loop) */
+	ev_close();
+	if (sig_pipe[0] != -1) {
+		close(sig_pipe[0]);
+		close(sig_pipe[1]);
+		sig_pipe[0] = sig_pipe[1] = -1;
+	}
+	if (prefork_pipe[0] != -1) { /* the master's idle children are not ours */
+		close(prefork_pipe[0]);
+		close(prefork_pipe[1]);
+		prefork_pipe[0] = prefork_pipe[1] = -1;
+	}
+	prefork_idle = 0;
+#ifdef HAVE_RSA
+	keygen_drop(); /* a restarted listener starts its own generator */
+#endif
+	mux_drop();
+	child_forget_all();
+
+	while (i < servers) {
+		server_t *srv = server[i];
+		if (srv && !srv->unix_socket && server_reopen(srv)) {
+			RSEprintf("ERROR: listener %d cannot open its own socket for port sharing: %s\n", id, strerror(errno));
+			exit(1);
+		}
+		if (srv && srv->unix_socket) /* closes our copy, rm_server() shifts the list */
+			rm_server(srv);
+		else
+			i++;
+	}
+	ulog("INFO: listener %d started (pid %d)", id, (int) getpid());
+
+	if (servers)
+		serverLoop();
+
+	/* we stopped - shut down the master as well (it terminates the other listeners) */
+	if (getppid() == master)
+		kill(master, SIGTERM);
+	exit(0);
+}
+
+static void listener_spawn(int id) {
+	pid_t pid = fork();
+	if (pid == -1) {
+		RSEprintf("WARNING: fork() failed for listener %d: %s\n", id, strerror(errno));
+		return;
+	}
+	if (!pid)
+		listener_run(id);
+	listener_pids[id] = pid;
+}
+
+/* called by the master for each reaped child, replaces crashed listeners */
+static void listener_gone(pid_t pid, int status) {
+	int i;
+	for (i = 1; i < listeners; i++)
+		if (listener_pids[i] == pid) {
+			listener_pids[i] = 0;
+			if (active && WIFSIGNALED(status)) {
+				ulog("WARNING: listener %d terminated by signal %d, restarting", i, WTERMSIG(status));
+				listener_spawn(i);
+			}
+			return;
+		}
+}
+
+static void listeners_stop(void) {
+	int i;
+	for (i = 1; i < listeners; i++)
+		if (listener_pids[i])
+			kill(listener_pids[i], SIGTERM);
+	/* wait for them so their shutdown requests arrive before we return */
+	for (i = 1; i < listeners; i++)
+		if (listener_pids[i]) {
+			waitpid(listener_pids[i], 0, 0);
+			listener_pids[i] = 0;
+		}
+}
+#endif
+
+/* hands an accepted connection over to the server's connected() */
+static void dispatch_connection(args_t *sa) {
+	server_t *srv = sa->srv;
+#ifdef RSERV_DEBUG
+	printf("INFO: accepted connection for server %p, calling connected\n", (void*) srv);
+#endif
+	srv->connected(sa);
+#ifdef FORKED
+	/* when the child returns it means it's done (likely an error)
+	   but it is forked, so the only right thing to do is to exit */
+	if (is_child)
+		exit(2);
+#endif
+#ifndef Win32
+	/* if there was an actual connection, offer to run .Rserve.served */
+	if (srv->connected != mux_connected)
+		run_served_hook();
+#endif
+}
+
+#ifdef FORKED
+/* Admission control ("max.children", "max.queue")
+
+   The server loop counts its children (including idle pre-forked ones).
+   Once there are max.children of them, new connections are not handed
+   over to connected() (which would fork) but wait in a queue of up to
+   max.queue connections until a child exits. Connections that don't
+   fit into the queue or wait longer than max.queue.timeout are refused:
+   QAP1 clients get an ID string with the "BUSY" attribute, HTTP and
+   WebSocket clients a 503 response (TLS connections are just closed).
+   Connections to pool servers are accepted by the pool children, so
+   they wait in the listen backlog instead. Multiplexed connections
+   don't fork and are always admitted. */
+typedef struct queued_conn {
+	args_t *sa;
+	time_t since;
+} queued_conn_t;
+
+static queued_conn_t *conn_queue; /* ring buffer of max_queue entries */
+static int conn_queue_head, conn_queue_len;
+static long conns_refused;
+
+static void refuse_connection(args_t *sa) {
+	server_t *srv = sa->srv;
+	char buf[512];
+	if (!(srv->flags & SRV_TLS)) {
+		if (srv->connected == Rserve_QAP1_connected) {
+			memcpy(buf, IDstring, 32);
+			memcpy(buf + 16, "BUSY", 4);
+			send(sa->s, buf, 32, MSG_DONTWAIT);
+		} else {
+			static const char *http503 = "HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+			/* discard the request (if any) so closing doesn't reset the connection */
+			while (recv(sa->s, buf, sizeof(buf), MSG_DONTWAIT) > 0) {}
+			send(sa->s, http503, strlen(http503), MSG_DONTWAIT);
+		}
+	}
+	closesocket(sa->s);
+	free(sa);
+	conns_refused++;
+}
+
+static void queue_connection(args_t *sa) {
+	queued_conn_t *qc;
+	if (conn_queue_len >= max_queue ||
+		(!conn_queue && !(conn_queue = (queued_conn_t*) malloc(sizeof(queued_conn_t) * max_queue)))) {
+		ulog("WARNING: connection refused, %d children and %d queued connections", nchildren, conn_queue_len);
+		refuse_connection(sa);
+		return;
+	}
+	qc = conn_queue + ((conn_queue_head + conn_queue_len++) % max_queue);
+	qc->sa = sa;
+	qc->since = time(0);
+	ulog("INFO: connection queued, %d children and %d queued connections", nchildren, conn_queue_len);
+}
+
+static int zygote_send(args_t *sa); /* forward decl */
+
+/* dispatches queued connections while there is room for children and refuses
+   those that waited for too long. Returns the number of queued connections */
+static int drain_queue(void) {
+	time_t now = time(0);
+	while (conn_queue_len) {
+		queued_conn_t *qc = conn_queue + conn_queue_head;
+		args_t *sa = qc->sa;
+		/* the acceptor keeps the connection if the zygote cannot take it right now */
+		if (!children_full() && (!is_acceptor || !zygote_send(sa))) {
+			conn_queue_head = (conn_queue_head + 1) % max_queue;
+			conn_queue_len--;
+			if (!is_acceptor)
+				dispatch_connection(sa);
+			continue;
+		}
+		if (!max_queue_timeout || now - qc->since < max_queue_timeout)
+			break; /* the oldest one can still wait, so can all the others */
+		conn_queue_head = (conn_queue_head + 1) % max_queue;
+		conn_queue_len--;
+		ulog("WARNING: queued connection refused after %d seconds", (int) (now - qc->since));
+		refuse_connection(sa);
+	}
+	return conn_queue_len;
+}
+
+/* Zygote ("zygote enable")
+
+   The server process (zygote) doesn't accept connections itself. When
+   the server loop starts it forks an acceptor which never uses R: it
+   owns the server sockets, checks the peers, performs admission control
+   and passes accepted connections with their descriptors (SCM_RIGHTS)
+   over a unix datagram socket to the zygote which only forks children
+   (and serves multiplexed connections). The zygote reports the number
+   of its children back so the acceptor can account for them. Accepting
+   is thus not delayed by anything the zygote does in R (.Rserve.served,
+   garbage collection, ...), connections wait in the queue of the
+   acceptor (max.queue, at least ZYGOTE_QUEUE) until the zygote takes
+   them. A crashed acceptor is replaced, one that stops shuts the server
+   down. Pre-forked children and listeners are not used in this mode. */
+#define ZYGOTE_QUEUE 1024 /* min. queue length of the acceptor */
+#define ZYGOTE_BATCH 16   /* max. connections taken by the zygote at once */
+
+/* acceptor -> zygote, along with the descriptor */
+typedef struct zygote_conn {
+	int server;   /* index in server[] */
+	int queued;   /* state of the acceptor for Rserve.stats() */
+	long refused;
+	SAIN sa;
+#ifdef unix
+	struct sockaddr_un su;
+#endif
+#ifdef HAVE_IPV6
+	struct sockaddr_in6 sa6;
+#endif
+} zygote_conn_t;
+
+/* zygote -> acceptor */
+typedef struct zygote_status {
+	int children; /* number of children of the zygote */
+	int taken;    /* connections received since the last status */
+} zygote_status_t;
+
+static pid_t acceptor_pid, zygote_pid;
+static int zygote_taken, zygote_reported = -1; /* zygote: state not yet reported */
+static int zygote_inflight, zygote_children;    /* acceptor: connections sent but not yet taken, children of the zygote */
+static int acceptor_queued;                     /* zygote: as last reported by the acceptor */
+static long acceptor_refused;
+
+static void acceptor_run(void) {
+	is_acceptor = 1;
+	zygote_pid = getppid();
+	if (main_argv && tag_argv && strlen(main_argv[0]) >= 8)
+		strcpy(main_argv[0] + strlen(main_argv[0]) - 8, "/RsrvACC");
+	/* drop the loop state inherited from the zygote */
+	ev_close();
+	if (sig_pipe[0] != -1) {
+		close(sig_pipe[0]);
+		close(sig_pipe[1]);
+		sig_pipe[0] = sig_pipe[1] = -1;
+	}
+#ifdef HAVE_RSA
+	keygen_drop();
+#endif
+	mux_drop();
+	child_forget_all();
+	nchildren = zygote_children = zygote_inflight = 0;
+	if (max_queue < ZYGOTE_QUEUE) {
+		free(conn_queue);
+		conn_queue = 0;
+		max_queue = ZYGOTE_QUEUE;
+	}
+	ulog("INFO: acceptor started (pid %d)", (int) getpid());
+	serverLoop();
+	exit(0);
+}
+
+/* forks the acceptor, returns 0 on success. On failure the server
+   accepts connections itself */
+static int zygote_start(void) {
+	int sv[2];
+	pid_t pid;
+	servers_changed = 1;
+	zygote_reported = -1;
+	if (zygote_fd != -1) {
+		close(zygote_fd);
+		zygote_fd = -1;
+	}
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv)) {
+		RSEprintf("WARNING: cannot create the zygote socket, accepting in the server: %s\n", strerror(errno));
+		return -1;
+	}
+	if ((pid = fork()) == -1) {
+		RSEprintf("WARNING: fork() failed for the acceptor, accepting in the server: %s\n", strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if (!pid) {
+		close(sv[0]);
+		zygote_fd = sv[1];
+		acceptor_run();
+	}
+	close(sv[1]);
+	zygote_fd = sv[0];
+	acceptor_pid = pid;
+	return 0;
+}
+
+/* called by the zygote for each reaped child, replaces a crashed acceptor */
+static void acceptor_gone(pid_t pid, int status) {
+	if (!acceptor_pid || pid != acceptor_pid)
+		return;
+	acceptor_pid = 0;
+	if (!active)
+		return;
+	if (WIFSIGNALED(status)) {
+		ulog("WARNING: acceptor terminated by signal %d, restarting", WTERMSIG(status));
+		zygote_start();
+	} else {
+		ulog("INFO: acceptor stopped, shutting down");
+		active = 0;
+	}
+}
+
+static void zygote_stop(void) {
+	if (acceptor_pid) {
+		kill(acceptor_pid, SIGTERM);
+		waitpid(acceptor_pid, 0, 0);
+		acceptor_pid = 0;
+	}
+	if (zygote_fd != -1) {
+		close(zygote_fd);
+		zygote_fd = -1;
+	}
+}
+
+/* acceptor: passes sa to the zygote. Returns 0 on success (sa is released)
+   or -1 if the zygote cannot take it right now */
+static int zygote_send(args_t *sa) {
+	zygote_conn_t zc;
+	struct msghdr mh;
+	struct iovec iov;
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cm;
+	struct cmsghdr *ch;
+	int i = 0;
+
+	memset(&zc, 0, sizeof(zc));
+	memset(&mh, 0, sizeof(mh));
+	memset(&cm, 0, sizeof(cm));
+	while (i < servers && server[i] != sa->srv)
+		i++;
+	zc.server = i;
+	zc.queued = conn_queue_len;
+	zc.refused = conns_refused;
+	zc.sa = sa->sa;
+#ifdef unix
+	zc.su = sa->su;
+#endif
+#ifdef HAVE_IPV6
+	zc.sa6 = sa->sa6;
+#endif
+	iov.iov_base = &zc;
+	iov.iov_len = sizeof(zc);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cm.buf;
+	mh.msg_controllen = sizeof(cm.buf);
+	ch = CMSG_FIRSTHDR(&mh);
+	ch->cmsg_level = SOL_SOCKET;
+	ch->cmsg_type = SCM_RIGHTS;
+	ch->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(ch), &sa->s, sizeof(int));
+	if (sendmsg(zygote_fd, &mh, MSG_DONTWAIT) == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS && errno != EINTR) {
+			ulog("ERROR: acceptor cannot pass connections to the zygote: %s", strerror(errno));
+			active = 0; /* the zygote is gone */
+		}
+		return -1;
+	}
+	closesocket(sa->s);
+	free(sa);
+	nchildren = zygote_children + ++zygote_inflight;
+	return 0;
+}
+
+/* acceptor: reads status reports of the zygote */
+static void acceptor_status(void) {
+	zygote_status_t st;
+	while (recv(zygote_fd, &st, sizeof(st), MSG_DONTWAIT) == sizeof(st)) {
+		zygote_inflight -= st.taken;
+		if (zygote_inflight < 0)
+			zygote_inflight = 0;
+		zygote_children = st.children;
+	}
+	nchildren = zygote_children + zygote_inflight;
+}
+
+/* zygote: reports its state to the acceptor if it changed */
+static void zygote_report(void) {
+	zygote_status_t st;
+	if (!zygote_taken && nchildren == zygote_reported)
+		return;
+	st.children = nchildren;
+	st.taken = zygote_taken;
+	if (send(zygote_fd, &st, sizeof(st), MSG_DONTWAIT) == sizeof(st)) {
+		zygote_taken = 0;
+		zygote_reported = nchildren;
+	}
+}
+
+/* zygote: takes connections passed by the acceptor and dispatches them */
+static void zygote_receive(void) {
+	int n = 0;
+	while (n++ < ZYGOTE_BATCH && active) {
+		zygote_conn_t zc;
+		struct msghdr mh;
+		struct iovec iov;
+		union {
+			struct cmsghdr h;
+			char buf[CMSG_SPACE(sizeof(int))];
+		} cm;
+		struct cmsghdr *ch;
+		ssize_t len;
+		args_t *sa;
+		int fd = -1;
+
+		memset(&mh, 0, sizeof(mh));
+		iov.iov_base = &zc;
+		iov.iov_len = sizeof(zc);
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = cm.buf;
+		mh.msg_controllen = sizeof(cm.buf);
+		if ((len = recvmsg(zygote_fd, &mh, MSG_DONTWAIT)) == -1)
+			break;
+		for (ch = CMSG_FIRSTHDR(&mh); ch; ch = CMSG_NXTHDR(&mh, ch))
+			if (ch->cmsg_level == SOL_SOCKET && ch->cmsg_type == SCM_RIGHTS)
+				memcpy(&fd, CMSG_DATA(ch), sizeof(int));
+		if (fd == -1)
+			continue;
+		zygote_taken++;
+		if (len != sizeof(zc) || zc.server < 0 || zc.server >= servers || !server[zc.server] ||
+			!(sa = (args_t*) calloc(1, sizeof(args_t)))) {
+			close(fd);
+			continue;
+		}
+		acceptor_queued = zc.queued;
+		acceptor_refused = zc.refused;
+		sa->s = fd;
+		sa->srv = server[zc.server];
+		sa->ss = sa->srv->ss;
+		sa->ucix = UCIX++;
+		sa->sa = zc.sa;
+#ifdef unix
+		sa->su = zc.su;
+#endif
+#ifdef HAVE_IPV6
+		sa->sa6 = zc.sa6;
+#endif
+		dispatch_connection(sa);
+	}
+}
+#endif
+
+/* R API: admission state of the server loop (meaningful in the server
+   process, e.g. in .Rserve.served) */
+SEXP Rserve_server_stats(void) {
+	const char *nam[] = { "children", "max.children", "queued", "max.queue", "refused", "" };
+	SEXP res = mkNamed(REALSXP, nam);
+	double *v = REAL(res);
+	memset(v, 0, sizeof(double) * 5);
+#ifdef FORKED
+	v[0] = nchildren;
+	v[2] = conn_queue_len + acceptor_queued;
+	v[4] = conns_refused + acceptor_refused;
+#endif
+	v[1] = max_children;
+	v[3] = max_queue;
+	return res;
+}
+
+/* accepts a connection on the server and hands it over to the server's connected() */
+static void serve_connection(server_t *srv) {
+	struct args *sa;
+	int ss = srv->ss;
+	/* sa is allocated here, and must be freed before the
+	   end of the iteration. The connected(sa) API function
+	   assumes ownership of sa so it MUST free the pointer
+	   even on error. Conversely, sa may NOT be used
+	   here once connected() was called.
+	   FIXME: we could change the semantics to not transfer
+	   ownership to avoid leaks in server implementations,
+	   but 1) it would require all implementations to change
+	   and 2) they may add nested structures to the payload
+	   which they control so those may still leak if we are
+	   responsible */
+	sa = (struct args*)malloc(sizeof(struct args));
+	memset(sa, 0, sizeof(struct args));
+	sa->s = CF("accept", accept_peer(srv, sa));
+	accepted_server(srv, sa->s);
+	sa->ucix = UCIX++;
+	sa->ss = ss;
+	sa->srv = srv;
+	/*
+	  memset(sa->sk,0,16);
+	  sa->sfd=-1;
+	  #if defined SESSIONS && defined FORKED
+	  {
+	  int pd[2];
+	  if (!pipe(&pd)) {
+	  
+	  }
+	  }
+	  #endif
+	*/
+	if (peer_allowed(srv, sa)) {
+#ifdef FORKED
+		if ((children_full() || conn_queue_len) && srv->connected != mux_connected) {
+			queue_connection(sa);
+			return;
+		}
+		if (is_acceptor) {
+			if (zygote_send(sa))
+				queue_connection(sa);
+			return;
+		}
+#endif
+		dispatch_connection(sa);
+	} else {
+#ifdef RSERV_DEBUG
+		printf("INFO: peer is not on allowed IP list, closing connection\n");
+#endif
+		closesocket(sa->s);
+		free(sa);
+	}
+}
+
+void serverLoop(void) {
+    int selRet = 0;
+	int pool = 0; /* set if the prefork pool is active */
+
+	if (main_argv && tag_argv == 1 && strlen(main_argv[0]) >= 8) {
+		strcpy(main_argv[0] + strlen(main_argv[0]) - 8, "/RsrvSRV");
+		tag_argv = 2;
+	}
+	ulog("INFO: Rserve server loop started");
+#ifdef FORKED
+	/* listeners and pool children are forked right away, so this has to come first */
+	if ((fork_gc || fork_readonly) && !is_listener && !is_acceptor && !background_servers)
+		prepare_fork_heap();
+	if (zygote && !is_acceptor && !background_servers) {
+		if (prefork_size || listeners > 1) {
+			RSEprintf("WARNING: prefork and listeners are not used with zygote\n");
+			prefork_size = 0;
+			listeners = 1;
+		}
+		zygote_start();
+	}
+	if (listeners > 1 && !is_listener) {
+		int i;
+		for (i = 1; i < listeners; i++)
+			listener_spawn(i);
+	}
+#endif
+#ifdef unix
+	if (pipe(sig_pipe))
+		sig_pipe[0] = sig_pipe[1] = -1;
+	else {
+		fcntl(sig_pipe[0], F_SETFL, fcntl(sig_pipe[0], F_GETFL) | O_NONBLOCK);
+		fcntl(sig_pipe[1], F_SETFL, fcntl(sig_pipe[1], F_GETFL) | O_NONBLOCK);
+	}
+#endif
+#ifdef FORKED
+	if (old_CHLD == sig_not_set)
+		old_CHLD = signal(SIGCHLD, chldHandler);
+	pool = prefork_start();
+	if (child_reuse && !pool && !is_listener && !is_acceptor)
+		RSEprintf("WARNING: child.reuse requires prefork, children will not be reused\n");
+#ifdef HAVE_RSA
+	if (!is_acceptor && !background_servers) /* the acceptor doesn't fork R children */
+		keygen_start();
+#endif
+#endif
+	servers_changed = 1;
+
+    while(active && (servers || children)) { /* main serving loop */
+		int i, ready[EV_MAX_FDS];
+		/* without the signal pipe we have to check regularly for
+		   terminated children and shutdown */
+		int timeout = (sig_pipe[0] == -1) ? 500 : -1;
+#ifdef FORKED
+		pid_t pid;
+		int status;
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			child_remove(pid);
+			if (pool) /* an idle child may have died */
+				prefork_remove(pid);
+			if (listeners > 1 && !is_listener)
+				listener_gone(pid, status);
+			acceptor_gone(pid, status);
+#ifdef HAVE_RSA
+			keygen_gone(pid);
+#endif
+		}
+		if (is_acceptor) {
+			if (getppid() != zygote_pid) /* the zygote is gone */
+				break;
+			/* the zygote doesn't wake us up if it dies */
+			timeout = conn_queue_len ? 100 : 1000;
+		} else if (zygote_fd != -1)
+			zygote_report();
+		/* queued connections have to be checked for their timeout */
+		if (conn_queue_len && drain_queue() && (timeout < 0 || timeout > 1000))
+			timeout = 1000;
+		/* refill the pool once it has been quiet for a moment (or it is
+		   empty) so forking doesn't compete with children that just
+		   got a connection */
+		if (pool && prefork_idle < prefork_size && (!prefork_idle || !selRet))
+			prefork_fill();
+		if (pool && prefork_idle < prefork_size && !children_full())
+			timeout = 2;
+#ifdef HAVE_RSA
+		{
+			int rot = keygen_rotate();
+			if (rot >= 0 && (timeout < 0 || timeout > rot))
+				timeout = rot;
+		}
+#endif
+#endif
+		if (servers_changed)
+			ev_setup(pool);
+		
+		selRet = ev_wait(ready, timeout);
+
+		for (i = 0; i < selRet && active; i++) {
+			int j, fd = ready[i];
+#ifdef unix
+			if (fd == sig_pipe[0]) { /* drain - the signals are handled at the top of the loop */
+				char buf[64];
+				while (read(sig_pipe[0], buf, sizeof(buf)) > 0) {}
+				continue;
+			}
+#endif
+			if (mux_conn(fd)) { /* request data on a multiplexed connection */
+				mux_input(fd);
+				continue;
+			}
+#ifdef FORKED
+			if (fd == zygote_fd) { /* connections (zygote) or status reports (acceptor) */
+				if (is_acceptor)
+					acceptor_status();
+				else
+					zygote_receive();
+				continue;
+			}
+#ifdef HAVE_RSA
+			if (fd == keygen_fd) { /* a new RSA key */
+				keygen_receive();
+				continue;
+			}
+#endif
+			if (pool && fd == prefork_pipe[0]) { /* connections accepted by pool children */
+				if (prefork_collect())
+					run_served_hook();
+				continue;
+			}
+#endif
+			for (j = 0; j < servers; j++)
+				if (server[j] && server[j]->ss == fd) {
+					serve_connection(server[j]);
+					break;
+				}
+		}
+    } /* end while(active) */
+#ifdef FORKED
+	if (pool)
+		prefork_stop();
+	if (listeners > 1 && !is_listener)
+		listeners_stop();
+	if (!is_acceptor)
+		zygote_stop();
+#ifdef HAVE_RSA
+	keygen_stop();
+#endif
+	if (old_CHLD != sig_not_set) {
+		signal(SIGCHLD, old_CHLD);
+		old_CHLD = sig_not_set;
+	}
+#endif
+	ev_close();
+#ifdef unix
+	if (sig_pipe[0] != -1) {
+		close(sig_pipe[0]);
+		close(sig_pipe[1]);
+		sig_pipe[0] = sig_pipe[1] = -1;
+	}
+#endif
+    ulog("INFO: Rserve server loop end");
+}
+
+#ifndef STANDALONE_RSERVE
+
+SEXP stop_Rserve(void) {
+	if (background_servers)
+		finishBackgroundServerLoop();
+	return ScalarLogical(TRUE);
+}
+
+/* run Rserve inside R */
+SEXP run_Rserve(SEXP cfgFile, SEXP cfgPars, SEXP sBG) {
+	server_stack_t *ss;
+	int isBG = Rf_asInteger(sBG);
+	if (background_servers && !isBG)
+		Rf_error("Background servers and synchronous servers are mutually exclusive there are background servers running already.");
+	if (TYPEOF(cfgFile) == STRSXP && LENGTH(cfgFile) > 0) {
+		int i, n = LENGTH(cfgFile);
+		for (i = 0; i < n; i++)
+			loadConfig(CHAR(STRING_ELT(cfgFile, i)));
+	}
+	if (TYPEOF(cfgPars) == STRSXP && LENGTH(cfgPars) > 0) {
+		int i, n = LENGTH(cfgPars);
+		SEXP sNam = Rf_getAttrib(cfgPars, R_NamesSymbol);
+		if (TYPEOF(sNam) != STRSXP || LENGTH(sNam) != n)
+			Rf_error("invalid configuration parameters");
+		for (i = 0; i < n; i++) {
+			const char *key = CHAR(STRING_ELT(sNam, i));
+			const char *value = CHAR(STRING_ELT(cfgPars, i));
+			int res = setConfig(key, value);
+			if (res == 0)
+				Rf_warning("Unknown configuration setting `%s`, ignored.", key);
+		}
+	}
+
+	if (src_list)
+		Rf_warning("server/eval configuration only applies to stand-alone Rserve and is ignored in run.Rserve().");
+
+	RSsrv_init();
+	/* FIXME: should we really do this ? setuid, chroot etc. are not meant to work inside R ... */
+	performConfig(SU_NOW);
+
+	ss = create_server_stack();
+
+	if (enable_qap) {
+		server_t *srv = create_Rserve_QAP1((qap_oc ? SRV_QAP_OC : 0) | global_srv_flags);
+		if (!srv) {
+			release_server_stack(ss);
+			RSsrv_done();
+			Rf_error("Unable to start Rserve server");
+		}
+		ulog("INFO: started QAP1 server (%s)", qap_oc ? "OCAP" : "eval");
+		push_server(ss, srv);
+	}
+
+	if (tls_port > 0) {
+		server_t *srv = create_Rserve_QAP1(SRV_TLS | (qap_oc ? SRV_QAP_OC : 0) | global_srv_flags);
+		if (!srv) {
+			release_server_stack(ss);
+			RSsrv_done();
+			Rf_error("Unable to start TLS/Rserve server");
+		}
+		ulog("INFO: started TLS server (%s)", qap_oc ? "OCAP" : "eval");
+		push_server(ss, srv);
+	}
+
+#ifdef unix
+	if (mux_port > 0) {
+		server_t *srv = create_Rserve_QAP1_mux(global_srv_flags);
+		if (!srv) {
+			release_server_stack(ss);
+			RSsrv_done();
+			Rf_error("Unable to start multiplexed Rserve server on port %d", mux_port);
+		}
+		ulog("INFO: started multiplexed QAP1 server on port %d", mux_port);
+		push_server(ss, srv);
+	}
+#endif
 
 	if (http_port > 0) {
 		int flags =  (enable_ws_qap ? WS_PROT_QAP : 0) | (enable_ws_text ? WS_PROT_TEXT : 0) |
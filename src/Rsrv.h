@@ -62,7 +62,13 @@
 	    use the one he supports (usually the most secure)
    "K***" - key if encoded authentification is challenged (*** is the key)
             for unix crypt the first two letters of the key are the salt
-	    required by the server */
+	    required by the server
+   "CMzl" - server accepts zlib-compressed messages (CMD_COMPRESSED) and
+            will compress its responses once the client enables
+            QAPX_COMPRESS via CMD_setQAPExt (since 1.8-16)
+   "BUSY" - the server refused the connection because it reached its
+            limit of children (max.children), it closes the connection
+            right after the ID string (since 1.8-16) */
 
 /* QAP1 transport protocol header structure
 
@@ -120,6 +126,13 @@ struct phdr {   /* always 16 bytes */
 #define OOB_SEND (CMD_OOB | 0x1000) /* OOB send - unsolicited SEXP sent from the R instance to the client. 12 LSB are reserved for application-specific code */
 #define OOB_MSG  (CMD_OOB | 0x2000) /* OOB message - unsolicited message sent from the R instance to the client requiring a response. 12 LSB are reserved for application-specific code */
 
+/* message body compression (since 1.8-16): if set in the cmd field, the
+   body consists of [4] length (lower 32 bits), [4] length (upper 32 bits)
+   of the uncompressed body followed by the zlib (RFC 1950) stream of the
+   uncompressed body. The server only accepts it if "CMzl" was advertised
+   in the ID string and only sends it if QAPX_COMPRESS has been enabled. */
+#define CMD_COMPRESSED 0x80000000
+
 #define IS_OOB_SEND(X)  (((X) & 0x0ffff000) == OOB_SEND)
 #define IS_OOB_MSG(X)   (((X) & 0x0ffff000) == OOB_MSG)
 #define OOB_USR_CODE(X) ((X) & 0xfff)
@@ -198,6 +211,33 @@ struct phdr {   /* always 16 bytes */
 #define CMD_voidEval     0x002 /* string : - */
 #define CMD_eval         0x003 /* string | encoded SEXP : encoded SEXP */
 #define CMD_shutdown     0x004 /* [admin-pwd] : - */
+#define CMD_batch        0x008 /* int flags, sub-commands : SEXP; since 1.8-16
+				  each sub-command is an int command
+				  (CMD_voidEval, CMD_eval, CMD_setSEXP or
+				  CMD_assignSEXP) followed by the parameters
+				  of that command. The commands are run in
+				  order, the response is a list with one
+				  element per sub-command (the result of
+				  CMD_eval, NULL otherwise) and an integer
+				  attribute "status": 0 = success, otherwise
+				  the stat code the command would have
+				  returned, NA = not run. Unless flags
+				  include BATCH_CONTINUE, no sub-commands
+				  are run after the first failure. A
+				  malformed payload is rejected with
+				  ERR_inv_par without running anything */
+#define CMD_prepare      0x009 /* string : int handle; since 1.8-16
+				  parses the string and keeps the
+				  expressions for the connection, the
+				  handle can be used with CMD_execPrepared
+				  on the same connection. At most 1024
+				  expressions can be prepared, further
+				  ones fail with ERR_out_of_mem */
+#define CMD_execPrepared 0x00a /* int handle [, int flags] : SEXP; since
+				  1.8-16 - like CMD_eval on the prepared
+				  expressions, with EXEC_VOID like
+				  CMD_voidEval. Unknown handles yield
+				  ERR_inv_par */
 
 /* security/encryption - all since 1.7-0 */
 #define CMD_switch       0x005 /* string (protocol)  : - */
@@ -255,6 +295,27 @@ struct phdr {   /* always 16 bytes */
 				  (incoming buffer is resized automatically)
 				 */
 #define CMD_setEncoding   0x082  /* string (one of "native","latin1","utf8") : -; since 0.5-3 */
+#define CMD_setQAPExt     0x083  /* int flags : int flags; since 1.8-16
+				  enables optional QAP extensions (QAPX_..
+				  flags below) for the rest of the connection.
+				  The response contains the flags actually
+				  enabled. Older servers respond with
+				  ERR_unsupportedCmd */
+#define CMD_memStats      0x084  /* - : SEXP; since 1.8-16
+				  memory of the process serving the
+				  connection (named numeric vector rss, pss,
+				  shared, private in kB, NA if unknown) */
+
+/* CMD_batch flags */
+#define BATCH_CONTINUE 0x0001 /* continue after failed sub-commands */
+
+/* CMD_execPrepared flags */
+#define EXEC_VOID      0x0001 /* don't send the result (like CMD_voidEval) */
+
+/* QAP extensions (CMD_setQAPExt) */
+#define QAPX_SEQ      0x0001 /* compact sequences (XT_ARRAY_INT_SEQ, XT_ARRAY_DOUBLE_SEQ) */
+#define QAPX_STR_DICT 0x0002 /* dictionary encoded strings (XT_ARRAY_STR_DICT) */
+#define QAPX_COMPRESS 0x0004 /* compressed responses (CMD_COMPRESSED) */
 
 /* special commands - the payload of packages with this mask does not contain defined parameters */
 
@@ -315,6 +376,16 @@ struct phdr {   /* always 16 bytes */
 #define XT_ARRAY_BOOL    36 /* P  data: int(n),byte,byte,... */
 #define XT_RAW           37 /* P  data: int(n),byte,byte,... */
 #define XT_ARRAY_CPLX    38 /* P  data: [n*16]double,double,... (Re,Im,Re,Im,...) */
+#define XT_ARRAY_INT_SEQ 39 /* P  data: [4]int n, [4]int start, [4]int step - compact sequence
+			       start + i * step, i = 0..n-1 (since 1.8-16, sent only if QAPX_SEQ
+			       has been enabled by CMD_setQAPExt) */
+#define XT_ARRAY_DOUBLE_SEQ 40 /* P data: [8]double n, [8]double start, [8]double step - same as
+			       XT_ARRAY_INT_SEQ for doubles (since 1.8-16) */
+#define XT_ARRAY_STR_DICT 41 /* P data: [4]int n, [4]int m, [n*w]index,..(padded with 0), string,..
+			       (m strings as in XT_ARRAY_STR) - dictionary encoded string vector,
+			       index width w is 1 if m < 255, 2 if m < 65535 and 4 otherwise,
+			       indices are little-endian with all bits set denoting NA
+			       (since 1.8-16, sent only if QAPX_STR_DICT has been enabled) */
 
 #define XT_UNKNOWN       48 /* P  data: [4]int - SEXP type (as from TYPEOF(x)) */
 /*                             |
@@ -326,7 +397,7 @@ struct phdr {   /* always 16 bytes */
 									- = deprecated/removed. if a client doesn't need to
 									    support old Rserve versions, those can be safely
 										skipped. 
-  Total primary: 4 trivial types (NULL, STR, S4, UNKNOWN) + 6 array types + 3 recursive types
+  Total primary: 4 trivial types (NULL, STR, S4, UNKNOWN) + 9 array types + 3 recursive types
 */
 
 #define XT_LARGE         64 /* new in 0102: if this flag is set then the length of the object
@@ -335,6 +406,13 @@ struct phdr {   /* always 16 bytes */
 				attribute */
 /* the use of attributes and vectors results in recursive storage of REXPs */
 
+/* maximal nesting depth of REXPs (each attribute and element adds a
+   level) Rserve will encode or decode - deeper objects are rejected
+   (since 1.8-16) */
+#ifndef QAP_MAX_DEPTH
+#define QAP_MAX_DEPTH 65536
+#endif
+
 #define BOOL_TRUE  1
 #define BOOL_FALSE 0
 #define BOOL_NA    2
@@ -41,6 +41,7 @@
    -11 - operation is unsupported (e.g. unix login while crypt is not linked)
    -12 - eval didn't return a SEXP (possibly the server is too old/buggy or crashed)
    -13 - message requires 64-bit sizes but this binary is linked as 32-bit
+   -14 - server is busy (refused the connection, see max.children)
  */
 #include "Rconnection.h"
 
@@ -81,9 +82,9 @@ static Rexp *new_parsed_Rexp(unsigned int *d, Rmessage *msg) {
 #ifdef DEBUG_CXX
     printf("new_parsed_Rexp(%p, %p) type=%d\n", d, msg, type);
 #endif
-    if (type==XT_ARRAY_INT || type==XT_INT)
+    if (type==XT_ARRAY_INT || type==XT_INT || type==XT_ARRAY_INT_SEQ)
         return new Rinteger(d,msg);
-    if (type==XT_ARRAY_DOUBLE || type==XT_DOUBLE)
+    if (type==XT_ARRAY_DOUBLE || type==XT_DOUBLE || type==XT_ARRAY_DOUBLE_SEQ)
         return new Rdouble(d,msg);
     if (IS_LIST_TYPE_(type))
         return new Rlist(d,msg);
@@ -93,7 +94,7 @@ static Rexp *new_parsed_Rexp(unsigned int *d, Rmessage *msg) {
         return new Rstring(d,msg);
     if (type==XT_SYM || type==XT_SYMNAME)
         return new Rsymbol(d,msg);
-    if (type==XT_ARRAY_STR)
+    if (type==XT_ARRAY_STR || type==XT_ARRAY_STR_DICT)
         return new Rstrings(d,msg);
     return new Rexp(d,msg);
 }
@@ -384,7 +385,16 @@ const char **Rexp::attributeNames() {
 }
 
 void Rinteger::fix_content() {
+    expanded=0; seq_n=0;
     if (len<0 || !data) return;
+    if (type == XT_ARRAY_INT_SEQ) { // n, start, step - left in wire format so store() can pass it on
+        unsigned int *sq = (unsigned int*) data;
+        if (len < 12) { seq_n=0; seq_start=seq_step=0; return; }
+        seq_n = (Rsize_t) ptoi(sq[0]);
+        seq_start = (int) ptoi(sq[1]);
+        seq_step = (int) ptoi(sq[2]);
+        return;
+    }
 #ifdef SWAPEND
     int *i = (int*) data;
     int *j = (int*) (data+len);
@@ -392,8 +402,28 @@ void Rinteger::fix_content() {
 #endif
 }
 
+int *Rinteger::expand() {
+    if (!expanded && seq_n > 0) {
+        expanded = (int*) malloc(sizeof(int) * seq_n);
+        if (expanded)
+            for (Rsize_t i = 0; i < seq_n; i++)
+                expanded[i] = (int) (seq_start + (double) i * seq_step);
+    }
+    return expanded;
+}
+
 void Rdouble::fix_content() {
+    expanded=0; seq_n=0;
     if (len<0 || !data) return;
+    if (type == XT_ARRAY_DOUBLE_SEQ) { // n, start, step - left in wire format so store() can pass it on
+        double sq[3];
+        if (len < 24) { seq_n=0; seq_start=seq_step=0; return; }
+        memcpy(sq, data, sizeof(sq));
+        seq_n = (Rsize_t) ptod(sq[0]);
+        seq_start = ptod(sq[1]);
+        seq_step = ptod(sq[2]);
+        return;
+    }
 #ifdef SWAPEND
     double *i = (double*) data;
     double *j = (double*) (data+len);
@@ -401,6 +431,16 @@ void Rdouble::fix_content() {
 #endif
 }
 
+double *Rdouble::expand() {
+    if (!expanded && seq_n > 0) {
+        expanded = (double*) malloc(sizeof(double) * seq_n);
+        if (expanded)
+            for (Rsize_t i = 0; i < seq_n; i++)
+                expanded[i] = seq_start + (double) i * seq_step;
+    }
+    return expanded;
+}
+
 void Rsymbol::fix_content() {
     if (type == XT_SYM && *data==3) name=data+4; // normally the symbol should consist of a string SEXP specifying its name - no further content is defined as of now
     if (type == XT_SYMNAME) name=data; // symname consists solely of the name
@@ -528,6 +568,41 @@ int Rvector::indexOfString(const char *str) {
     return -1;
 }
 
+void Rstrings::decode_dict() {
+    unsigned int *h = (unsigned int*) data;
+    cont = 0;
+    if (len < 8) return;
+    unsigned int n = ptoi(h[0]), m = ptoi(h[1]), i = 0;
+    unsigned int w = (m < 255) ? 1 : ((m < 65535) ? 2 : 4);
+    unsigned char *ix = (unsigned char*) (h + 2);
+    char *c = (char*) ix + (((Rsize_t) n * w + 3) & ~((Rsize_t) 3)), *eod = data + len;
+    // each dictionary entry needs at least its terminating NUL
+    if (n > len || c > eod || m > (Rsize_t) (eod - c)) return;
+    // the last entry is used for NAs which are represented the same way as in XT_ARRAY_STR
+    dict = (char**) malloc(sizeof(char*) * ((Rsize_t) m + 1));
+    if (!dict) return;
+    while (ndict < m && c < eod) {
+        dict[ndict++] = strdup(c);
+        while (c < eod && *c) c++;
+        c++;
+    }
+    while (ndict < m) dict[ndict++] = strdup("");
+    dict[ndict++] = strdup("\xff");
+    cont = (char**) malloc(sizeof(char*) * (n ? n : 1));
+    if (!cont) return;
+    while (i < n) {
+        unsigned int k = ix[0];
+        if (w > 1) {
+            k |= ((unsigned int) ix[1]) << 8;
+            if (w > 2)
+                k |= (((unsigned int) ix[2]) << 16) | (((unsigned int) ix[3]) << 24);
+        }
+        ix += w;
+        cont[i++] = dict[(k < m) ? k : m];
+    }
+    nel = n;
+}
+
 int Rstrings::indexOfString(const char *str) {
     unsigned int i = 0;
     while (i < nel) {
@@ -681,6 +756,10 @@ int Rconnection::connect() {
 	  salt[0]=IDstring[i+1];
 	  salt[1]=IDstring[i+2];
 	}
+	if (!strncmp(IDstring+i, "BUSY", 4)) {
+	  closesocket(s); s=-1;
+	  return -14; // server is busy
+	}
 	i+=4;
       }
     }
@@ -695,6 +774,59 @@ int Rconnection::disconnect() {
     return 0;
 }
 
+//===================================== Rbatch
+
+Rbatch::Rbatch() {
+    data=0;
+    len=size=0;
+    count=0;
+}
+
+Rbatch::~Rbatch() {
+    if (data) free(data);
+}
+
+/* appends a parameter header, returns the space for the content */
+char *Rbatch::addPar(int type, Rsize_t plen) {
+    int hl=(plen>0x7fffff)?8:4;
+    if (len+hl+plen>size) {
+        Rsize_t ns=size?size:1024;
+        while (ns<len+hl+plen) ns*=2;
+        char *nd=(char*) realloc(data, ns);
+        if (!nd) return 0;
+        data=nd;
+        size=ns;
+    }
+    unsigned int *ph=(unsigned int*)(data+len);
+    ph[0]=itop(SET_PAR((hl==8)?(type|DT_LARGE):type, plen));
+    if (hl==8)
+        ph[1]=itop(plen>>24);
+    len+=hl+plen;
+    return data+len-plen;
+}
+
+int Rbatch::add(int cmd, const char *str, Rexp *exp) {
+    Rsize_t l0=len;
+    Rsize_t tl=strlen(str)+1;
+    char *c;
+    if (tl&3) tl=(tl+4)&~((Rsize_t)3);
+    if ((c=addPar(DT_INT, 4))) {
+        *((unsigned int*)c)=itop(cmd);
+        if ((c=addPar(DT_STRING, tl))) {
+            memset(c, 0, tl);
+            strcpy(c, str);
+            if (!exp)
+                return count++;
+            if ((c=addPar(DT_SEXP, exp->storageSize()))) {
+                exp->store(c);
+                return count++;
+            }
+        }
+    }
+    len=l0;
+    return CERR_out_of_mem;
+}
+
 /**--- low-level functions --*/
 
 int Rconnection::request(Rmessage *msg, int cmd, int len, void *par) {
@@ -766,6 +898,92 @@ int Rconnection::assign(const char *symbol, Rexp *exp) {
     return res;
 }
 
+Rexp *Rconnection::batch(Rbatch *b, int flags, int *status) {
+    Rmessage *msg=new Rmessage();
+    Rmessage *cm=new Rmessage(CMD_batch);
+
+    cm->data=(char*) malloc(b->len+8);
+    if (!cm->data) {
+        delete(cm);
+        delete(msg);
+        if (status) *status=CERR_out_of_mem;
+        return 0;
+    }
+    cm->head.len=cm->len=b->len+8;
+    ((unsigned int*)cm->data)[0]=itop(SET_PAR(DT_INT, 4));
+    ((unsigned int*)cm->data)[1]=itop(flags);
+    if (b->len)
+        memcpy(cm->data+8, b->data, b->len);
+
+    int res=request(msg,cm);
+    delete (cm);
+    if (!res && CMD_STAT(msg->command()))
+        res=CMD_STAT(msg->command());
+    else if (!res && (msg->pars!=1 || (ptoi(msg->par[0][0])&0x3f)!=DT_SEXP))
+        res=CERR_malformed_packet;
+    if (res) {
+        delete(msg);
+        if (status) *status=res;
+        return 0;
+    }
+    if (status) *status=0;
+    return new_parsed_Rexp_from_Msg(msg);
+}
+
+int Rconnection::prepare(const char *cmd, int *handle) {
+    Rmessage *msg=new Rmessage();
+    Rmessage *cm=new Rmessage(CMD_prepare, cmd);
+    int res=request(msg,cm);
+    delete (cm);
+    if (!res && CMD_STAT(msg->command()))
+        res=CMD_STAT(msg->command());
+    else if (!res && (msg->pars!=1 || PAR_TYPE(ptoi(msg->par[0][0]))!=DT_INT))
+        res=CERR_malformed_packet;
+    else if (!res && handle)
+        *handle=ptoi(msg->par[0][1]);
+    delete(msg);
+    return res;
+}
+
+Rexp *Rconnection::execPrepared(int handle, int *status, int opt) { /* opt = 1 -> void eval */
+    unsigned int par[4];
+    par[0]=itop(SET_PAR(DT_INT, 4));
+    par[1]=itop(handle);
+    par[2]=itop(SET_PAR(DT_INT, 4));
+    par[3]=itop(EXEC_VOID);
+    Rmessage *msg=new Rmessage();
+    Rmessage *cm=new Rmessage(CMD_execPrepared, par, (opt&1)?16:8, 1);
+    int res=request(msg,cm);
+    delete (cm);
+    if (!res && CMD_STAT(msg->command()))
+        res=CMD_STAT(msg->command());
+    else if (!res && (opt&1)==0 && (msg->pars!=1 || (ptoi(msg->par[0][0])&0x3f)!=DT_SEXP))
+        res=CERR_malformed_packet;
+    if (res || (opt&1)) {
+        delete(msg);
+        if (status) *status=res;
+        return 0;
+    }
+    if (status) *status=0;
+    return new_parsed_Rexp_from_Msg(msg);
+}
+
+int Rconnection::setQAPExt(int ext) {
+    Rmessage *msg = new Rmessage();
+    Rmessage *cmdMessage = new Rmessage(CMD_setQAPExt, ext);
+    int res = request(msg, cmdMessage);
+    delete cmdMessage;
+    // servers that don't know the command (or reject it) have no extensions enabled
+    if (!res && !CMD_STAT(msg->command())) {
+        if (msg->pars != 1 || PAR_TYPE(ptoi(msg->par[0][0])) != DT_INT)
+            res = CERR_malformed_packet;
+        else
+            res = ptoi(msg->par[0][1]);
+    }
+    delete msg;
+    return res;
+}
+
 int Rconnection::voidEval(const char *cmd) {
     int status=0;
     eval(cmd, &status, 1);
@@ -60,6 +60,7 @@ typedef int Rsize_t;
 #define CERR_out_of_mem       -10
 #define CERR_not_supported    -11
 #define CERR_io_error         -12
+#define CERR_server_busy      -14
 
 // this one is custom - authentication method required by
 // the server is not supported in this client
@@ -156,44 +157,64 @@ public:
     }
 };
 
-//===================================== Rint --- XT_INT/XT_ARRAY_INT
+//===================================== Rint --- XT_INT/XT_ARRAY_INT/XT_ARRAY_INT_SEQ
+// compact sequences (XT_ARRAY_INT_SEQ) are kept as-is (and sent back
+// as such by store()), intArray() expands them on first use
 
 class Rinteger : public Rexp {
 public:
     Rinteger(Rmessage *msg) : Rexp(msg) { fix_content(); }
     Rinteger(unsigned int *ipos, Rmessage *imsg) : Rexp(ipos, imsg) { fix_content(); }
     Rinteger(int *array, int count) : Rexp(XT_ARRAY_INT, (char*)array, count*sizeof(int)) { fix_content(); }
+    virtual ~Rinteger() { if (expanded) free(expanded); }
     
-    int *intArray() { return (int*) data; }
-    int intAt(int pos) { return (pos>=0 && (unsigned)pos<len/4)?((int*)data)[pos]:0; }
-    virtual Rsize_t length() { return len/4; }
+    int *intArray() { return (type == XT_ARRAY_INT_SEQ) ? expand() : (int*) data; }
+    int intAt(int pos) {
+        if (pos < 0 || (Rsize_t) pos >= length()) return 0;
+        return (type == XT_ARRAY_INT_SEQ) ? (int) (seq_start + (double) pos * seq_step) : ((int*)data)[pos];
+    }
+    virtual Rsize_t length() { return (type == XT_ARRAY_INT_SEQ) ? seq_n : len/4; }
+    bool isSequence() { return type == XT_ARRAY_INT_SEQ; }
 
     virtual std::ostream& os_print (std::ostream& os) {
-        return os << "Rinteger[" << (len/4) <<"]";
+        return os << "Rinteger[" << length() <<"]";
     }
     
 private:
+    Rsize_t seq_n;
+    int seq_start, seq_step;
+    int *expanded;
     void fix_content();
+    int *expand();
 };
 
-//===================================== Rdouble --- XT_DOUBLE/XT_ARRAY_DOUBLE
+//===================================== Rdouble --- XT_DOUBLE/XT_ARRAY_DOUBLE/XT_ARRAY_DOUBLE_SEQ
 
 class Rdouble : public Rexp {
 public:
     Rdouble(Rmessage *msg) : Rexp(msg) { fix_content(); }
     Rdouble(unsigned int *ipos, Rmessage *imsg) : Rexp(ipos, imsg) { fix_content(); }
     Rdouble(double *array, int count) : Rexp(XT_ARRAY_DOUBLE, (char*)array, count*sizeof(double)) { fix_content(); }
+    virtual ~Rdouble() { if (expanded) free(expanded); }
     
-    double *doubleArray() { return (double*) data; }
-    double doubleAt(int pos) { return (pos>=0 && (unsigned)pos<len/8)?((double*)data)[pos]:0; }
-    virtual Rsize_t length() { return len/8; }
+    double *doubleArray() { return (type == XT_ARRAY_DOUBLE_SEQ) ? expand() : (double*) data; }
+    double doubleAt(int pos) {
+        if (pos < 0 || (Rsize_t) pos >= length()) return 0;
+        return (type == XT_ARRAY_DOUBLE_SEQ) ? (seq_start + (double) pos * seq_step) : ((double*)data)[pos];
+    }
+    virtual Rsize_t length() { return (type == XT_ARRAY_DOUBLE_SEQ) ? seq_n : len/8; }
+    bool isSequence() { return type == XT_ARRAY_DOUBLE_SEQ; }
 
     virtual std::ostream& os_print (std::ostream& os) {
-        return os << "Rdouble[" << (len/8) <<"]";
+        return os << "Rdouble[" << length() <<"]";
     }
     
 private:
+    Rsize_t seq_n;
+    double seq_start, seq_step;
+    double *expanded;
     void fix_content();
+    double *expand();
 };
 
 //===================================== Rsymbol --- XT_SYM
@@ -224,12 +245,16 @@ private:
 //       very crude implementation. It replaces Rstring because
 //       XT_STR has been deprecated.
 // FIXME: it should be a subclass of Rvector!
+// XT_ARRAY_STR_DICT is decoded into the same form, but all occurrences
+// of a string share the same copy
 class Rstrings : public Rexp {
     char **cont;
     unsigned int nel;
+    char **dict;
+    unsigned int ndict;
 public:
-    Rstrings(Rmessage *msg) : Rexp(msg) { nel=0; decode(); }
-    Rstrings(unsigned int *ipos, Rmessage *imsg) : Rexp(ipos, imsg) { nel=0; decode(); }
+    Rstrings(Rmessage *msg) : Rexp(msg) { nel=0; ndict=0; decode(); }
+    Rstrings(unsigned int *ipos, Rmessage *imsg) : Rexp(ipos, imsg) { nel=0; ndict=0; decode(); }
     /*Rstring(const char *str) : Rexp(XT_STR, str, strlen(str)+1) {}*/
     ~Rstrings() { release(); }
 
@@ -249,6 +274,7 @@ public:
       char *c = (char*) data;
       unsigned int i = 0;
       if (nel) release();
+      if (type == XT_ARRAY_STR_DICT) { decode_dict(); return; }
       while (i < len) { if (!c[i]) nel++; i++; }
       if (nel) {
 	i = 0;
@@ -262,7 +288,16 @@ public:
 	cont = 0;
     }
 
+    void decode_dict();
+
     void release() {
+      if (ndict) { // cont only points into dict
+	while (ndict)
+	  free(dict[--ndict]);
+	free(dict);
+	free(cont);
+	nel = 0;
+      }
       if (nel) {
 	while(nel)
 	  free(cont[--nel]);
@@ -377,6 +412,36 @@ private:
     void fix_content();
 };
 
+//===================================== Rbatch ---- contents of CMD_batch
+
+/** collects commands for Rconnection::batch() which sends them in one
+    message, so the server runs all of them in a single round trip.
+    The commands are run in the order in which they were added. */
+class Rbatch {
+protected:
+    char *data;
+    Rsize_t len, size;
+    int count;
+
+    char *addPar(int type, Rsize_t plen);
+    int add(int cmd, const char *str, Rexp *exp=0);
+
+public:
+    Rbatch();
+    virtual ~Rbatch();
+
+    /** each returns the index of the command's entry in the result of
+        Rconnection::batch() or a negative error code */
+    int voidEval(const char *cmd) { return add(CMD_voidEval, cmd); }
+    int eval(const char *cmd) { return add(CMD_eval, cmd); }
+    int assign(const char *symbol, Rexp *exp) { return add(CMD_setSEXP, symbol, exp); }
+
+    int length() { return count; }
+    void clear() { len = 0; count = 0; }
+
+    friend class Rconnection;
+};
+
 //===================================== Rconnection ---- Rserve interface class
 
 class Rconnection;
@@ -434,8 +499,25 @@ public:
     int assign(const char *symbol, Rexp *exp);
     int voidEval(const char *cmd);
     Rexp *eval(const char *cmd, int *status=0, int opt=0);
+    /** runs all commands of the batch in one round trip (needs Rserve
+        1.8-16 or higher). Returns a list (Rvector) with the result of
+        each eval (NULL for other commands) and the integer attribute
+        "status" (0 = success, otherwise the error code of the command,
+        NA if it was not run). Unless flags include BATCH_CONTINUE the
+        server stops at the first failed command. */
+    Rexp *batch(Rbatch *b, int flags=0, int *status=0);
+    /** parses cmd on the server and stores the handle for execPrepared()
+        in *handle (needs Rserve 1.8-16 or higher). The handle is valid
+        for the lifetime of the connection. Returns 0 on success or the
+        error code */
+    int prepare(const char *cmd, int *handle);
+    /** evaluates expressions registered with prepare(), opt = 1 -> void eval */
+    Rexp *execPrepared(int handle, int *status=0, int opt=0);
     int login(const char *user, const char *pwd);
     int shutdown(const char *key);
+    /** enables QAP extensions (QAPX_.. flags), returns the flags enabled
+        by the server (0 for servers before 1.8-16) or a negative error code */
+    int setQAPExt(int ext);
 
     /*      ( I/O functions )     */
     int openFile(const char *fn);
@@ -61,3 +61,6 @@
 
 /* CRAN has OpenSSL so we can use TLS */
 #define HAVE_TLS 1
+
+/* zlib is part of the toolchain (used for QAP compression) */
+#define HAVE_ZLIB 1
@@ -0,0 +1,137 @@
+/* Prefix tree of IP address ranges - see iptrie.h */
+
+#include "iptrie.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+/* all nodes are kept in one array, node 0 is the root. A node with
+   term set ends a prefix, so all addresses below it are covered */
+typedef struct iptrie_node {
+    int next[2]; /* index of the child for bit 0/1, 0 = none */
+    int term;
+} iptrie_node_t;
+
+struct iptrie {
+    iptrie_node_t *node;
+    int nodes, size;
+};
+
+static const unsigned char v4_prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+#define ADDR_BIT(A, I) (((A)[(I) >> 3] >> (7 - ((I) & 7))) & 1)
+
+iptrie_t *iptrie_new(void) {
+    iptrie_t *t = (iptrie_t*) calloc(1, sizeof(iptrie_t));
+    if (!t)
+	return 0;
+    if (!(t->node = (iptrie_node_t*) calloc(64, sizeof(iptrie_node_t)))) {
+	free(t);
+	return 0;
+    }
+    t->size = 64;
+    t->nodes = 1;
+    return t;
+}
+
+void iptrie_free(iptrie_t *t) {
+    if (t) {
+	free(t->node);
+	free(t);
+    }
+}
+
+/* inserts the prefix of the given number of bits of the IPv6 address a */
+static int trie_insert(iptrie_t *t, const unsigned char *a, int bits) {
+    int i, n = 0;
+    /* nothing to do below a prefix that already covers it */
+    for (i = 0; i < bits && !t->node[n].term; i++) {
+	int b = ADDR_BIT(a, i);
+	if (!t->node[n].next[b]) {
+	    if (t->nodes == t->size) {
+		iptrie_node_t *nn = (iptrie_node_t*) realloc(t->node, sizeof(iptrie_node_t) * t->size * 2);
+		if (!nn)
+		    return -1;
+		memset(nn + t->size, 0, sizeof(iptrie_node_t) * t->size);
+		t->node = nn;
+		t->size *= 2;
+	    }
+	    t->node[n].next[b] = t->nodes++;
+	}
+	n = t->node[n].next[b];
+    }
+    t->node[n].term = 1;
+    return 0;
+}
+
+/* parses a dotted IPv4 address into 4 bytes, returns 1 on success */
+static int parse_v4(const char *s, unsigned char *a) {
+    unsigned int v[4];
+    char extra;
+    int i;
+    if (sscanf(s, "%u.%u.%u.%u%c", v, v + 1, v + 2, v + 3, &extra) != 4)
+	return 0;
+    for (i = 0; i < 4; i++) {
+	if (v[i] > 255)
+	    return 0;
+	a[i] = (unsigned char) v[i];
+    }
+    return 1;
+}
+
+int iptrie_add(iptrie_t *t, const char *spec) {
+    unsigned char a[16];
+    char buf[64], *c;
+    int bits = -1, max;
+
+    if (strlen(spec) >= sizeof(buf))
+	return -1;
+    strcpy(buf, spec);
+    if ((c = strchr(buf, '/'))) {
+	char *e;
+	*c = 0;
+	bits = (int) strtol(c + 1, &e, 10);
+	if (e == c + 1 || *e || bits < 0)
+	    return -1;
+    }
+    if (parse_v4(buf, a + 12)) {
+	memcpy(a, v4_prefix, sizeof(v4_prefix));
+	max = 32;
+    }
+#ifndef WIN32
+    else if (inet_pton(AF_INET6, buf, a) == 1)
+	max = 128;
+#endif
+    else
+	return -1;
+    if (bits < 0)
+	bits = max;
+    if (bits > max)
+	return -1;
+    return trie_insert(t, a, bits + 128 - max);
+}
+
+int iptrie_match(const iptrie_t *t, const unsigned char *addr, int len) {
+    unsigned char a[16];
+    int i = 0, n = 0;
+    if (len == 4) {
+	memcpy(a, v4_prefix, sizeof(v4_prefix));
+	memcpy(a + 12, addr, 4);
+	addr = a;
+    } else if (len != 16)
+	return 0;
+    while (!t->node[n].term) {
+	if (i == 128 || !(n = t->node[n].next[ADDR_BIT(addr, i)]))
+	    return 0;
+	i++;
+    }
+    return 1;
+}
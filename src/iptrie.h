@@ -0,0 +1,26 @@
+#ifndef IPTRIE_H__
+#define IPTRIE_H__
+
+/* Prefix tree of IP address ranges
+
+   Used for the "allow" list: entries are parsed once into a binary
+   tree over the address bits, so checking a peer takes at most 128
+   steps regardless of the number of entries. IPv4 addresses are
+   stored as IPv4-mapped IPv6 addresses (::ffff:a.b.c.d), so IPv4
+   entries also match IPv4 peers of dual-stack IPv6 sockets. */
+
+typedef struct iptrie iptrie_t;
+
+iptrie_t *iptrie_new(void);
+void iptrie_free(iptrie_t *t);
+
+/* adds an address range given as <IPv4>[/<bits>] or <IPv6>[/<bits>]
+   (a single address if bits are not specified). Returns 0 on success,
+   -1 if the entry is invalid or cannot be allocated */
+int iptrie_add(iptrie_t *t, const char *spec);
+
+/* returns 1 if the address (4 bytes IPv4 or 16 bytes IPv6, network
+   byte order) is covered by any of the ranges, 0 otherwise */
+int iptrie_match(const iptrie_t *t, const unsigned char *addr, int len);
+
+#endif
@@ -1,9 +1,10 @@
 #include "qap_decode.h"
 
 #include <Rversion.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
-#define decode_to_SEXP QAP_decode 
 
 /* string encoding handling */
 #if (R_VERSION < R_Version(2,8,0)) || (defined DISABLE_ENCODING)
@@ -22,96 +23,354 @@ typedef unsigned long long temp_ptr_int_t;
 typedef unsigned long temp_ptr_int_t;
 #endif
 
-/* this is the representation of NAs in strings. We chose 0xff since that should never occur in UTF-8 strings. If 0xff occurs in the beginning of a string anyway, it will be doubled to avoid misrepresentation. */
-static const unsigned char NaStringRepresentation[2] = { 255, 0 };
+#if (R_VERSION >= R_Version(3,6,0)) && ! (defined DISABLE_ALTREP)
+#define USE_ALTREP 1
+#include <stdint.h>
+#include <R_ext/Altrep.h>
+#include <R_ext/Rdynload.h>
 
-/* decode_toSEXP is used to decode SEXPs from binary form and create
-   corresponding objects in R. UPC is a pointer to a counter of
-   UNPROTECT calls which will be necessary after we're done.
-   The buffer position is advanced to the point where the SEXP ends
-   (more precisely it points to the next stored SEXP). */
-SEXP decode_to_SEXP(unsigned int **buf)
-{
-    unsigned int *b = *buf, *pab = *buf;
-    char *c, *cc;
-    SEXP val = 0, vatt = 0;
-    int ty = PAR_TYPE(ptoi(*b));
-    rlen_t ln = PAR_LEN(ptoi(*b));
-    rlen_t i, l;
-    
-    if (IS_LARGE(ty)) {
-	ty ^= XT_LARGE;
-	b++;
-	ln |= ((rlen_t) (unsigned int) ptoi(*b)) << 24;
+static int alt_ready; /* 0 = not initialized, 1 = ok, -1 = unavailable */
+static int alt_init(void);
+
+/* compact sequences (XT_ARRAY_*_SEQ): data1 is a real vector
+   c(n, start, step), data2 is the expanded vector once the data
+   pointer has been requested (NULL before) */
+static R_altrep_class_t qseq_int_class, qseq_real_class;
+
+static R_xlen_t qseq_Length(SEXP x) {
+    return (R_xlen_t) REAL(R_altrep_data1(x))[0];
+}
+
+static void *qseq_Dataptr(SEXP x, Rboolean writeable) {
+    SEXP val = R_altrep_data2(x);
+    if (val == R_NilValue) {
+	const double *sq = REAL(R_altrep_data1(x));
+	R_xlen_t i = 0, n = (R_xlen_t) sq[0];
+	val = allocVector(TYPEOF(x), n);
+	R_set_altrep_data2(x, val);
+	if (TYPEOF(x) == INTSXP) {
+	    int *iv = INTEGER(val);
+	    for (; i < n; i++) iv[i] = (int) (sq[1] + (double) i * sq[2]);
+	} else {
+	    double *dv = REAL(val);
+	    for (; i < n; i++) dv[i] = sq[1] + (double) i * sq[2];
+	}
     }
-#ifdef RSERV_DEBUG
-    printf("decode: type=%d, len=%ld\n", ty, (long)ln);
+    return (TYPEOF(x) == INTSXP) ? (void*) INTEGER(val) : (void*) REAL(val);
+}
+
+static const void *qseq_Dataptr_or_null(SEXP x) {
+    return (R_altrep_data2(x) == R_NilValue) ? 0 : qseq_Dataptr(x, FALSE);
+}
+
+static Rboolean qseq_Inspect(SEXP x, int pre, int deep, int pvec,
+			     void (*inspect_subtree)(SEXP, int, int, int)) {
+    const double *sq = REAL(R_altrep_data1(x));
+    Rprintf(" Rserve QAP sequence %g + i * %g, n = %.0f%s\n", sq[1], sq[2], sq[0],
+	    (R_altrep_data2(x) == R_NilValue) ? "" : " (expanded)");
+    return TRUE;
+}
+
+/* returns 1 if the (unexpanded) sequence has no NAs. Integer sequences
+   are monotone and within the int range, so only the first and last
+   element can be NA. Real sequences have NaNs if start is NA/NaN or
+   step is not finite (0 * Inf is NaN) */
+static int qseq_no_na(SEXP x) {
+    const double *sq = REAL(R_altrep_data1(x));
+    if (sq[0] < 1)
+	return 1;
+    if (TYPEOF(x) == INTSXP)
+	return (sq[1] != (double) NA_INTEGER &&
+		sq[1] + (sq[0] - 1.0) * sq[2] != (double) NA_INTEGER) ? 1 : 0;
+    return (!ISNAN(sq[1]) && R_FINITE(sq[2])) ? 1 : 0;
+}
+
+static int qseq_Is_sorted(SEXP x) {
+    if (R_altrep_data2(x) != R_NilValue) /* may have been modified */
+	return UNKNOWN_SORTEDNESS;
+    if (!qseq_no_na(x))
+	return UNKNOWN_SORTEDNESS;
+    return (REAL(R_altrep_data1(x))[2] < 0) ? SORTED_DECR : SORTED_INCR;
+}
+
+static int qseq_No_NA(SEXP x) {
+    return (R_altrep_data2(x) == R_NilValue) ? qseq_no_na(x) : 0;
+}
+
+static int qseq_int_Elt(SEXP x, R_xlen_t i) {
+    const double *sq;
+    if (R_altrep_data2(x) != R_NilValue)
+	return INTEGER(R_altrep_data2(x))[i];
+    sq = REAL(R_altrep_data1(x));
+    return (int) (sq[1] + (double) i * sq[2]);
+}
+
+static R_xlen_t qseq_int_Get_region(SEXP x, R_xlen_t i, R_xlen_t n, int *buf) {
+    R_xlen_t len = qseq_Length(x), k;
+    const double *sq = REAL(R_altrep_data1(x));
+    if (i + n > len) n = len - i;
+    if (R_altrep_data2(x) != R_NilValue) {
+	if (n > 0) memcpy(buf, INTEGER(R_altrep_data2(x)) + i, n * sizeof(int));
+	return n;
+    }
+    for (k = 0; k < n; k++)
+	buf[k] = (int) (sq[1] + (double) (i + k) * sq[2]);
+    return n;
+}
+
+static double qseq_real_Elt(SEXP x, R_xlen_t i) {
+    const double *sq;
+    if (R_altrep_data2(x) != R_NilValue)
+	return REAL(R_altrep_data2(x))[i];
+    sq = REAL(R_altrep_data1(x));
+    return sq[1] + (double) i * sq[2];
+}
+
+static R_xlen_t qseq_real_Get_region(SEXP x, R_xlen_t i, R_xlen_t n, double *buf) {
+    R_xlen_t len = qseq_Length(x), k;
+    const double *sq = REAL(R_altrep_data1(x));
+    if (i + n > len) n = len - i;
+    if (R_altrep_data2(x) != R_NilValue) {
+	if (n > 0) memcpy(buf, REAL(R_altrep_data2(x)) + i, n * sizeof(double));
+	return n;
+    }
+    for (k = 0; k < n; k++)
+	buf[k] = sq[1] + (double) (i + k) * sq[2];
+    return n;
+}
 #endif
-    b++;
-    pab = b; /* pre-attr b */
 
-    if (ty & XT_HAS_ATTR) {
-#ifdef RSERV_DEBUG
-	printf(" - has attributes\n");
+/* ALTREP vectors referencing the decode buffer */
+#if (defined USE_ALTREP) && (defined NATIVE_COPY)
+#define USE_QREF 1
+
+/* data1 is an external pointer to the payload, protecting the
+   owner of the buffer, data2 is the length (as a real scalar) */
+static R_altrep_class_t qref_int_class, qref_real_class;
+static SEXP ref_owner;
+static rlen_t ref_size;
+static int ref_count;
+
+static R_xlen_t qref_Length(SEXP x) {
+    return (R_xlen_t) REAL(R_altrep_data2(x))[0];
+}
+
+/* the payload is owned exclusively by the vector,
+   so it's fine to hand it out for writing as well */
+static void *qref_Dataptr(SEXP x, Rboolean writeable) {
+    return R_ExternalPtrAddr(R_altrep_data1(x));
+}
+
+static const void *qref_Dataptr_or_null(SEXP x) {
+    return R_ExternalPtrAddr(R_altrep_data1(x));
+}
+
+static Rboolean qref_Inspect(SEXP x, int pre, int deep, int pvec,
+			     void (*inspect_subtree)(SEXP, int, int, int)) {
+    Rprintf(" Rserve QAP buffer reference (%p)\n", qref_Dataptr_or_null(x));
+    return TRUE;
+}
+
+static int qref_int_Elt(SEXP x, R_xlen_t i) {
+    return ((const int*) qref_Dataptr_or_null(x))[i];
+}
+
+static R_xlen_t qref_int_Get_region(SEXP x, R_xlen_t i, R_xlen_t n, int *buf) {
+    R_xlen_t len = qref_Length(x);
+    if (i + n > len) n = len - i;
+    if (n > 0) memcpy(buf, ((const int*) qref_Dataptr_or_null(x)) + i, n * sizeof(int));
+    return n;
+}
+
+static double qref_real_Elt(SEXP x, R_xlen_t i) {
+    return ((const double*) qref_Dataptr_or_null(x))[i];
+}
+
+static R_xlen_t qref_real_Get_region(SEXP x, R_xlen_t i, R_xlen_t n, double *buf) {
+    R_xlen_t len = qref_Length(x);
+    if (i + n > len) n = len - i;
+    if (n > 0) memcpy(buf, ((const double*) qref_Dataptr_or_null(x)) + i, n * sizeof(double));
+    return n;
+}
+
+static void qref_init(DllInfo *dll) {
+    qref_int_class = R_make_altinteger_class("qap_int_ref", "Rserve", dll);
+    R_set_altrep_Length_method(qref_int_class, qref_Length);
+    R_set_altrep_Inspect_method(qref_int_class, qref_Inspect);
+    R_set_altvec_Dataptr_method(qref_int_class, qref_Dataptr);
+    R_set_altvec_Dataptr_or_null_method(qref_int_class, qref_Dataptr_or_null);
+    R_set_altinteger_Elt_method(qref_int_class, qref_int_Elt);
+    R_set_altinteger_Get_region_method(qref_int_class, qref_int_Get_region);
+
+    qref_real_class = R_make_altreal_class("qap_real_ref", "Rserve", dll);
+    R_set_altrep_Length_method(qref_real_class, qref_Length);
+    R_set_altrep_Inspect_method(qref_real_class, qref_Inspect);
+    R_set_altvec_Dataptr_method(qref_real_class, qref_Dataptr);
+    R_set_altvec_Dataptr_or_null_method(qref_real_class, qref_Dataptr_or_null);
+    R_set_altreal_Elt_method(qref_real_class, qref_real_Elt);
+    R_set_altreal_Get_region_method(qref_real_class, qref_real_Get_region);
+}
+
+/* creates a reference to n elements of size es at *b - the pointer
+   is moved back to the preceding 8-byte boundary if necessary (we can
+   clobber the 4 bytes before the payload since they have been decoded
+   already). The whole buffer stays alive as long as any reference does,
+   so only payloads that cover at least half of it are referenced.
+   Returns NULL if the payload should be copied instead. */
+static SEXP qref_new(int type, unsigned int *b, R_xlen_t n, size_t es) {
+    SEXP ptr, val;
+    void *data = b;
+    if (!ref_owner || n * es < QAP_REF_MIN || (double) n * es * 2.0 < (double) ref_size ||
+	(((uintptr_t) b) & 3) || !alt_init())
+	return 0;
+    if (((uintptr_t) b) & 7) {
+	memmove(b - 1, b, n * es);
+	data = b - 1;
+    }
+    ptr = PROTECT(R_MakeExternalPtr(data, R_NilValue, ref_owner));
+    val = PROTECT(ScalarReal((double) n));
+    val = R_new_altrep((type == INTSXP) ? qref_int_class : qref_real_class, ptr, val);
+    UNPROTECT(2);
+    ref_count++;
+    return val;
+}
 #endif
-	*buf = b;
-	vatt = PROTECT(decode_to_SEXP(buf));
-	b = *buf;
-	ty = ty ^ XT_HAS_ATTR;
-#ifdef RSERV_DEBUG
-	printf(" - returned from attributes(@%p)\n", (void*)*buf);
+
+#ifdef USE_ALTREP
+/* registers the ALTREP classes on first use */
+static int alt_init(void) {
+    DllInfo *dll;
+    if (alt_ready) return (alt_ready > 0);
+#ifdef STANDALONE_RSERVE
+    dll = R_getEmbeddingDllInfo();
+#else
+    dll = R_getDllInfo("Rserve");
 #endif
-	ln -= (((char*)b) - ((char*)pab)); /* adjust length */
+    if (!dll) {
+	alt_ready = -1;
+	return 0;
     }
+    qseq_int_class = R_make_altinteger_class("qap_int_seq", "Rserve", dll);
+    R_set_altrep_Length_method(qseq_int_class, qseq_Length);
+    R_set_altrep_Inspect_method(qseq_int_class, qseq_Inspect);
+    R_set_altvec_Dataptr_method(qseq_int_class, qseq_Dataptr);
+    R_set_altvec_Dataptr_or_null_method(qseq_int_class, qseq_Dataptr_or_null);
+    R_set_altinteger_Elt_method(qseq_int_class, qseq_int_Elt);
+    R_set_altinteger_Get_region_method(qseq_int_class, qseq_int_Get_region);
+    R_set_altinteger_Is_sorted_method(qseq_int_class, qseq_Is_sorted);
+    R_set_altinteger_No_NA_method(qseq_int_class, qseq_No_NA);
+
+    qseq_real_class = R_make_altreal_class("qap_real_seq", "Rserve", dll);
+    R_set_altrep_Length_method(qseq_real_class, qseq_Length);
+    R_set_altrep_Inspect_method(qseq_real_class, qseq_Inspect);
+    R_set_altvec_Dataptr_method(qseq_real_class, qseq_Dataptr);
+    R_set_altvec_Dataptr_or_null_method(qseq_real_class, qseq_Dataptr_or_null);
+    R_set_altreal_Elt_method(qseq_real_class, qseq_real_Elt);
+    R_set_altreal_Get_region_method(qseq_real_class, qseq_real_Get_region);
+    R_set_altreal_Is_sorted_method(qseq_real_class, qseq_Is_sorted);
+    R_set_altreal_No_NA_method(qseq_real_class, qseq_No_NA);
+#ifdef USE_QREF
+    qref_init(dll);
+#endif
+    alt_ready = 1;
+    return 1;
+}
+#endif
+
+rlen_t QAP_seq_max = 0;
+
+/* creates a vector of type INTSXP or REALSXP with the elements
+   start + i * step. If possible, it is an ALTREP compact sequence
+   so it is only expanded if its data pointer is requested. */
+static SEXP seq_new(int type, R_xlen_t n, double start, double step)
+{
+    SEXP val;
+    R_xlen_t i;
+#ifdef USE_ALTREP
+    if (alt_init()) {
+	SEXP sq = PROTECT(allocVector(REALSXP, 3));
+	REAL(sq)[0] = (double) n;
+	REAL(sq)[1] = start;
+	REAL(sq)[2] = step;
+	val = R_new_altrep((type == INTSXP) ? qseq_int_class : qseq_real_class, sq, R_NilValue);
+	UNPROTECT(1);
+	return val;
+    }
+#endif
+    /* n is chosen by the client, so the expansion is bounded */
+    if (QAP_seq_max && (double) n * ((type == INTSXP) ? sizeof(int) : sizeof(double)) > (double) QAP_seq_max) {
+	REprintf("Rserve SEXP parsing: sequence too long\n");
+	return R_NilValue;
+    }
+    val = allocVector(type, n);
+    if (type == INTSXP)
+	for (i = 0; i < n; i++) INTEGER(val)[i] = (int) (start + (double) i * step);
+    else
+	for (i = 0; i < n; i++) REAL(val)[i] = start + (double) i * step;
+    return val;
+}
+
+/* this is the representation of NAs in strings. We chose 0xff since that should never occur in UTF-8 strings. If 0xff occurs in the beginning of a string anyway, it will be doubled to avoid misrepresentation. */
+static const unsigned char NaStringRepresentation[2] = { 255, 0 };
+
+/* decodes a node without children (other than attributes). b points
+   to the payload (behind the attributes) of ln bytes. The result is
+   not protected. */
+static SEXP decode_leaf(int ty, unsigned int *b, rlen_t ln)
+{
+    char *c, *cc;
+    SEXP val = R_NilValue;
+    rlen_t i, l;
 
-    /* b = beginning of the SEXP data (after attrs)
-       pab = beginning before attrs (=just behind the heaer)
-       ln = length of th SEX payload (w/o attr) */
     switch(ty) {
     case XT_NULL:
-	val = R_NilValue;
-	*buf = b;
 	break;
 	
     case XT_INT:
     case XT_ARRAY_INT:
 	l = ln / 4;
+#ifdef USE_QREF
+	if (ref_owner && (val = qref_new(INTSXP, b, l, sizeof(int))))
+	    break;
+#endif
 	val = allocVector(INTSXP, l);
 #ifdef NATIVE_COPY
 	memcpy(INTEGER(val), b, l * sizeof(int));
-	b += l;
 #else
 	i = 0;
 	while (i < l) {
 	    INTEGER(val)[i] = ptoi(*b); i++; b++;
 	}
 #endif
-	*buf = b;
 	break;
 
     case XT_ARRAY_BOOL:
 	{
-	    int vl = ptoi(*(b++));
+	    int vl = (ln < 4) ? -1 : ptoi(*(b++));
 	    char *cb = (char*) b;
+	    if (vl < 0 || vl > ln - 4) {
+		REprintf("Rserve SEXP parsing: invalid logical vector\n");
+		break;
+	    }
 	    val = allocVector(LGLSXP, vl);
 	    i = 0;
 	    while (i < vl) {
 		LOGICAL(val)[i] = (cb[i] == 1) ? TRUE : ((cb[i] == 0) ? FALSE : NA_LOGICAL);
 		i++;
 	    }
-	    while ((i & 3) != 0) i++;
-	    b = (unsigned int*) (cb + i);
 	}
-	*buf = b;
 	break;
 
     case XT_DOUBLE:
     case XT_ARRAY_DOUBLE:
 	l = ln / 8;
+#ifdef USE_QREF
+	if (ref_owner && (val = qref_new(REALSXP, b, l, sizeof(double))))
+	    break;
+#endif
 	val = allocVector(REALSXP, l);
 #ifdef NATIVE_COPY
 	memcpy(REAL(val), b, sizeof(double) * l);
-	b += l * 2;
 #else
 	i = 0;
 	while (i < l) {
@@ -120,15 +379,46 @@ SEXP decode_to_SEXP(unsigned int **buf)
 	    i++;
 	}
 #endif
-	*buf = b;
 	break;
 	
+    case XT_ARRAY_INT_SEQ:
+	{
+	    double n, st, step, last;
+	    if (ln < 12) {
+		REprintf("Rserve SEXP parsing: invalid integer sequence\n");
+		break;
+	    }
+	    n = (double) (unsigned int) ptoi(b[0]);
+	    st = (double) (int) ptoi(b[1]);
+	    step = (double) (int) ptoi(b[2]);
+	    last = st + ((n > 0) ? (n - 1.0) : 0) * step;
+	    if (last < (double) INT_MIN || last > (double) INT_MAX)
+		REprintf("Rserve SEXP parsing: invalid integer sequence\n");
+	    else
+		val = seq_new(INTSXP, (R_xlen_t) n, st, step);
+	}
+	break;
+
+    case XT_ARRAY_DOUBLE_SEQ:
+	{
+	    double sq[3];
+	    if (ln < 24) {
+		REprintf("Rserve SEXP parsing: invalid numeric sequence\n");
+		break;
+	    }
+	    fixdcpy(sq, b);
+	    fixdcpy(sq + 1, b + 2);
+	    fixdcpy(sq + 2, b + 4);
+	    if (sq[0] >= 0 && sq[0] <= (double) R_XLEN_T_MAX)
+		val = seq_new(REALSXP, (R_xlen_t) sq[0], sq[1], sq[2]);
+	}
+	break;
+
     case XT_ARRAY_CPLX:
 	l = ln / 16;
 	val = allocVector(CPLXSXP, l);
 #ifdef NATIVE_COPY
 	memcpy(COMPLEX(val), b, sizeof(Rcomplex) * l);
-	b += l * 4;
 #else
 	i = 0;
 	while (i < l) {
@@ -137,7 +427,6 @@ SEXP decode_to_SEXP(unsigned int **buf)
 	    i++;
 	}
 #endif
-	*buf = b;
 	break;
 
     case XT_ARRAY_STR:
@@ -170,147 +459,609 @@ SEXP decode_to_SEXP(unsigned int **buf)
 	    }
 	    UNPROTECT(1);
 	}
-	*buf = (unsigned int*)((char*)b + ln);
 	break;
 	
-    case XT_RAW:
-	i = ptoi(*b);
-	val = allocVector(RAWSXP, i);
-	memcpy(RAW(val), (b + 1), i);
-	*buf = (unsigned int*)((char*)b + ln);
-	break;
-	
-    case XT_VECTOR:
-    case XT_VECTOR_EXP:
+    case XT_ARRAY_STR_DICT:
 	{
-	    unsigned char *ie = (unsigned char*) b + ln;
-	    rlen_t n = 0;
-	    SEXP vr = PROTECT(CONS(R_NilValue, R_NilValue));
-	    SEXP tail = vr;
-	    *buf = b;
-	    while ((unsigned char*)*buf < ie) {
-		SEXP v = decode_to_SEXP(buf);
-		/* CONS() protects its arguments if GC is needed so v is safe */
-		SEXP ne = CONS(v, R_NilValue);
-		SETCDR(tail, ne);
-		tail = ne;
-		n++;
+	    rlen_t n, m;
+	    int w;
+	    unsigned char *ix = (unsigned char*) (b + 2);
+	    char *sen = (char*)b + ln;
+	    SEXP dict;
+	    if (ln < 8 || (n = (rlen_t) (unsigned int) ptoi(b[0])) > ln ||
+		(c = (char*) ix + ((n * (w = ((m = (rlen_t) (unsigned int) ptoi(b[1])) < 255) ? 1 : ((m < 65535) ? 2 : 4)) + 3) & (rlen_max ^ 3L))) > sen ||
+		m > sen - c) { /* each entry needs at least its terminating NUL */
+		REprintf("Rserve SEXP parsing: invalid string dictionary\n");
+		break;
 	    }
-#ifdef RSERV_DEBUG
-	    printf(" vector (%s), %ld elements\n", (ty == XT_VECTOR) ? "generic" : ((ty == XT_VECTOR_EXP) ? "expression" : "string"), (long) n);
-#endif
-	    val = PROTECT(allocVector((ty==XT_VECTOR) ? VECSXP : ((ty == XT_VECTOR_EXP) ? EXPRSXP : STRSXP), n));
-	    n = 0;
-	    while (CDR(vr) != R_NilValue) {
-		vr = CDR(vr);
-		SET_VECTOR_ELT(val, n++, CAR(vr));
+	    /* the dictionary is the same as XT_ARRAY_STR */
+	    dict = PROTECT(allocVector(STRSXP, m));
+	    i = 0; cc = c;
+	    while (c < sen && i < m) {
+		if (!*c) {
+		    if ((unsigned char)cc[0] == NaStringRepresentation[0])
+			SET_STRING_ELT(dict, i, mkRChar(cc + 1));
+		    else
+			SET_STRING_ELT(dict, i, mkRChar(cc));
+		    i++;
+		    cc = c + 1;
+		}
+		c++;
 	    }
-#ifdef RSERV_DEBUG
-	    printf(" end of vector %lx/%lx\n",
-		   (unsigned long) ((temp_ptr_int_t) *buf),
-		   (unsigned long) ((temp_ptr_int_t) ie));
-#endif
-	    UNPROTECT(2); /* val and vr */
+	    val = PROTECT(allocVector(STRSXP, n));
+	    for (i = 0; i < n; i++) {
+		unsigned int k = ix[0];
+		if (w > 1) {
+		    k |= ((unsigned int) ix[1]) << 8;
+		    if (w > 2)
+			k |= (((unsigned int) ix[2]) << 16) | (((unsigned int) ix[3]) << 24);
+		}
+		ix += w;
+		/* all bits set is NA, invalid indices are treated as NA as well */
+		SET_STRING_ELT(val, i, (k < m) ? STRING_ELT(dict, k) : R_NaString);
+	    }
+	    UNPROTECT(2);
+	}
+	break;
+
+    case XT_RAW:
+	i = (ln < 4) ? -1 : (rlen_t) (unsigned int) ptoi(*b);
+	if (i < 0 || i > ln - 4) {
+	    REprintf("Rserve SEXP parsing: invalid raw vector\n");
 	    break;
 	}
+	val = allocVector(RAWSXP, i);
+	memcpy(RAW(val), (b + 1), i);
+	break;
 
     case XT_STR:
     case XT_SYMNAME:
-		/* i=ptoi(*b);
-		   b++; */
 #ifdef RSERV_DEBUG
-		printf(" string/symbol(%d) '%s'\n", ty, (char*)b);
+	printf(" string/symbol(%d) '%s'\n", ty, (char*)b);
 #endif
-		{
-		    char *c = (char*) b;
-		    if (ty == XT_STR) {
-			val = mkRChar(c);
-		    } else
-			val = install(c);
-		}
-		*buf = (unsigned int*)((char*)b + ln);
-		break;
+	val = (ty == XT_STR) ? mkRChar((char*) b) : install((char*) b);
+	break;
 
     case XT_S4:
 	val = Rf_allocS4Object();
 	break;
-	
-    case XT_LIST_NOTAG:
-    case XT_LIST_TAG:
-    case XT_LANG_NOTAG:
-    case XT_LANG_TAG:
-	{
-	    SEXP vnext = R_NilValue, vtail = 0;
-	    unsigned char *ie = (unsigned char*) b + ln;
-	    val = R_NilValue;
-	    *buf = b;
-	    while ((unsigned char*)*buf < ie) {
-#ifdef RSERV_DEBUG
-		printf(" el %08lx of %08lx\n",
-		       (unsigned long) ((temp_ptr_int_t) *buf),
-		       (unsigned long) ((temp_ptr_int_t) ie));
+
+    default:
+	REprintf("Rserve SEXP parsing: unsupported type %d\n", ty);
+    }
+    return val;
+}
+
+/* sets the attributes of val (which must be protected) */
+static void set_attr(SEXP val, SEXP vatt)
+{
+    /* if vatt contains "class" we have to set the object bit [we could use classgets(vec,kls) instead] */
+    SEXP head = vatt;
+    int has_class = 0;
+    if (val == R_NilValue) /* NULL cannot have attributes */
+	return;
+    SET_ATTRIB(val, vatt);
+    while (head != R_NilValue) {
+	if (TAG(head) == R_ClassSymbol) {
+	    has_class = 1; break;
+	}
+	head = CDR(head);
+    }
+    if (has_class) /* if it has a class slot, we have to set the object bit */
+	SET_OBJECT(val, 1);
+#ifdef SET_S4_OBJECT
+    /* FIXME: we have currently no way of knowing whether an object
+       derived from a non-S4 type is actually S4 object. Hence
+       we can only flag "pure" S4 objects */
+    if (TYPEOF(val) == S4SXP)
+	SET_S4_OBJECT(val);
 #endif
-		SEXP el = PROTECT(decode_to_SEXP(buf));
-		SEXP ea = R_NilValue;
-		if (ty == XT_LANG_TAG || ty==XT_LIST_TAG) {
+}
+
+/* reads the header at *b, advances *b to the payload and returns the
+   type (or -1 if the node doesn't fit before end which may be NULL
+   if there is no limit) */
+static int node_header(unsigned int **b, unsigned char *end, rlen_t *ln)
+{
+    unsigned int *h = *b;
+    int ty;
+    if (end && (unsigned char*) (h + 1) > end)
+	return -1;
+    ty = PAR_TYPE(ptoi(*h));
+    *ln = PAR_LEN(ptoi(*h));
+    if (IS_LARGE(ty)) {
+	ty ^= XT_LARGE;
+	h++;
+	if (end && (unsigned char*) (h + 1) > end)
+	    return -1;
+	*ln |= ((rlen_t) (unsigned int) ptoi(*h)) << 24;
+    }
+    h++;
+    *b = h;
+    if (end && *ln > end - (unsigned char*) h)
+	return -1;
+    return ty;
+}
+
+/* number of nodes between b and end or -1 if they don't fit */
+static rlen_t count_nodes(unsigned int *b, unsigned char *end)
+{
+    rlen_t n = 0, ln;
+    while ((unsigned char*) b < end) {
+	if (node_header(&b, end, &ln) < 0)
+	    return -1;
+	b = (unsigned int*) ((unsigned char*) b + ln);
+	n++;
+    }
+    return n;
+}
+
+/* nodes with children (other than attributes) */
+#define IS_CONTAINER(T) ((T) == XT_VECTOR || (T) == XT_VECTOR_EXP || \
+			 ((T) >= XT_LIST_NOTAG && (T) <= XT_LANG_TAG))
+
+/* a node with children or attributes on the decoding stack. Its value
+   (as far as it has been built) and attributes are kept in the keep
+   list (at 2 * depth and 2 * depth + 1) so they are protected. */
+typedef struct dec_frame {
+    int ty;             /* XT_ type without XT_HAS_ATTR */
+    int attr;           /* the next node are the attributes */
+    int tag;            /* tagged lists: the next node is a tag */
+    unsigned char *end; /* end of the node */
+    rlen_t i;           /* vectors: index of the next element */
+    SEXP tail;          /* lists: last cell */
+} dec_frame_t;
+
+/* decode_toSEXP is used to decode SEXPs from binary form and create
+   corresponding objects in R. The buffer position is advanced to the
+   point where the SEXP ends (more precisely it points to the next
+   stored SEXP). The object is decoded iteratively so the nesting
+   depth is only limited by QAP_MAX_DEPTH. Returns NULL if the object
+   cannot be decoded. The result is NOT protected. */
+static SEXP decode_to_SEXP(unsigned int **buf)
+{
+    unsigned int *b = *buf;
+    dec_frame_t *st = 0, *f;
+    int depth = 0, alloc = 0, ty, k;
+    const char *err = 0;
+    PROTECT_INDEX ki;
+    SEXP keep, val = R_NilValue;
+    rlen_t ln;
+
+    PROTECT_WITH_INDEX(keep = allocVector(VECSXP, 64), &ki);
+    while (1) { /* b points to the header of the next node */
+	if ((ty = node_header(&b, depth ? st[depth - 1].end : 0, &ln)) < 0) {
+	    err = "invalid object length";
+	    break;
+	}
 #ifdef RSERV_DEBUG
-		    printf(" tag %08lx of %08lx\n",
-			   (unsigned long) ((temp_ptr_int_t) *buf),
-			   (unsigned long) ((temp_ptr_int_t) ie));
+	printf("decode: type=%d, len=%ld, depth=%d\n", ty, (long)ln, depth);
 #endif
-		    ea = decode_to_SEXP(buf);
-		    if (ea != R_NilValue) PROTECT(ea);
+	if ((ty & XT_HAS_ATTR) || IS_CONTAINER(ty)) {
+	    if (depth >= QAP_MAX_DEPTH) {
+		err = "object is nested too deeply";
+		break;
+	    }
+	    if (depth >= alloc) {
+		int na = alloc ? (alloc * 2) : 32;
+		dec_frame_t *nf = (dec_frame_t*) realloc(st, sizeof(dec_frame_t) * na);
+		if (!nf) {
+		    err = "out of memory";
+		    break;
 		}
-		if (ty == XT_LANG_TAG || ty == XT_LANG_NOTAG)
-		    vnext = LCONS(el, R_NilValue);
-		else
-		    vnext = CONS(el, R_NilValue);
-		PROTECT(vnext);
-		if (ea != R_NilValue)
-		    SET_TAG(vnext, ea);
-		if (vtail) {
-		    SETCDR(vtail, vnext);
-		    UNPROTECT((ea == R_NilValue) ? 2 : 3);
-		} else {
-		    UNPROTECT((ea == R_NilValue) ? 2 : 3);
-		    val = vnext;
-		    PROTECT(val); /* protect the root */
+		st = nf;
+		alloc = na;
+	    }
+	    if (2 * depth + 2 > XLENGTH(keep)) {
+		SEXP nk = allocVector(VECSXP, XLENGTH(keep) * 2);
+		rlen_t i, n = XLENGTH(keep);
+		for (i = 0; i < n; i++)
+		    SET_VECTOR_ELT(nk, i, VECTOR_ELT(keep, i));
+		REPROTECT(keep = nk, ki);
+	    }
+	    f = st + depth;
+	    f->ty = ty & ~XT_HAS_ATTR;
+	    f->attr = 1;
+	    f->tag = 0;
+	    f->end = (unsigned char*) b + ln;
+	    f->i = 0;
+	    f->tail = R_NilValue;
+	    SET_VECTOR_ELT(keep, 2 * depth, R_NilValue);
+	    SET_VECTOR_ELT(keep, 2 * depth + 1, R_NilValue);
+	    depth++;
+	    if (ty & XT_HAS_ATTR) /* decode the attributes first */
+		continue;
+	    val = R_NilValue; /* no attributes */
+	} else {
+	    val = decode_leaf(ty, b, ln);
+	    b = (unsigned int*) ((unsigned char*) b + ln);
+	}
+
+	/* val is a complete node, add it to its parent and complete
+	   all parents that have no more children */
+	while (depth) {
+	    f = st + depth - 1;
+	    k = 2 * (depth - 1);
+	    if (f->attr) { /* val are the attributes, start the payload */
+		SET_VECTOR_ELT(keep, k + 1, val);
+		f->attr = 0;
+		switch (f->ty) {
+		case XT_VECTOR:
+		case XT_VECTOR_EXP:
+		    {
+			/* count the elements first so we can allocate the
+			   vector directly */
+			rlen_t n = count_nodes(b, f->end);
+			if (n < 0) {
+			    err = "invalid vector";
+			    break;
+			}
+			SET_VECTOR_ELT(keep, k, allocVector((f->ty == XT_VECTOR) ? VECSXP : EXPRSXP, n));
+			if (n) /* decode the first element */
+			    goto next_node;
+		    }
+		    break;
+		case XT_LIST_NOTAG:
+		case XT_LIST_TAG:
+		case XT_LANG_NOTAG:
+		case XT_LANG_TAG:
+		    if ((unsigned char*) b < f->end)
+			goto next_node;
+		    break;
+		default: /* no children */
+		    SET_VECTOR_ELT(keep, k, decode_leaf(f->ty, b, f->end - (unsigned char*) b));
+		}
+		if (err) break;
+	    } else { /* val is a child */
+		switch (f->ty) {
+		case XT_VECTOR:
+		case XT_VECTOR_EXP:
+		    SET_VECTOR_ELT(VECTOR_ELT(keep, k), f->i++, val);
+		    break;
+		case XT_LIST_TAG:
+		case XT_LANG_TAG:
+		    if (f->tag) {
+			if (val != R_NilValue)
+			    SET_TAG(f->tail, val);
+			f->tag = 0;
+			break;
+		    }
+		    f->tag = 1; /* fall through - the tag follows */
+		default:
+		    {
+			/* CONS() protects its arguments if GC is needed so val is safe */
+			SEXP cell = (f->ty == XT_LANG_TAG || f->ty == XT_LANG_NOTAG) ?
+			    LCONS(val, R_NilValue) : CONS(val, R_NilValue);
+			if (f->tail == R_NilValue)
+			    SET_VECTOR_ELT(keep, k, cell);
+			else
+			    SETCDR(f->tail, cell);
+			f->tail = cell;
+		    }
+		}
+		if ((unsigned char*) b < f->end)
+		    goto next_node;
+		if (f->tag) {
+		    err = "missing tag in a pairlist";
+		    break;
 		}
-		vtail = vnext;				   
 	    }
-	    if (vtail) UNPROTECT(1);
-	    break;
+	    /* the node is complete - note that its value remains
+	       protected until the slot is re-used so it is safe to add
+	       it to the parent */
+	    val = VECTOR_ELT(keep, k);
+	    if (VECTOR_ELT(keep, k + 1) != R_NilValue)
+		set_attr(val, VECTOR_ELT(keep, k + 1));
+	    b = (unsigned int*) f->end;
+	    depth--;
 	}
-	default:
-	    REprintf("Rserve SEXP parsing: unsupported type %d\n", ty);
-	    val = R_NilValue;
-	    *buf = (unsigned int*)((char*)b + ln);
+	break; /* the top-level node is complete (or failed) */
+    next_node: ;
     }
-    
-    if (vatt) {
-	/* if vatt contains "class" we have to set the object bit [we could use classgets(vec,kls) instead] */
-	SEXP head = vatt;
-	int has_class = 0;
-	PROTECT(val);
-	SET_ATTRIB(val, vatt);
-	while (head != R_NilValue) {
-	    if (TAG(head) == R_ClassSymbol) {
-		has_class = 1; break;
+    if (st) free(st);
+    UNPROTECT(1); /* keep */
+    if (err) {
+	REprintf("Rserve SEXP parsing: %s\n", err);
+	return 0;
+    }
+    *buf = b;
+    /* NOTE: val is NOT protected */
+    return val;
+}
+
+SEXP QAP_decode(unsigned int **buf)
+{
+#ifdef USE_QREF
+    ref_owner = 0; /* in case a previous QAP_decode_ref() didn't return */
+#endif
+    return decode_to_SEXP(buf);
+}
+
+SEXP QAP_decode_ref(unsigned int **buf, rlen_t size, SEXP owner, int *refs)
+{
+    SEXP val;
+#ifdef USE_QREF
+    ref_owner = owner;
+    ref_size = size;
+    ref_count = 0;
+    val = decode_to_SEXP(buf);
+    ref_owner = 0;
+    if (refs) *refs = ref_count;
+#else
+    val = decode_to_SEXP(buf);
+    if (refs) *refs = 0;
+#endif
+    return val;
+}
+
+/* streaming decoder (QAP_decode_stream)
+
+   Containers (XT_VECTOR, XT_VECTOR_EXP) and integer, numeric,
+   complex, logical and raw vectors of at least QAP_STREAM_MIN bytes
+   are decoded as they are read, the vector payloads are read directly
+   into the allocated R vectors. All other nodes are read into a
+   temporary buffer and decoded with decode_to_SEXP(). */
+
+#define QAP_STREAM_MIN 65536 /* smaller nodes are buffered */
+#define QAP_STREAM_DEPTH 64  /* max. nesting of streamed containers */
+
+#define IS_STREAMED(T) ((T) == XT_VECTOR || (T) == XT_VECTOR_EXP || (T) == XT_ARRAY_INT || \
+			(T) == XT_ARRAY_DOUBLE || (T) == XT_ARRAY_CPLX || (T) == XT_ARRAY_BOOL || (T) == XT_RAW)
+
+typedef struct qap_stream {
+    qap_read_t rd;
+    void *ctx;
+    rlen_t pos;     /* number of bytes read so far */
+    rlen_t max_buf; /* max. size of a buffered node, 0 = no limit */
+} qap_stream_t;
+
+static int stream_read(qap_stream_t *s, void *buf, rlen_t len)
+{
+    if (len < 1) return 0;
+    if (s->rd(s->ctx, buf, len)) return -1;
+    s->pos += len;
+    return 0;
+}
+
+static int stream_skip(qap_stream_t *s, rlen_t len)
+{
+    char tmp[1024];
+    while (len > 0) {
+	rlen_t n = (len > (rlen_t) sizeof(tmp)) ? (rlen_t) sizeof(tmp) : len;
+	if (stream_read(s, tmp, n)) return -1;
+	len -= n;
+    }
+    return 0;
+}
+
+/* the allocation size is determined by the client before the data
+   has been received, so allocation errors must not escape */
+typedef struct stream_alloc {
+    SEXPTYPE type;
+    R_xlen_t n;
+    SEXP val;
+} stream_alloc_t;
+
+static void stream_alloc_(void *data)
+{
+    stream_alloc_t *sa = (stream_alloc_t*) data;
+    sa->val = allocVector(sa->type, sa->n);
+}
+
+static SEXP stream_alloc(SEXPTYPE type, R_xlen_t n)
+{
+    stream_alloc_t sa;
+    sa.type = type;
+    sa.n = n;
+    sa.val = 0;
+    if (!R_ToplevelExec(stream_alloc_, &sa)) {
+	REprintf("Rserve SEXP parsing: cannot allocate vector of length %.0f\n", (double) n);
+	return 0;
+    }
+    return sa.val;
+}
+
+/* reads the header of a node of at most len bytes into h,
+   returns the type or -1 */
+static int stream_header(qap_stream_t *s, rlen_t len, unsigned int *h, int *hs, rlen_t *ln)
+{
+    int ty;
+    if (len < 4 || stream_read(s, h, 4))
+	return -1;
+    ty = PAR_TYPE(ptoi(h[0]));
+    *ln = PAR_LEN(ptoi(h[0]));
+    *hs = 4;
+    if (IS_LARGE(ty)) {
+	if (len < 8 || stream_read(s, h + 1, 4))
+	    return -1;
+	ty ^= XT_LARGE;
+	*ln |= ((rlen_t) (unsigned int) ptoi(h[1])) << 24;
+	*hs = 8;
+    }
+    if (*ln > len - *hs)
+	return -1;
+    return ty;
+}
+
+/* reads the payload of ln bytes of the node with the header h into a
+   buffer and decodes it */
+static SEXP stream_buffered(qap_stream_t *s, unsigned int *h, int hs, rlen_t ln)
+{
+    unsigned int *buf, *b;
+    SEXP val;
+    if (s->max_buf && ln > s->max_buf) {
+	REprintf("Rserve SEXP parsing: object too big\n");
+	return 0;
+    }
+    if (!(buf = (unsigned int*) malloc(hs + ln + 8)))
+	return 0;
+    memcpy(buf, h, hs);
+    if (stream_read(s, ((char*) buf) + hs, ln)) {
+	free(buf);
+	return 0;
+    }
+    memset(((char*) buf) + hs + ln, 0, 8);
+    b = buf;
+    val = decode_to_SEXP(&b);
+    free(buf);
+    return val;
+}
+
+/* reads n elements of size es directly into the vector payload */
+static int stream_array(qap_stream_t *s, void *dst, R_xlen_t n, int es)
+{
+    if (stream_read(s, dst, (rlen_t) n * es))
+	return -1;
+#ifndef NATIVE_COPY
+    {
+	R_xlen_t i;
+	if (es == sizeof(int)) {
+	    int *iv = (int*) dst;
+	    for (i = 0; i < n; i++) iv[i] = ptoi(iv[i]);
+	} else { /* doubles, complex numbers are pairs of doubles */
+	    double *dv = (double*) dst, t;
+	    for (i = 0; i < n * (es / 8); i++) {
+		fixdcpy(&t, dv + i);
+		dv[i] = t;
 	    }
-	    head = CDR(head);
 	}
-	if (has_class) /* if it has a class slot, we have to set the object bit */
-	    SET_OBJECT(val, 1);
-#ifdef SET_S4_OBJECT
-	/* FIXME: we have currently no way of knowing whether an object
-	   derived from a non-S4 type is actually S4 object. Hence
-	   we can only flag "pure" S4 objects */
-	if (TYPEOF(val) == S4SXP)
-	    SET_S4_OBJECT(val);
+    }
+#endif
+    return 0;
+}
+
+/* decodes the next node of at most len bytes */
+static SEXP stream_node(qap_stream_t *s, rlen_t len, int depth)
+{
+    unsigned int h[2];
+    int hs, ty;
+    rlen_t ln, pos;
+    SEXP val = 0, attr = R_NilValue;
+
+    if ((ty = stream_header(s, len, h, &hs, &ln)) < 0) {
+	REprintf("Rserve SEXP parsing: invalid object length\n");
+	return 0;
+    }
+    if (ln < QAP_STREAM_MIN || depth >= QAP_STREAM_DEPTH || !IS_STREAMED(ty & ~XT_HAS_ATTR))
+	return stream_buffered(s, h, hs, ln);
+#ifdef RSERV_DEBUG
+    printf("stream decode: type=%d, len=%ld, depth=%d\n", ty, (long)ln, depth);
 #endif
-	UNPROTECT(2); /* vatt + val */
+    if (ty & XT_HAS_ATTR) {
+	pos = s->pos;
+	if (!(attr = stream_node(s, ln, depth + 1)))
+	    return 0;
+	ln -= s->pos - pos;
+	ty ^= XT_HAS_ATTR;
+    }
+    PROTECT(attr);
+    switch (ty) {
+    case XT_ARRAY_INT:
+	if ((val = stream_alloc(INTSXP, ln / 4)) &&
+	    (stream_array(s, INTEGER(val), XLENGTH(val), sizeof(int)) || stream_skip(s, ln & 3)))
+	    val = 0;
+	break;
+
+    case XT_ARRAY_DOUBLE:
+	if ((val = stream_alloc(REALSXP, ln / 8)) &&
+	    (stream_array(s, REAL(val), XLENGTH(val), sizeof(double)) || stream_skip(s, ln & 7)))
+	    val = 0;
+	break;
+
+    case XT_ARRAY_CPLX:
+	if ((val = stream_alloc(CPLXSXP, ln / 16)) &&
+	    (stream_array(s, COMPLEX(val), XLENGTH(val), sizeof(Rcomplex)) || stream_skip(s, ln & 15)))
+	    val = 0;
+	break;
+
+    case XT_RAW:
+    case XT_ARRAY_BOOL:
+	{
+	    unsigned int vl;
+	    if (stream_read(s, &vl, 4))
+		break;
+	    vl = ptoi(vl);
+	    if (vl > ln - 4) {
+		REprintf("Rserve SEXP parsing: invalid %s vector\n", (ty == XT_RAW) ? "raw" : "logical");
+		break;
+	    }
+	    if (ty == XT_RAW) {
+		if ((val = stream_alloc(RAWSXP, vl)) && stream_read(s, RAW(val), vl))
+		    val = 0;
+	    } else if ((val = stream_alloc(LGLSXP, vl))) {
+		/* read the bytes into the last quarter and expand them
+		   in place - element i never overwrites bytes beyond i */
+		unsigned char *cb = ((unsigned char*) LOGICAL(val)) + 3 * (rlen_t) vl;
+		int *lv = LOGICAL(val);
+		R_xlen_t i;
+		if (stream_read(s, cb, vl))
+		    val = 0;
+		else
+		    for (i = 0; i < vl; i++) {
+			unsigned char v = cb[i];
+			lv[i] = (v == 1) ? TRUE : ((v == 0) ? FALSE : NA_LOGICAL);
+		    }
+	    }
+	    if (val && stream_skip(s, ln - 4 - vl))
+		val = 0;
+	}
+	break;
+
+    case XT_VECTOR:
+    case XT_VECTOR_EXP:
+	{
+	    /* the number of elements is not known in advance,
+	       so they are collected in a list that grows as needed */
+	    PROTECT_INDEX pi;
+	    R_xlen_t n = 0, i;
+	    SEXP el;
+	    PROTECT_WITH_INDEX(val = allocVector(VECSXP, 64), &pi);
+	    while (ln > 0) {
+		pos = s->pos;
+		if (!(el = stream_node(s, ln, depth + 1))) {
+		    val = 0;
+		    break;
+		}
+		ln -= s->pos - pos;
+		if (n == XLENGTH(val)) {
+		    SEXP nv;
+		    PROTECT(el);
+		    nv = allocVector(VECSXP, n * 2);
+		    for (i = 0; i < n; i++)
+			SET_VECTOR_ELT(nv, i, VECTOR_ELT(val, i));
+		    REPROTECT(val = nv, pi);
+		    UNPROTECT(1);
+		}
+		SET_VECTOR_ELT(val, n++, el);
+	    }
+	    if (val) {
+		SEXP res = allocVector((ty == XT_VECTOR) ? VECSXP : EXPRSXP, n);
+		for (i = 0; i < n; i++)
+		    SET_VECTOR_ELT(res, i, VECTOR_ELT(val, i));
+		val = res;
+	    }
+	    UNPROTECT(1);
+	}
+	break;
+    }
+    if (val && attr != R_NilValue) {
+	PROTECT(val);
+	set_attr(val, attr);
+	UNPROTECT(1);
     }
-    /* NOTE: val is NOT protected - this guarantees that recursion doesn't fill up the stack */
+    UNPROTECT(1); /* attr */
     return val;
 }
 
+SEXP QAP_decode_stream(qap_read_t rd, void *ctx, rlen_t len, rlen_t max_buf)
+{
+    qap_stream_t s;
+    s.rd = rd;
+    s.ctx = ctx;
+    s.pos = 0;
+    s.max_buf = max_buf;
+#ifdef USE_QREF
+    ref_owner = 0;
+#endif
+    return stream_node(&s, len, 0);
+}
@@ -8,6 +8,37 @@
 
 #include "Rsrv.h"
 
+/* decodes the object at *buf and advances *buf behind it. Returns NULL
+   if the object is malformed or nested deeper than QAP_MAX_DEPTH */
 SEXP QAP_decode(unsigned int **buf);
 
+/* zero-copy variant: integer and real vectors with payloads of at least
+   QAP_REF_MIN bytes and at least half of size (the allocated size of the
+   buffer) are not copied but wrapped in ALTREP vectors that reference
+   the buffer directly. owner must keep the buffer alive as long as it
+   is referenced (typically an external pointer with a finalizer that
+   releases the buffer). If refs is not NULL the number
+   of created references is stored there - if it is zero, the buffer
+   is not referenced by the result. Falls back to QAP_decode()
+   behavior if ALTREP is not available. */
+#define QAP_REF_MIN 1048576
+SEXP QAP_decode_ref(unsigned int **buf, rlen_t size, SEXP owner, int *refs);
+
+/* streaming variant: decodes an object of at most len bytes which is
+   read using rd(ctx, buf, n) - it must read exactly n bytes and
+   return 0 or return -1 on failure. Large integer, numeric, complex,
+   logical and raw vectors are read directly into the R vectors, so
+   the object never has to be held in a buffer as a whole. Other
+   nodes are buffered and decoded as in QAP_decode(), if max_buf is
+   not 0 they may not be longer than max_buf bytes. Returns NULL if
+   rd failed or the object cannot be decoded, the number of bytes
+   consumed is undefined in that case. */
+typedef int (*qap_read_t)(void *ctx, void *buf, rlen_t n);
+SEXP QAP_decode_stream(qap_read_t rd, void *ctx, rlen_t len, rlen_t max_buf);
+
+/* max. size (in bytes) of a compact sequence that has to be expanded
+   because ALTREP is not available, longer ones are decoded as NULL.
+   0 = no limit (default), the server uses maxinbuf */
+extern rlen_t QAP_seq_max;
+
 #endif
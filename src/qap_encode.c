@@ -1,9 +1,14 @@
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include "qap_encode.h"
 #include <Rversion.h>
 
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
 /* compatibility re-mapping */
 #define getStorageSize QAP_getStorageSize
 #define storeSEXP      QAP_storeSEXP
@@ -11,387 +16,1429 @@
 /* FIXME: we should move this to some common place ... */
 /* string encoding handling */
 #if (R_VERSION < R_Version(2,8,0)) || (defined DISABLE_ENCODING)
-#define mkRChar(X) mkChar(X)
-#define CHAR_FE(X) CHAR(X)
+#define sc_reset()
+
+/* string in the current encoding and its length */
+static const char *str_fe(SEXP c, rlen_t *len) {
+	*len = LENGTH(c);
+	return CHAR(c);
+}
 #else
 #define USE_ENCODING 1
 extern cetype_t string_encoding;
-#define mkRChar(X) mkCharCE((X), string_encoding)
-#define CHAR_FE(X) charsxp_to_current(X)
-static const char *charsxp_to_current(SEXP s) {
-	if (Rf_getCharCE(s) == string_encoding) return CHAR(s);
-	return Rf_reEnc(CHAR(s), getCharCE(s), string_encoding, 0);
+
+/* Re-encoding strings is expensive and both the sizing and the storing
+   pass need the result, so converted strings are memoized in a hash
+   table keyed by their CHARSXP (CHARSXPs are cached by R so repeated
+   strings are only converted once). ASCII strings and strings that are
+   already in the target encoding need no conversion and their length
+   is known from the CHARSXP, so they bypass the table entirely.
+   The table lives from a top-level sizing call until the end of the
+   top-level store that follows (the object is protected by the caller
+   so the keys remain valid). */
+#if R_VERSION >= R_Version(4,1,0)
+#define CHAR_IS_ASCII(C) Rf_charIsASCII(C)
+#else /* no API to check, Rf_reEnc() will deal with it */
+#define CHAR_IS_ASCII(C) 0
+#endif
+
+typedef struct str_conv {
+	SEXP c;
+	const char *s;
+	rlen_t len;
+} str_conv_t;
+
+static str_conv_t *sc_tab;
+static rlen_t sc_size, sc_used;
+
+#define sc_hash(C) ((rlen_t) ((((unsigned long) (C)) >> 4) * 2654435761UL))
+
+static void sc_reset(void) {
+	if (sc_tab) free(sc_tab);
+	sc_tab = 0;
+	sc_size = sc_used = 0;
+}
+
+static void sc_add(SEXP c, const char *s, rlen_t len) {
+	rlen_t i;
+	if (sc_used * 2 >= sc_size) { /* grow and re-hash */
+		rlen_t j, ns = sc_size ? (sc_size * 2) : 1024;
+		str_conv_t *nt = (str_conv_t*) calloc(ns, sizeof(str_conv_t));
+		if (!nt) return; /* no memo, we'll just convert again */
+		for (j = 0; j < sc_size; j++)
+			if (sc_tab[j].c) {
+				i = sc_hash(sc_tab[j].c) & (ns - 1);
+				while (nt[i].c) i = (i + 1) & (ns - 1);
+				nt[i] = sc_tab[j];
+			}
+		if (sc_tab) free(sc_tab);
+		sc_tab = nt;
+		sc_size = ns;
+	}
+	i = sc_hash(c) & (sc_size - 1);
+	while (sc_tab[i].c) i = (i + 1) & (sc_size - 1);
+	sc_tab[i].c = c;
+	sc_tab[i].s = s;
+	sc_tab[i].len = len;
+	sc_used++;
+}
+
+/* string in the current encoding and its length */
+static const char *str_fe(SEXP c, rlen_t *len) {
+	const char *s;
+	if (CHAR_IS_ASCII(c) || Rf_getCharCE(c) == string_encoding) {
+		*len = LENGTH(c);
+		return CHAR(c);
+	}
+	if (sc_size) {
+		rlen_t i = sc_hash(c) & (sc_size - 1);
+		while (sc_tab[i].c) {
+			if (sc_tab[i].c == c) {
+				*len = sc_tab[i].len;
+				return sc_tab[i].s;
+			}
+			i = (i + 1) & (sc_size - 1);
+		}
+	}
+	s = Rf_reEnc(CHAR(c), getCharCE(c), string_encoding, 0);
+	*len = strlen(s);
+	sc_add(c, s, *len);
+	return s;
 }
 #endif
 
 /* this is the representation of NAs in strings. We chose 0xff since that should never occur in UTF-8 strings. If 0xff occurs in the beginning of a string anyway, it will be doubled to avoid misrepresentation. */
 static const unsigned char NaStringRepresentation[2] = { 255, 0 };
 
-#define attrFixup if (hasAttr) buf = storeSEXP(buf, ATTRIB(x), 0);
 #define dist(A,B) (((rlen_t)(((char*)B)-((char*)A))) - 4L)
 #define align(A) (((A) + 3L) & (rlen_max ^ 3L))
 
-rlen_t getStorageSize(SEXP x) {
-    int t = TYPEOF(x);
-    rlen_t len = 4;
-    rlen_t tl = 0;
-    
-#if defined RSERV_DEBUG && ! (defined DEBUG_NO_STORAGE)
-    switch(tl) { /* only some types support XLENGTH calls now */
-    case CPLXSXP:
-    case REALSXP:
-    case INTSXP:
-    case LGLSXP:
-    case RAWSXP:
-    case STRSXP:
-    case EXPRSXP:
-    case VECSXP:
-	tl = XLENGTH(x);
-	break;
-    default:
-	tl = (rlen_t) -1;
+int QAP_ext = 0;
+
+/* payloads are only read, so ALTREP vectors (such as shared or mapped
+   vectors, see rsmap.h) don't need to provide a writable copy */
+#if (R_VERSION >= R_Version(3,5,0)) && ! (defined DISABLE_ALTREP)
+#define REAL_R(X)    ((double*) REAL_RO(X))
+#define INTEGER_R(X) ((int*) INTEGER_RO(X))
+#define LOGICAL_R(X) ((int*) LOGICAL_RO(X))
+#else
+#define REAL_R    REAL
+#define INTEGER_R INTEGER
+#define LOGICAL_R LOGICAL
+#endif
+
+/* compact sequences: ALTREP vectors that have not been materialized
+   (such as seq_len(n) or 1:n) are checked element-wise via their
+   region accessors (which doesn't expand them) and if they form an
+   arithmetic sequence they are sent as XT_ARRAY_*_SEQ */
+#if (R_VERSION >= R_Version(3,5,0)) && ! (defined DISABLE_ALTREP)
+#define SEQ_MIN   4   /* don't bother with shorter vectors */
+#define SEQ_CHUNK 512
+
+/* returns 1 if x can be sent as a sequence start + i * step */
+static int seq_info(SEXP x, double *start, double *step) {
+    R_xlen_t n, i, j, k;
+    double s, d;
+
+    if (!(QAP_ext & QAPX_SEQ) || !ALTREP(x) || DATAPTR_OR_NULL(x) ||
+	(n = XLENGTH(x)) < SEQ_MIN)
+	return 0;
+    if (TYPEOF(x) == INTSXP) {
+	int v[SEQ_CHUNK];
+	double last;
+	if ((double) n > 4294967295.0) /* n is sent as 32-bit */
+	    return 0;
+	s = (double) INTEGER_ELT(x, 0);
+	d = (double) INTEGER_ELT(x, 1) - s;
+	last = s + (double) (n - 1) * d;
+	if (last < (double) INT_MIN || last > (double) INT_MAX)
+	    return 0;
+	for (i = 0; i < n; i += k) {
+	    if ((k = INTEGER_GET_REGION(x, i, SEQ_CHUNK, v)) < 1)
+		return 0;
+	    for (j = 0; j < k; j++)
+		if (v[j] != (int) (s + (double) (i + j) * d))
+		    return 0;
+	}
+    } else if (TYPEOF(x) == REALSXP) {
+	double v[SEQ_CHUNK], e1;
+	s = REAL_ELT(x, 0);
+	e1 = REAL_ELT(x, 1);
+	/* the difference of the first two elements is not necessarily
+	   the step the sequence was created with, so try the step
+	   derived from the end points first */
+	d = (REAL_ELT(x, n - 1) - s) / (double) (n - 1);
+	if (s + d != e1)
+	    d = e1 - s;
+	for (i = 0; i < n; i += k) {
+	    if ((k = REAL_GET_REGION(x, i, SEQ_CHUNK, v)) < 1)
+		return 0;
+	    for (j = 0; j < k; j++) { /* compare bits so -0 and NaNs don't pass */
+		double e = s + (double) (i + j) * d;
+		if (memcmp(v + j, &e, sizeof(double)))
+		    return 0;
+	    }
+	}
+    } else
+	return 0;
+    *start = s;
+    *step = d;
+    return 1;
+}
+#else
+#define seq_info(X, S, D) 0
+#endif
+
+/* dictionary encoding of string vectors (XT_ARRAY_STR_DICT): the
+   distinct strings are sent once and the vector as indices into
+   them. It is used (if enabled by the client) for vectors with many
+   repeated strings when it results in a smaller payload - it also
+   saves the receiver from creating the same string over and over.
+   CHARSXPs are unique for each string and encoding so they are used
+   as keys directly. */
+#define SD_MIN 16 /* don't bother with shorter vectors */
+#define SD_NA  0xffffffffU
+
+/* index width (in bytes) for a dictionary with M entries - the
+   value with all bits set is reserved for NA */
+#define sd_width(M) (((M) < 255) ? 1 : (((M) < 65535) ? 2 : 4))
+
+typedef struct str_dict {
+    SEXP *tab;        /* hash table of CHARSXPs */
+    unsigned int *id; /* dictionary index of each table entry */
+    SEXP *list;       /* entries in the order of first occurrence */
+    rlen_t size, used;
+} str_dict_t;
+
+static str_dict_t sd;
+
+#define sd_hash(C) ((rlen_t) ((((unsigned long) (C)) >> 4) * 2654435761UL))
+
+static void sd_free(void) {
+    if (sd.tab) free(sd.tab);
+    if (sd.id) free(sd.id);
+    if (sd.list) free(sd.list);
+    memset(&sd, 0, sizeof(sd));
+}
+
+/* returns the dictionary index of c or SD_NA if it is not in the
+   dictionary */
+static unsigned int sd_find(SEXP c) {
+    rlen_t i;
+    if (!sd.size)
+	return SD_NA;
+    i = sd_hash(c) & (sd.size - 1);
+    while (sd.tab[i]) {
+	if (sd.tab[i] == c) return sd.id[i];
+	i = (i + 1) & (sd.size - 1);
+    }
+    return SD_NA;
+}
+
+/* removes all entries - only the used slots of the table are cleared
+   since it is sized for the largest vector seen so far */
+static void sd_clear(void) {
+    rlen_t j, i;
+    for (j = 0; j < sd.used; j++) {
+	i = sd_hash(sd.list[j]) & (sd.size - 1);
+	while (sd.tab[i] != sd.list[j])
+	    i = (i + 1) & (sd.size - 1);
+	sd.tab[i] = 0;
+    }
+    sd.used = 0;
+}
+
+/* returns the dictionary index of c (adding it if necessary)
+   or SD_NA if out of memory */
+static unsigned int sd_get(SEXP c) {
+    rlen_t i;
+    unsigned int k = sd_find(c);
+    if (k != SD_NA)
+	return k;
+    if (sd.used * 2 >= sd.size) { /* grow and re-hash */
+	rlen_t j, ns = sd.size ? (sd.size * 2) : 1024;
+	SEXP *nt = (SEXP*) calloc(ns, sizeof(SEXP)), *nl;
+	unsigned int *ni = (unsigned int*) malloc(ns * sizeof(unsigned int));
+	if (!nt || !ni || !(nl = (SEXP*) realloc(sd.list, (ns / 2) * sizeof(SEXP)))) {
+	    if (nt) free(nt);
+	    if (ni) free(ni);
+	    return SD_NA;
+	}
+	sd.list = nl;
+	for (j = 0; j < sd.size; j++)
+	    if (sd.tab[j]) {
+		i = sd_hash(sd.tab[j]) & (ns - 1);
+		while (nt[i]) i = (i + 1) & (ns - 1);
+		nt[i] = sd.tab[j];
+		ni[i] = sd.id[j];
+	    }
+	if (sd.tab) free(sd.tab);
+	if (sd.id) free(sd.id);
+	sd.tab = nt;
+	sd.id = ni;
+	sd.size = ns;
+    }
+    i = sd_hash(c) & (sd.size - 1);
+    while (sd.tab[i])
+	i = (i + 1) & (sd.size - 1);
+    sd.tab[i] = c;
+    sd.list[sd.used] = c;
+    return (sd.id[i] = (unsigned int) sd.used++);
+}
+
+/* builds the dictionary of x and returns the size of its dictionary
+   encoded payload or 0 if x should be stored as XT_ARRAY_STR */
+static rlen_t sd_build(SEXP x) {
+    rlen_t n = XLENGTH(x), i, plain = 0, dl = 0, l;
+    const char *cv;
+
+    if (!(QAP_ext & QAPX_STR_DICT) || n < SD_MIN)
+	return 0;
+    sd_clear();
+    for (i = 0; i < n; i++) {
+	SEXP cs = STRING_ELT(x, i);
+	if (cs == R_NaString) {
+	    plain += 2;
+	    continue;
+	}
+	cv = str_fe(cs, &l);
+	plain += l + 1 + (((unsigned char) cv[0] == NaStringRepresentation[0]) ? 1 : 0);
+	/* give up early if there is not enough repetition */
+	if (sd_get(cs) == SD_NA || sd.used > n / 2)
+	    return 0;
+    }
+    for (i = 0; i < sd.used; i++) {
+	cv = str_fe(sd.list[i], &l);
+	dl += l + 1 + (((unsigned char) cv[0] == NaStringRepresentation[0]) ? 1 : 0);
+    }
+    dl = 8 + align(n * sd_width(sd.used)) + align(dl);
+    return (dl < align(plain)) ? dl : 0;
+}
+
+/* stores the indices of len elements starting at the i-th into buf
+   (the dictionary must have been built by sd_build). Returns the number
+   of bytes or -1 if an element is not in the dictionary */
+static rlen_t sd_store_idx(unsigned char *buf, SEXP x, rlen_t i, rlen_t len) {
+    int w = sd_width(sd.used);
+    unsigned char *c = buf;
+    rlen_t e = i + len;
+    while (i < e) {
+	SEXP cs = STRING_ELT(x, i++);
+	unsigned int k = SD_NA;
+	if (cs != R_NaString && (k = sd_find(cs)) == SD_NA)
+	    return -1;
+	*(c++) = (unsigned char) (k & 255);
+	if (w > 1) {
+	    *(c++) = (unsigned char) ((k >> 8) & 255);
+	    if (w > 2) {
+		*(c++) = (unsigned char) ((k >> 16) & 255);
+		*(c++) = (unsigned char) ((k >> 24) & 255);
+	    }
+	}
+    }
+    return c - buf;
+}
+
+/* --- parallel copy of large payloads ---
+   storeSEXP() only lays out large numeric payloads (which needs the R
+   API) and records the copy jobs, they are run once the layout is
+   complete. The copy is pure memory work (memcpy or byte-swapping
+   copy) so it can be done by several threads which is worthwhile for
+   objects consisting of many large vectors (e.g. data frames). */
+int    QAP_copy_threads = 0;
+rlen_t QAP_copy_min = 1048576;
+
+typedef struct cp_job {
+    void *dst;
+    const void *src;
+    rlen_t len;    /* in bytes */
+    int es;        /* element size (for byte-swapping) */
+} cp_job_t;
+
+/* large payloads are split into jobs of at most this size so a single
+   large vector is copied in parallel as well (multiple of 16) */
+#define CP_CHUNK (4L * 1048576L)
+
+static cp_job_t *cp_tab;
+static rlen_t cp_size, cp_used;
+
+static void cp_run(cp_job_t *j) {
+#ifdef NATIVE_COPY
+    memcpy(j->dst, j->src, j->len);
+#else
+    rlen_t i = 0, n = j->len / j->es;
+    if (j->es == 4) {
+	unsigned int *d = (unsigned int*) j->dst;
+	const unsigned int *s = (const unsigned int*) j->src;
+	for (; i < n; i++) d[i] = itop(s[i]);
+    } else if (j->es == 8) {
+	for (; i < n; i++) fixdcpy(((double*) j->dst) + i, ((double*) j->src) + i);
+    } else
+	memcpy(j->dst, j->src, j->len);
+#endif
+}
+
+/* copies len bytes of elements of size es from src to dst - either
+   right away or deferred to cp_flush() if the payload is large and
+   parallel copy is enabled */
+static void cp_add(void *dst, const void *src, rlen_t len, int es) {
+    cp_job_t j;
+#ifdef WITH_THREADS
+    if (QAP_copy_threads > 1 && len >= QAP_copy_min) {
+	rlen_t n = (len + CP_CHUNK - 1) / CP_CHUNK;
+	if (cp_used + n > cp_size) {
+	    rlen_t ns = cp_size ? (cp_size * 2) : 256;
+	    cp_job_t *nt;
+	    while (ns < cp_used + n) ns *= 2;
+	    if ((nt = (cp_job_t*) realloc(cp_tab, sizeof(cp_job_t) * ns))) {
+		cp_tab = nt;
+		cp_size = ns;
+	    }
+	}
+	if (cp_used + n <= cp_size) {
+	    while (len > 0) {
+		cp_job_t *c = cp_tab + (cp_used++);
+		c->dst = dst;
+		c->src = src;
+		c->len = (len > CP_CHUNK) ? CP_CHUNK : len;
+		c->es = es;
+		dst = ((char*) dst) + c->len;
+		src = ((const char*) src) + c->len;
+		len -= c->len;
+	    }
+	    return;
+	}
+    }
+#endif
+    j.dst = dst;
+    j.src = src;
+    j.len = len;
+    j.es = es;
+    cp_run(&j);
+}
+
+#ifdef WITH_THREADS
+static pthread_mutex_t cp_mutex = PTHREAD_MUTEX_INITIALIZER;
+static rlen_t cp_next;
+
+static void *cp_worker(void *arg) {
+    while (1) {
+	rlen_t i;
+	pthread_mutex_lock(&cp_mutex);
+	i = cp_next++;
+	pthread_mutex_unlock(&cp_mutex);
+	if (i >= cp_used)
+	    break;
+	cp_run(cp_tab + i);
+    }
+    return 0;
+}
+#endif
+
+/* runs all deferred copy jobs - if run is 0 they are discarded */
+static void cp_flush(int run) {
+#ifdef WITH_THREADS
+    if (run && cp_used) {
+	pthread_t th[QAP_COPY_MAX_THREADS];
+	int n = (QAP_copy_threads > QAP_COPY_MAX_THREADS) ? QAP_COPY_MAX_THREADS : QAP_copy_threads, i, started = 0;
+	if (n > cp_used) n = (int) cp_used;
+	cp_next = 0;
+	/* the calling thread is one of the workers */
+	for (i = 1; i < n; i++)
+	    if (!pthread_create(th + started, 0, cp_worker, 0))
+		started++;
+	cp_worker(0);
+	for (i = 0; i < started; i++)
+	    pthread_join(th[i], 0);
+    }
+    cp_used = 0;
+    if (cp_size > 4096) { /* don't hold on to large tables */
+	free(cp_tab);
+	cp_tab = 0;
+	cp_size = 0;
     }
-    printf("getStorageSize(%p,type=%d,len=%ld) ", (void*)x, t, (long) tl);
 #endif
-    if (t != CHARSXP && TYPEOF(ATTRIB(x)) == LISTSXP) {
-		rlen_t alen = getStorageSize(ATTRIB(x));
-		len += alen;
+}
+
+/* --- iterative traversal ---
+   Objects are traversed using an explicit stack instead of recursion
+   so the depth of an object is not limited by the C stack (and each
+   node costs a frame push instead of a function call). Each frame
+   represents a node whose children are being visited: the attributes
+   first, then the elements (CAR and TAG of each cell for pairlists,
+   formals and body for closures). */
+typedef struct enc_frame {
+    SEXP x;          /* the node (may be NULL which is stored as XT_NULL) */
+    SEXP l;          /* next cell (pairlists) */
+    rlen_t i, n;     /* next element and number of elements (vectors) */
+    int t;           /* TYPEOF(x) or -1 for NULL */
+    int step;        /* next child: 0 = attributes, 1 = element, 2 = tag */
+    int hasAttr;     /* XT_HAS_ATTR if x has attributes */
+    int tags;        /* pairlist has at least one tag */
+    int type;        /* XT_ type of the node (storing passes) */
+    int seq;         /* stored as compact sequence start = s0, step = d0 */
+    double s0, d0;
+    rlen_t slot;     /* index of the node in the size record */
+    rlen_t len;      /* sizing: size of the children so far */
+    unsigned int *pre; /* storeSEXP: start of the node */
+} enc_frame_t;
+
+typedef struct enc_stack {
+    enc_frame_t *f;
+    int depth, alloc;
+} enc_stack_t;
+
+/* initializes the frame for x, returns 1 if x has children (which
+   means it has to be pushed on the stack) or 0 for leaves */
+static int es_init(enc_frame_t *f, SEXP x) {
+    f->x = x;
+    f->len = 0;
+    f->hasAttr = f->seq = 0;
+    if (!x) {
+	f->t = -1;
+	return 0;
     }
-    switch (t) {
+    f->t = TYPEOF(x);
+    if (f->t != CHARSXP && TYPEOF(ATTRIB(x)) == LISTSXP)
+	f->hasAttr = XT_HAS_ATTR;
+    else switch (f->t) { /* the common case of leaves is done here */
+	case LISTSXP:
+	case LANGSXP:
+	case CLOSXP:
+	case VECSXP:
+	case EXPRSXP:
+	    break;
+	default:
+	    return 0;
+	}
+    f->step = f->hasAttr ? 0 : 1;
+    f->l = R_NilValue;
+    f->i = f->n = 0;
+    f->tags = 0;
+    switch (f->t) {
     case LISTSXP:
     case LANGSXP:
-		{
-			SEXP l = x;
-			rlen_t tags = 0, n = 0;
-			while (l != R_NilValue) {
-				len  += getStorageSize(CAR(l));
-				tags += getStorageSize(TAG(l));
-				n++;
-				l = CDR(l);
-			}
-			if (tags > 4L * n) len += tags; /* use tagged list */
+	{
+	    SEXP l = x;
+	    while (l != R_NilValue) {
+		if (TAG(l) != R_NilValue) {
+		    f->tags = 1;
+		    break;
 		}
-		break;
+		l = CDR(l);
+	    }
+	    f->l = x;
+	}
+	break;
+    case VECSXP:
+    case EXPRSXP:
+	f->n = XLENGTH(x);
+	return (f->n > 0 || f->hasAttr);
+    }
+    return 1;
+}
+
+/* pushes a copy of the (initialized) frame, returns a pointer to the
+   new top or NULL if the depth limit is reached or there is not enough
+   memory */
+static enc_frame_t *es_push(enc_stack_t *es, enc_frame_t *f) {
+    if (es->depth >= QAP_MAX_DEPTH)
+	return 0;
+    if (es->depth >= es->alloc) {
+	int na = es->alloc ? (es->alloc * 2) : 64;
+	enc_frame_t *nf = (enc_frame_t*) realloc(es->f, sizeof(enc_frame_t) * na);
+	if (!nf) return 0;
+	es->f = nf;
+	es->alloc = na;
+    }
+    es->f[es->depth] = *f;
+    return es->f + es->depth++;
+}
+
+static void es_free(enc_stack_t *es) {
+    if (es->f) free(es->f);
+    es->f = 0;
+    es->depth = es->alloc = 0;
+}
+
+/* sets *c to the next child of the node and returns 1 or returns 0
+   if all children have been visited. Tags are only visited if the
+   pairlist has any. */
+static int es_child(enc_frame_t *f, SEXP *c) {
+    if (!f->step) {
+	f->step = 1;
+	*c = ATTRIB(f->x);
+	return 1;
+    }
+    switch (f->t) {
+    case LISTSXP:
+    case LANGSXP:
+	if (f->step == 2) {
+	    *c = TAG(f->l);
+	    f->l = CDR(f->l);
+	    f->step = 1;
+	    return 1;
+	}
+	if (f->l == R_NilValue)
+	    return 0;
+	*c = CAR(f->l);
+	if (f->tags)
+	    f->step = 2;
+	else
+	    f->l = CDR(f->l);
+	return 1;
     case CLOSXP:
-		len+=getStorageSize(FORMALS(x));
-		len+=getStorageSize(BODY(x));
-		break;
+	if (f->i > 1)
+	    return 0;
+	*c = (f->i++) ? BODY(f->x) : FORMALS(f->x);
+	return 1;
+    case VECSXP:
+    case EXPRSXP:
+	if (f->i >= f->n)
+	    return 0;
+	*c = VECTOR_ELT(f->x, f->i++);
+	return 1;
+    }
+    return 0;
+}
+
+/* allocates the next slot in the size record, returns -1 on error */
+static rlen_t sz_slot(qap_sizes_t *sz) {
+    if (sz->nodes >= sz->alloc) {
+	rlen_t na = sz->alloc ? (sz->alloc * 2) : 1024;
+	rlen_t *ns = (rlen_t*) realloc(sz->size, sizeof(rlen_t) * na);
+	if (!ns)
+	    return -1;
+	sz->size = ns;
+	sz->alloc = na;
+    }
+    sz->size[sz->nodes] = 0;
+    return sz->nodes++;
+}
+
+static void sz_free(qap_sizes_t *sz) {
+    if (sz->size) free(sz->size);
+    if (sz->seq) free(sz->seq);
+    memset(sz, 0, sizeof(*sz));
+}
+
+/* checks whether the vector in f (which has been given a slot) is sent
+   as a compact sequence and records it, so the vector is only scanned
+   once. Returns -1 if out of memory */
+static int sz_seq(qap_sizes_t *sz, enc_frame_t *f) {
+    if ((f->t != INTSXP && f->t != REALSXP) || !seq_info(f->x, &f->s0, &f->d0))
+	return 0;
+    if (sz->seqs >= sz->seq_alloc) {
+	rlen_t na = sz->seq_alloc ? (sz->seq_alloc * 2) : 64;
+	qap_seq_t *ns = (qap_seq_t*) realloc(sz->seq, sizeof(qap_seq_t) * na);
+	if (!ns)
+	    return -1;
+	sz->seq = ns;
+	sz->seq_alloc = na;
+    }
+    sz->seq[sz->seqs].slot = f->slot;
+    sz->seq[sz->seqs].start = f->s0;
+    sz->seq[sz->seqs].step = f->d0;
+    sz->seqs++;
+    f->seq = 1;
+    return 0;
+}
+
+/* storing passes: returns 1 if the node in f was recorded as compact
+   sequence by sz_seq() (and sets its start and step). Slots are
+   visited in increasing order so the records are consumed in order */
+static int sz_seq_next(qap_sizes_t *sz, enc_frame_t *f) {
+    qap_seq_t *q;
+    if (sz->seq_pos >= sz->seqs || sz->seq[sz->seq_pos].slot != f->slot)
+	return 0;
+    q = sz->seq + sz->seq_pos++;
+    f->s0 = q->start;
+    f->d0 = q->step;
+    return 1;
+}
+
+/* size of the node itself, i.e., without its attributes and elements.
+   If exact is 0 then this is the upper bound used by
+   QAP_getStorageSize(), otherwise it is the exact size as stored. */
+static rlen_t node_size(enc_frame_t *f, int exact) {
+    SEXP x = f->x;
+    rlen_t len = 4, tl;
+
+    switch (f->t) {
+    case -1:
+	break;
+    case LISTSXP:
+    case LANGSXP:
+    case CLOSXP:
+    case EXPRSXP:
+    case VECSXP:
+    case S4SXP: /* S4 really has the payload in attributes */
+	break;
+    case NILSXP:
+	if (!exact) len += 4L;
+	break;
     case CPLXSXP:
-		tl = XLENGTH(x);
-		len += tl * 16L;
-		break;
-    case REALSXP:
-		tl = XLENGTH(x);
-		len += tl * 8L;
-		break;
+	len += XLENGTH(x) * 16L;
+	break;
+    case REALSXP: /* f->seq is set by sz_seq() */
+	len += f->seq ? 24L : (XLENGTH(x) * 8L);
+	break;
     case INTSXP:
-		tl = XLENGTH(x);
-		len += tl * 4L;
-		break;
+	len += f->seq ? 12L : (XLENGTH(x) * 4L);
+	break;
     case LGLSXP:
     case RAWSXP:
-		tl = XLENGTH(x);
-		if (tl > 1)
-			len += 4L + align(tl);
-		else
-			len += 4L;
-		break;
-
+	tl = XLENGTH(x);
+	if (exact || tl > 1)
+	    len += 4L + align(tl);
+	else
+	    len += 4L;
+	break;
     case SYMSXP:
     case CHARSXP:
-		{
-			const char *ct = ((t==CHARSXP) ? CHAR_FE(x) : CHAR_FE(PRINTNAME(x)));
-			if (!ct)
-				len += 4L;
-			else {
-				rlen_t sl = strlen(ct) + 1L;				
-				len += align(sl);
-			}
-		}
-		break;
+	{
+	    rlen_t sl;
+	    str_fe((f->t == CHARSXP) ? x : PRINTNAME(x), &sl);
+	    len += align(sl + 1L);
+	}
+	break;
     case STRSXP:
-		{
-			rlen_t i = 0;
-			tl = XLENGTH(x);
-			while (i < tl) {
-				len += getStorageSize(STRING_ELT(x, i));
-				i++;
-			}
-		}
+	{
+	    rlen_t i = 0, sl, l;
+	    tl = XLENGTH(x);
+	    if ((sl = sd_build(x))) {
+		len += sl;
 		break;
-    case EXPRSXP:
-    case VECSXP:
-		{
-			unsigned int i = 0;
-			tl = XLENGTH(x);
-			while(i < tl) {
-				len += getStorageSize(VECTOR_ELT(x,i));
-				i++;
-			}
+	    }
+	    if (!exact) {
+		while (i < tl) { /* same as getStorageSize() of each CHARSXP */
+		    str_fe(STRING_ELT(x, i), &l);
+		    len += 4L + align(l + 1L);
+		    i++;
 		}
 		break;
-	case S4SXP:
-		/* S4 really has the payload in attributes, so it doesn't occupy anything */
-		break;
+	    }
+	    while (i < tl) {
+		SEXP cs = STRING_ELT(x, i);
+		if (cs == R_NaString)
+		    sl += 2;
+		else {
+		    const char *cv = str_fe(cs, &l);
+		    if ((unsigned char) cv[0] == NaStringRepresentation[0]) sl++;
+		    sl += l + 1L;
+		}
+		i++;
+	    }
+	    len += align(sl);
+	}
+	break;
     default:
-		len += 4L; /* unknown types are simply stored as int */
+	len += 4L; /* unknown types are simply stored as int */
     }
+    return len;
+}
+
+/* completes the size of a node whose children have been sized */
+static rlen_t size_done(enc_frame_t *f, int exact, qap_sizes_t *sz) {
+    rlen_t len = f->len + node_size(f, exact);
     if (len > 0xfffff0) /* large types must be stored in the new format */
-		len += 4L;
+	len += 4L;
+    if (sz) sz->size[f->slot] = len;
+    return len;
+}
+
+/* computes the size of x (see node_size() for exact) - if sz is not
+   NULL then the size of each node is recorded in the order in which
+   the nodes are stored. Returns -1 on error. */
+static rlen_t enc_size(SEXP x, int exact, qap_sizes_t *sz) {
+    enc_stack_t es = { 0, 0, 0 };
+    enc_frame_t cf, *f;
+    rlen_t len = -1, nl = 0;
+    int kids = es_init(&cf, x);
+    SEXP c;
+
+    if (sz) sz->nodes = sz->pos = sz->seqs = sz->seq_pos = 0;
+    while (1) { /* cf is the next node to visit */
+	if (sz && ((cf.slot = sz_slot(sz)) < 0 || sz_seq(sz, &cf)))
+	    break;
+	if (kids) {
+	    if (!(f = es_push(&es, &cf)))
+		break;
+	} else { /* leaves don't need a stack frame */
+	    nl = size_done(&cf, exact, sz);
+	    if (!es.depth) {
+		len = nl;
+		break;
+	    }
+	    f = es.f + es.depth - 1;
+	    f->len += nl;
+	}
+	/* complete all nodes that have no more children */
+	while (!es_child(f, &c)) {
+	    nl = size_done(f, exact, sz);
+	    if (!--es.depth)
+		break;
+	    f = es.f + es.depth - 1;
+	    f->len += nl;
+	}
+	if (!es.depth) {
+	    len = nl;
+	    break;
+	}
+	kids = es_init(&cf, c);
+    }
+    es_free(&es);
+    return len;
+}
+
+/* node sizes recorded by the last getStorageSize() call so that the
+   following storeSEXP() of the same object doesn't have to compute them
+   again (like the memoized strings they are valid until the end of the
+   store since the object is protected by the caller) */
+static qap_sizes_t last_sz;
+static SEXP last_x;
+
+rlen_t getStorageSize(SEXP x) {
+    rlen_t len;
+    sc_reset(); /* new object, drop memoized strings */
+    len = enc_size(x, 0, &last_sz);
+    last_x = (len < 0) ? 0 : x;
 #if defined RSERV_DEBUG && ! (defined DEBUG_NO_STORAGE)
-    printf("= %lu\n", (unsigned long) len);
+    printf("getStorageSize(%p,type=%d) = %ld\n", (void*)x, x ? TYPEOF(x) : -1, (long) len);
 #endif
     return len;
 }
 
-/* if storage_size is > 0 then it it used instad of a call to getStorageSize() */
-unsigned int* storeSEXP(unsigned int* buf, SEXP x, rlen_t storage_size) {
-    int t = TYPEOF(x);
-    int hasAttr = 0;
-    int isLarge = 0;
-    unsigned int *preBuf = buf;
+/* XT_ type of the node (including XT_HAS_ATTR) - this is where
+   vectors are checked for dictionaries, compact sequences were
+   recorded in sz when sizing */
+static int node_type(enc_frame_t *f, qap_sizes_t *sz) {
+    SEXP x = f->x;
+    int type;
+
+    switch (f->t) {
+    case -1:
+	return XT_NULL;
+    case NILSXP:
+	type = XT_NULL;
+	break;
+    case LISTSXP:
+    case LANGSXP:
+	/* note that we are using the fact that XT_LANG_xx=XT_LIST_xx+2 */
+	type = ((f->t == LISTSXP) ? 0 : 2) + (f->tags ? XT_LIST_TAG : XT_LIST_NOTAG);
+	break;
+    case CLOSXP:
+	type = XT_CLOS;
+	break;
+    case REALSXP:
+	type = (f->seq = sz_seq_next(sz, f)) ? XT_ARRAY_DOUBLE_SEQ : XT_ARRAY_DOUBLE;
+	break;
+    case INTSXP:
+	type = (f->seq = sz_seq_next(sz, f)) ? XT_ARRAY_INT_SEQ : XT_ARRAY_INT;
+	break;
+    case CPLXSXP:
+	type = XT_ARRAY_CPLX;
+	break;
+    case RAWSXP:
+	type = XT_RAW;
+	break;
+    case LGLSXP:
+	type = XT_ARRAY_BOOL;
+	break;
+    case STRSXP:
+	type = sd_build(x) ? XT_ARRAY_STR_DICT : XT_ARRAY_STR;
+	break;
+    case EXPRSXP:
+	type = XT_VECTOR_EXP;
+	break;
+    case VECSXP:
+	type = XT_VECTOR;
+	break;
+    case S4SXP:
+	type = XT_S4;
+	break;
+    case CHARSXP:
+	type = XT_STR;
+	break;
+    case SYMSXP:
+	type = XT_SYMNAME;
+	break;
+    default:
+	type = XT_UNKNOWN;
+    }
+    return type | f->hasAttr;
+}
+
+/* stores the payload of the node (which follows its attributes) */
+static unsigned int *st_payload(enc_frame_t *f, unsigned int *buf) {
+    SEXP x = f->x;
+
+    switch (f->type & ~XT_HAS_ATTR) {
+    case XT_ARRAY_INT_SEQ:
+	buf[0] = itop((unsigned int) XLENGTH(x));
+	buf[1] = itop((int) f->s0);
+	buf[2] = itop((int) f->d0);
+	buf += 3;
+	break;
+
+    case XT_ARRAY_DOUBLE_SEQ:
+	{
+	    double n = (double) XLENGTH(x);
+	    fixdcpy(buf, &n);
+	    fixdcpy(buf + 2, &f->s0);
+	    fixdcpy(buf + 4, &f->d0);
+	    buf += 6;
+	}
+	break;
+
+    case XT_ARRAY_DOUBLE:
+	cp_add(buf, REAL_R(x), sizeof(double) * XLENGTH(x), sizeof(double));
+	buf += XLENGTH(x) * sizeof(double) / sizeof(*buf);
+	break;
+
+    case XT_ARRAY_CPLX:
+	/* the real and imaginary parts are swapped separately */
+	cp_add(buf, COMPLEX(x), XLENGTH(x) * sizeof(*COMPLEX(x)), sizeof(double));
+	buf += XLENGTH(x) * sizeof(*COMPLEX(x)) / sizeof(*buf);
+	break;
+
+    case XT_RAW:
+	{
+	    rlen_t ll = XLENGTH(x);
+	    *buf = itop(ll); buf++;
+	    if (ll) cp_add(buf, RAW(x), ll, 1);
+	    ll += 3; ll /= 4;
+	    buf += ll;
+	}
+	break;
+
+    case XT_ARRAY_BOOL:
+	{
+	    rlen_t ll = XLENGTH(x), i = 0;
+	    int *lgl = LOGICAL_R(x);
+	    *buf = itop(ll); buf++;
+	    while(i < ll) { /* logical values are stored as bytes of values 0/1/2 */
+		int bv = lgl[i];
+		*((unsigned char*)buf) = (bv == 0) ? 0 : (bv==1) ? 1 : 2;
+		buf = (unsigned int*)(((unsigned char*)buf) + 1);
+		i++;
+	    }
+	    /* pad by 0xff to a multiple of 4 */
+	    while (i & 3) {
+		*((unsigned char*)buf) = 0xff;
+		i++;
+		buf=(unsigned int*)(((unsigned char*)buf) + 1);
+	    }
+	}
+	break;
+
+    case XT_ARRAY_STR_DICT:
+	{
+	    rlen_t nx = XLENGTH(x), i, il;
+	    char *st;
+	    if (f->hasAttr) /* attributes may have used the dictionary */
+		sd_build(x);
+	    buf[0] = itop((unsigned int) nx);
+	    buf[1] = itop((unsigned int) sd.used);
+	    st = (char*) (buf + 2);
+	    if ((il = sd_store_idx((unsigned char*) st, x, 0, nx)) < 0)
+		return 0;
+	    st += il;
+	    while ((st - (char*)buf) & 3) *(st++) = 0;
+	    buf = (unsigned int*) st;
+	    for (i = 0; i < sd.used; i++) {
+		rlen_t l;
+		const char *cv = str_fe(sd.list[i], &l);
+		if ((unsigned char) cv[0] == NaStringRepresentation[0])
+		    (st++)[0] = (char) NaStringRepresentation[0];
+		memcpy(st, cv, l + 1);
+		st += l + 1;
+	    }
+	    while ((st - (char*)buf) & 3) *(st++) = 1;
+	    buf = (unsigned int*)st;
+	}
+	break;
+
+    case XT_ARRAY_STR:
+	{
+	    char *st;
+	    rlen_t nx = XLENGTH(x), i;
+	    /* leading int n; is not needed due to the choice of padding */
+	    st = (char *)buf;
+	    for (i = 0; i < nx; i++) {
+		SEXP cs = STRING_ELT(x, i);
+		const char *cv;
+		rlen_t l;
+		if (cs == R_NaString) {
+		    cv = (const char*) NaStringRepresentation;
+		    l = 1;
+		} else {
+		    cv = str_fe(cs, &l);
+		    if ((unsigned char) cv[0] == NaStringRepresentation[0]) /* we will double the leading 0xff to avoid abiguity between NA and "\0xff" */
+			(st++)[0] = (char) NaStringRepresentation[0];
+		}
+		memcpy(st, cv, l + 1);
+		st += l + 1;
+	    }
+	    /* pad with '\01' to make sure we can determine the number of elements */
+	    while ((st - (char*)buf) & 3) *(st++) = 1;
+	    buf = (unsigned int*)st;
+	}
+	break;
+
+    case XT_ARRAY_INT:
+	{
+	    rlen_t n = XLENGTH(x);
+	    cp_add(buf, INTEGER_R(x), n * sizeof(int), sizeof(int));
+	    buf += n;
+	}
+	break;
+
+    case XT_STR:
+    case XT_SYMNAME:
+	{
+	    rlen_t sl;
+	    const char *val = str_fe((f->t == CHARSXP) ? x : PRINTNAME(x), &sl);
+	    memcpy(buf, val, ++sl);
+	    while (sl & 3) /* pad by 0 to a length divisible by 4 (since 0.1-10) */
+		((char*)buf)[sl++] = 0;
+	    buf = (unsigned int*)(((char*)buf) + sl);
+	}
+	break;
+
+    case XT_UNKNOWN:
+	*buf = itop(TYPEOF(x));
+	buf++;
+	break;
+    }
+    return buf;
+}
+
+/* stores the payload of the node and fixes up its header */
+static unsigned int *st_leave(enc_frame_t *f, unsigned int *buf, rlen_t size) {
+    unsigned int *preBuf = f->pre;
     rlen_t txlen;
+    if (!(buf = st_payload(f, buf)))
+	return 0;
+    txlen = dist(preBuf, buf);
+    if (size > 0xfffff0) {
+	txlen -= 4L;
+	preBuf[0] = itop(SET_PAR(PAR_TYPE(f->type | XT_LARGE), txlen & 0xffffff));
+	preBuf[1] = itop(txlen >> 24);
+    } else
+	*preBuf = itop(SET_PAR(PAR_TYPE(f->type), txlen));
+#ifdef RSERV_DEBUG
+    printf("stored %p at %p, %lu bytes\n", (void*)f->x, (void*)preBuf, (unsigned long) dist(preBuf, buf));
+#endif
+    if (dist(preBuf, buf) > size) {
+#ifdef RSERVE_PKG
+	REprintf("**ERROR: underestimated storage %ld / %ld SEXP type %d\n", (long) dist(preBuf, buf), (long) size, f->t);
+#else
+	fprintf(stderr, "**ERROR: underestimated storage %ld / %ld SEXP type %d\n", (long) dist(preBuf, buf), (long) size, f->t);
+#endif
+    }
+    return buf;
+}
+
+/* if storage_size is > 0 then it is used as the size of the top-level
+   object instead of a call to getStorageSize(). Returns NULL if the
+   object cannot be stored (too deeply nested or out of memory). */
+unsigned int* storeSEXP(unsigned int* buf, SEXP x, rlen_t storage_size) {
+    qap_sizes_t sz;
+    enc_stack_t es = { 0, 0, 0 };
+    enc_frame_t cf, *f;
+    SEXP c;
+    int kids;
+
+    /* the size of each node is needed before its payload is stored
+       to decide whether it needs the large header */
+    if (storage_size > 0 && x == last_x) /* sized by getStorageSize() */
+	sz = last_sz;
+    else {
+	sc_reset(); /* not sized before, start afresh */
+	memset(&sz, 0, sizeof(sz));
+	if (enc_size(x, 0, &sz) < 0)
+	    buf = 0;
+    }
+    memset(&last_sz, 0, sizeof(last_sz));
+    last_x = 0;
+    if (buf && storage_size > 0)
+	sz.size[0] = storage_size;
+
+    kids = es_init(&cf, x);
+    while (buf) { /* cf is the next node to store */
+	if (sz.pos >= sz.nodes) { /* the object has changed since sizing */
+	    buf = 0;
+	    break;
+	}
+	cf.slot = sz.pos++;
+	cf.type = node_type(&cf, &sz);
+	cf.pre = buf;
+	buf += (sz.size[cf.slot] > 0xfffff0) ? 2 : 1; /* large format needs 8 bytes */
+	if (kids) {
+	    if (!(f = es_push(&es, &cf))) {
+		buf = 0;
+		break;
+	    }
+	} else {
+	    if (!(buf = st_leave(&cf, buf, sz.size[cf.slot])) || !es.depth)
+		break;
+	    f = es.f + es.depth - 1;
+	}
+	while (!es_child(f, &c)) {
+	    if (!(buf = st_leave(f, buf, sz.size[f->slot])) || !--es.depth)
+		break;
+	    f = es.f + es.depth - 1;
+	}
+	if (!buf || !es.depth)
+	    break;
+	kids = es_init(&cf, c);
+    }
+
+    /* the layout is complete, copy the deferred payloads */
+    cp_flush(buf ? 1 : 0);
+    es_free(&es);
+    sz_free(&sz);
+    /* top-level object done */
+    sc_reset();
+    sd_free();
+
+    return buf;
+}
+
+/* --- streaming encoder --- */
+
+void QAP_stream_init(qap_stream_t *qs, char *buf, rlen_t buf_size, qap_send_fn_t send, void *ctx) {
+    memset(qs, 0, sizeof(*qs));
+    qs->buf = buf;
+    qs->buf_size = buf_size;
+    qs->send = send;
+    qs->ctx = ctx;
+}
+
+void QAP_stream_free(qap_stream_t *qs) {
+    sz_free(&qs->sz);
+}
 
-    if (!x) { /* null pointer will be treated as XT_NULL */
-		*buf = itop(XT_NULL); buf++; goto didit;
+rlen_t QAP_stream_size(qap_stream_t *qs, SEXP x) {
+    rlen_t len;
+    qs->err = 0;
+    if (x != last_x) /* keep the strings memoized by getStorageSize(x) */
+	sc_reset();
+    if ((len = enc_size(x, 1, &qs->sz)) < 0)
+	qs->err = 1;
+    return len;
+}
+
+void QAP_stream_sendv(qap_stream_t *qs, qap_sendv_fn_t sendv) {
+    qs->sendv = sendv;
+}
+
+/* adds the buffered data that is not yet covered to the segment list */
+static void qs_seg_close(qap_stream_t *qs) {
+    if (qs->fill > qs->seg) {
+	qs->iov[qs->iovs].iov_base = qs->buf + qs->seg;
+	qs->iov[qs->iovs].iov_len = qs->fill - qs->seg;
+	qs->iovs++;
+	qs->seg = qs->fill;
     }
-    
-    if (t != CHARSXP && TYPEOF(ATTRIB(x)) == LISTSXP)
-		hasAttr = XT_HAS_ATTR;
-    
-    if (t == NILSXP) {
-		*buf = itop(XT_NULL | hasAttr);
-		buf++;
-		attrFixup;
-		goto didit;
-    } 
-    
-    /* check storage size */
-    if (!storage_size) storage_size = getStorageSize(x);
-    txlen = storage_size;
-    if (txlen > 0xfffff0) { /* if the entry is too big, use large format */
-		isLarge = 1;
-		buf++;
+}
+
+int QAP_stream_flush(qap_stream_t *qs) {
+    if (qs->err) return -1;
+    if (qs->iovs) {
+	qs_seg_close(qs);
+	if (qs->sendv(qs->ctx, qs->iov, qs->iovs) < 0)
+	    qs->err = 1;
+	qs->iovs = 0;
+    } else if (qs->fill) {
+	if (qs->send(qs->ctx, qs->buf, qs->fill) < 0)
+	    qs->err = 1;
     }
-    
-    if (t==LISTSXP || t==LANGSXP) {
-		SEXP l = x;
-		rlen_t tags = 0;
-		while (l != R_NilValue) {
-			if (TAG(l) != R_NilValue) tags++;
-			l = CDR(l);
-		}
-		/* note that we are using the fact that XT_LANG_xx=XT_LIST_xx+2 */
-		*buf = itop((((t == LISTSXP) ? 0 : 2) + (tags ? XT_LIST_TAG : XT_LIST_NOTAG)) | hasAttr);
-		buf++;
-		attrFixup;
-		l = x;
-		while (l != R_NilValue) {			
-			buf = storeSEXP(buf, CAR(l), 0);
-			if (tags)
-				buf = storeSEXP(buf, TAG(l), 0);
-			l = CDR(l);
-		}
-		goto didit;
+    qs->fill = qs->seg = 0;
+    return qs->err ? -1 : 0;
+}
+
+int QAP_stream_put(qap_stream_t *qs, const void *data, rlen_t len) {
+    const char *c = (const char*) data;
+    if (qs->sendv && len >= QAP_STREAM_REF_MIN && !qs->err) {
+	/* reference the block instead of copying it - we need up to two
+	   segments now and one more for the final part of the buffer */
+	if (qs->iovs + 3 > QAP_STREAM_IOVS && QAP_stream_flush(qs))
+	    return -1;
+	qs_seg_close(qs);
+	qs->iov[qs->iovs].iov_base = (void*) c;
+	qs->iov[qs->iovs].iov_len = len;
+	qs->iovs++;
+	return 0;
     }
-    
-    if (t==CLOSXP) { /* closures (send FORMALS and BODY) */
-		*buf=itop(XT_CLOS|hasAttr);
-		buf++;
-		attrFixup;
-		buf=storeSEXP(buf, FORMALS(x), 0);
-		buf=storeSEXP(buf, BODY(x), 0);
-		goto didit;
+    while (len > 0 && !qs->err) {
+	rlen_t av = qs->buf_size - qs->fill;
+	if (av > len) av = len;
+	memcpy(qs->buf + qs->fill, c, av);
+	qs->fill += av;
+	c += av;
+	len -= av;
+	if (qs->fill == qs->buf_size)
+	    QAP_stream_flush(qs);
     }
-    
-    if (t==REALSXP) {
-		*buf=itop(XT_ARRAY_DOUBLE|hasAttr);
-		buf++;
-		attrFixup;
+    return qs->err ? -1 : 0;
+}
+
+static void qs_putc(qap_stream_t *qs, unsigned char c) {
+    if (qs->fill == qs->buf_size && QAP_stream_flush(qs))
+	return;
+    ((unsigned char*)qs->buf)[qs->fill++] = c;
+}
+
+static void qs_int(qap_stream_t *qs, unsigned int i) {
+    i = itop(i);
+    QAP_stream_put(qs, &i, 4);
+}
+
+/* writes the header for a node of the given total size (as computed by QAP_stream_size) */
+static void qs_header(qap_stream_t *qs, int type, rlen_t total) {
+    if (total > 0xfffff0) {
+	rlen_t txlen = total - 8L;
+	qs_int(qs, SET_PAR(PAR_TYPE(type | XT_LARGE), txlen & 0xffffff));
+	qs_int(qs, txlen >> 24);
+    } else
+	qs_int(qs, SET_PAR(PAR_TYPE(type), total - 4L));
+}
+
+/* stores the payload of the node (which follows its attributes) */
+static void qs_payload(qap_stream_t *qs, enc_frame_t *f) {
+    SEXP x = f->x;
+
+    switch (f->type & ~XT_HAS_ATTR) {
+    case XT_ARRAY_DOUBLE_SEQ:
+	{
+	    double n = (double) XLENGTH(x);
+	    unsigned int dv[6];
+	    fixdcpy(dv, &n);
+	    fixdcpy(dv + 2, &f->s0);
+	    fixdcpy(dv + 4, &f->d0);
+	    QAP_stream_put(qs, dv, sizeof(dv));
+	}
+	break;
+
+    case XT_ARRAY_DOUBLE:
 #ifdef NATIVE_COPY
-		memcpy(buf, REAL(x), sizeof(double) * XLENGTH(x));
-		buf += XLENGTH(x) * sizeof(double) / sizeof(*buf);
+	QAP_stream_put(qs, REAL_R(x), sizeof(double) * XLENGTH(x));
 #else
-		{
-			rlen_t i = 0, n = XLENGTH(x);
-			while(i < n) {
-				fixdcpy(buf, REAL(x) + i);
-				buf += 2; /* sizeof(double)=2*sizeof(int) */
-				i++;
-			}
-		}
+	{
+	    rlen_t i = 0, n = XLENGTH(x);
+	    unsigned int dv[2];
+	    while (i < n) {
+		fixdcpy(dv, REAL_R(x) + i);
+		QAP_stream_put(qs, dv, 8);
+		i++;
+	    }
+	}
 #endif
-		goto didit;
-    }
+	break;
 
-    if (t==CPLXSXP) {
-		*buf = itop(XT_ARRAY_CPLX|hasAttr);
-		buf++;
-		attrFixup;
+    case XT_ARRAY_CPLX:
 #ifdef NATIVE_COPY
-		memcpy(buf, COMPLEX(x), XLENGTH(x) * sizeof(*COMPLEX(x)));
-		buf += XLENGTH(x) * sizeof(*COMPLEX(x)) / sizeof(*buf);
+	QAP_stream_put(qs, COMPLEX(x), XLENGTH(x) * sizeof(*COMPLEX(x)));
 #else
-		{
-			rlen_t i = 0, n = XLENGTH(x);
-			while (i < n) {
-				fixdcpy(buf, &(COMPLEX(x)[i].r));
-				buf += 2; /* sizeof(double)=2*sizeof(int) */
-				fixdcpy(buf, &(COMPLEX(x)[i].i));
-				buf += 2; /* sizeof(double)=2*sizeof(int) */
-				i++;
-			}
-		}
+	{
+	    rlen_t i = 0, n = XLENGTH(x);
+	    unsigned int dv[4];
+	    while (i < n) {
+		fixdcpy(dv, &(COMPLEX(x)[i].r));
+		fixdcpy(dv + 2, &(COMPLEX(x)[i].i));
+		QAP_stream_put(qs, dv, 16);
+		i++;
+	    }
+	}
 #endif
-		goto didit;
-    }
+	break;
 
-	if (t==RAWSXP) {
-		rlen_t ll = XLENGTH(x);
-		*buf = itop(XT_RAW | hasAttr);
-		buf++;
-		attrFixup;
-		*buf = itop(ll); buf++;
-		if (ll) memcpy(buf, RAW(x), ll);
-		ll += 3; ll /= 4;
-		buf += ll;
-		goto didit;
-	}
-		
-    if (t==LGLSXP) {
-		rlen_t ll = XLENGTH(x), i = 0;
-		int *lgl = LOGICAL(x);
-		*buf = itop(XT_ARRAY_BOOL | hasAttr);
-		buf++;
-		attrFixup;
-		*buf = itop(ll); buf++;
-		while(i < ll) { /* logical values are stored as bytes of values 0/1/2 */
-			int bv = lgl[i];
-			*((unsigned char*)buf) = (bv == 0) ? 0 : (bv==1) ? 1 : 2;
-			buf = (unsigned int*)(((unsigned char*)buf) + 1);
-			i++;
-		}
-		/* pad by 0xff to a multiple of 4 */
-		while (i & 3) {
-			*((unsigned char*)buf) = 0xff;
-			i++;
-			buf=(unsigned int*)(((unsigned char*)buf) + 1);
-		}
-		goto didit;
-    }
-    
-	if (t == STRSXP) {
-		char *st;
-		rlen_t nx = XLENGTH(x), i;
-		*buf = itop(XT_ARRAY_STR|hasAttr);
-		buf++;
-		attrFixup;
-		/* leading int n; is not needed due to the choice of padding */
-		st = (char *)buf;
-		for (i = 0; i < nx; i++) {
-			const char *cv = CHAR_FE(STRING_ELT(x, i));
-			rlen_t l = strlen(cv);
-			if (STRING_ELT(x, i) == R_NaString) {
-				cv = (const char*) NaStringRepresentation;
-				l = 1;
-			} else if ((unsigned char) cv[0] == NaStringRepresentation[0]) /* we will double the leading 0xff to avoid abiguity between NA and "\0xff" */
-				(st++)[0] = (char) NaStringRepresentation[0];
-			strcpy(st, cv);
-			st += l + 1;
+    case XT_RAW:
+	{
+	    rlen_t ll = XLENGTH(x);
+	    qs_int(qs, ll);
+	    QAP_stream_put(qs, RAW(x), ll);
+	    while (ll & 3) {
+		qs_putc(qs, 0);
+		ll++;
+	    }
+	}
+	break;
+
+    case XT_ARRAY_BOOL:
+	{
+	    rlen_t ll = XLENGTH(x), i = 0;
+	    int *lgl = LOGICAL_R(x);
+	    qs_int(qs, ll);
+	    while (i < ll) { /* logical values are stored as bytes of values 0/1/2 */
+		int bv = lgl[i];
+		qs_putc(qs, (bv == 0) ? 0 : (bv == 1) ? 1 : 2);
+		i++;
+	    }
+	    /* pad by 0xff to a multiple of 4 */
+	    while (i & 3) {
+		qs_putc(qs, 0xff);
+		i++;
+	    }
+	}
+	break;
+
+    case XT_ARRAY_STR_DICT:
+	{
+	    rlen_t nx = XLENGTH(x), i = 0, sl;
+	    unsigned char ib[1024];
+	    if (f->hasAttr) /* attributes may have used the dictionary */
+		sd_build(x);
+	    qs_int(qs, (unsigned int) nx);
+	    qs_int(qs, (unsigned int) sd.used);
+	    sl = 0;
+	    while (i < nx) {
+		rlen_t k = (nx - i > 256) ? 256 : (nx - i);
+		rlen_t bl = sd_store_idx(ib, x, i, k);
+		if (bl < 0) {
+		    qs->err = 1;
+		    return;
 		}
-		/* pad with '\01' to make sure we can determine the number of elements */
-		while ((st - (char*)buf) & 3) *(st++) = 1;
-		buf = (unsigned int*)st;
-		goto didit;
-	}
-
-    if (t==EXPRSXP || t==VECSXP) {
-		rlen_t i = 0, n = XLENGTH(x);
-		*buf = itop(((t == EXPRSXP) ? XT_VECTOR_EXP : XT_VECTOR) | hasAttr);
-		buf++;
-		attrFixup;
-		while(i < n) {
-			buf = storeSEXP(buf, VECTOR_ELT(x, i), 0);
-			i++;
+		QAP_stream_put(qs, ib, bl);
+		sl += bl;
+		i += k;
+	    }
+	    while (sl & 3) {
+		qs_putc(qs, 0);
+		sl++;
+	    }
+	    sl = 0;
+	    for (i = 0; i < sd.used; i++) {
+		rlen_t l;
+		const char *cv = str_fe(sd.list[i], &l);
+		if ((unsigned char) cv[0] == NaStringRepresentation[0]) {
+		    qs_putc(qs, NaStringRepresentation[0]);
+		    sl++;
 		}
-		goto didit;
-    }
-	
-    if (t==INTSXP) {
-		rlen_t n = XLENGTH(x);
-		int *iptr = INTEGER(x);
-		*buf = itop(XT_ARRAY_INT | hasAttr);
-		buf++;
-		attrFixup;
-#ifdef NATIVE_COPY
-		memcpy(buf, iptr, n * sizeof(int));
-		buf += n;
-#else
-		{
-		    rlen_t i = 0;
-		    while(i < n) {
-			*buf = itop(iptr[i]);
-			buf++;
-			i++;
-		    }
-		}
-#endif
-		goto didit;
-    }
+		QAP_stream_put(qs, cv, l + 1);
+		sl += l + 1;
+	    }
+	    while (sl & 3) {
+		qs_putc(qs, 1);
+		sl++;
+	    }
+	}
+	break;
 
-    if (t==S4SXP) {
-		*buf=itop(XT_S4|hasAttr);
-		buf++;
-		attrFixup;
-		goto didit;		
-	}
-	
-    if (t==CHARSXP||t==SYMSXP) {
-		rlen_t sl;
-		const char *val;
-		if (t == CHARSXP) {
-			*buf = itop(XT_STR | hasAttr);
-			val = CHAR_FE(x);
+    case XT_ARRAY_STR:
+	{
+	    rlen_t nx = XLENGTH(x), i, sl = 0;
+	    for (i = 0; i < nx; i++) {
+		SEXP cs = STRING_ELT(x, i);
+		if (cs == R_NaString) {
+		    QAP_stream_put(qs, NaStringRepresentation, 2);
+		    sl += 2;
 		} else {
-			*buf = itop(XT_SYMNAME | hasAttr);
-			val = CHAR_FE(PRINTNAME(x));
+		    rlen_t l;
+		    const char *cv = str_fe(cs, &l);
+		    l++;
+		    if ((unsigned char) cv[0] == NaStringRepresentation[0]) { /* double the leading 0xff */
+			qs_putc(qs, NaStringRepresentation[0]);
+			sl++;
+		    }
+		    QAP_stream_put(qs, cv, l);
+		    sl += l;
 		}
-		buf++;
-		attrFixup;
-		strcpy((char*)buf, val);
-		sl = strlen((char*)buf); sl++;
-		while (sl & 3) /* pad by 0 to a length divisible by 4 (since 0.1-10) */
-			((char*)buf)[sl++] = 0;
-		buf = (unsigned int*)(((char*)buf) + sl);
-		goto didit;
-    }
-	
-    *buf = itop(XT_UNKNOWN | hasAttr);
-    buf++;
-    attrFixup;
-    *buf = itop(TYPEOF(x));
-    buf++;
-    
- didit:
-    if (isLarge) {
-		txlen = dist(preBuf, buf) - 4L;
-		preBuf[0] = itop(SET_PAR(PAR_TYPE(((unsigned char*) preBuf)[4] | XT_LARGE), txlen & 0xffffff));
-		preBuf[1] = itop(txlen >> 24);
-    } else
-		*preBuf = itop(SET_PAR(PAR_TYPE(ptoi(*preBuf)), dist(preBuf, buf)));
+	    }
+	    /* pad with '\01' to make sure we can determine the number of elements */
+	    while (sl & 3) {
+		qs_putc(qs, 1);
+		sl++;
+	    }
+	}
+	break;
 
-#ifdef RSERV_DEBUG
-	printf("stored %p at %p, %lu bytes\n", (void*)x, (void*)preBuf, (unsigned long) dist(preBuf, buf));
-#endif
+    case XT_ARRAY_INT_SEQ:
+	qs_int(qs, (unsigned int) XLENGTH(x));
+	qs_int(qs, (int) f->s0);
+	qs_int(qs, (int) f->d0);
+	break;
 
-    if (dist(preBuf, buf) > storage_size) {
-#ifdef RSERVE_PKG
-      REprintf("**ERROR: underestimated storage %ld / %ld SEXP type %d\n", (long) dist(preBuf, buf), (long) storage_size, TYPEOF(x));
+    case XT_ARRAY_INT:
+#ifdef NATIVE_COPY
+	QAP_stream_put(qs, INTEGER_R(x), XLENGTH(x) * sizeof(int));
 #else
-      fprintf(stderr, "**ERROR: underestimated storage %ld / %ld SEXP type %d\n", (long) dist(preBuf, buf), (long) storage_size, TYPEOF(x));
+	{
+	    rlen_t i = 0, n = XLENGTH(x);
+	    int *iptr = INTEGER_R(x);
+	    while (i < n)
+		qs_int(qs, iptr[i++]);
+	}
 #endif
-      /* R_inspect(x)  // can't use this since it's hidden in R */
+	break;
+
+    case XT_STR:
+    case XT_SYMNAME:
+	{
+	    rlen_t sl;
+	    const char *val = str_fe((f->t == CHARSXP) ? x : PRINTNAME(x), &sl);
+	    sl++;
+	    QAP_stream_put(qs, val, sl);
+	    while (sl & 3) { /* pad by 0 to a length divisible by 4 */
+		qs_putc(qs, 0);
+		sl++;
+	    }
+	}
+	break;
+
+    case XT_UNKNOWN:
+	qs_int(qs, TYPEOF(x));
+	break;
     }
+}
 
-    return buf;
+/* stores x (which must have been sized by QAP_stream_size() first) into
+   the stream. The chunk buffer is flushed whenever it fills up, but not
+   at the end, use QAP_stream_flush() once the message is complete. */
+int QAP_stream_store(qap_stream_t *qs, SEXP x) {
+    enc_stack_t es = { 0, 0, 0 };
+    enc_frame_t cf, *f;
+    SEXP c;
+    int kids = es_init(&cf, x);
+
+    qs->sz.pos = qs->sz.seq_pos = 0;
+    while (!qs->err) { /* cf is the next node to store */
+	/* the object must not change between sizing and storing */
+	if (qs->sz.pos >= qs->sz.nodes) {
+	    qs->err = 1;
+	    break;
+	}
+	cf.slot = qs->sz.pos++;
+	cf.type = node_type(&cf, &qs->sz);
+	qs_header(qs, cf.type, qs->sz.size[cf.slot]);
+	if (kids) {
+	    if (!(f = es_push(&es, &cf))) {
+		qs->err = 1;
+		break;
+	    }
+	} else {
+	    qs_payload(qs, &cf);
+	    if (!es.depth)
+		break;
+	    f = es.f + es.depth - 1;
+	}
+	while (!es_child(f, &c)) {
+	    qs_payload(qs, f);
+	    if (!--es.depth)
+		break;
+	    f = es.f + es.depth - 1;
+	}
+	if (!es.depth)
+	    break;
+	kids = es_init(&cf, c);
+    }
+    es_free(&es);
+    sc_reset();
+    sd_free();
+    last_x = 0;
+    if (qs->sz.pos != qs->sz.nodes)
+	qs->err = 1;
+    return qs->err ? -1 : 0;
 }
@@ -8,7 +8,82 @@
 
 #include "Rsrv.h"
 
+#ifdef WIN32
+#ifndef RS_IOVEC_DEFINED
+#define RS_IOVEC_DEFINED 1
+struct iovec { void *iov_base; size_t iov_len; };
+#endif
+#else
+#include <sys/uio.h>
+#endif
+
+/* both fail (returning -1 and NULL respectively) if x is nested
+   deeper than QAP_MAX_DEPTH */
 rlen_t QAP_getStorageSize(SEXP x);
 unsigned int* QAP_storeSEXP(unsigned int* buf, SEXP x, rlen_t storage_size);
 
+/* QAP extensions (QAPX_.. flags) the encoder may use - the peer
+   must have enabled them (see CMD_setQAPExt), default is none */
+extern int QAP_ext;
+
+/* QAP_storeSEXP() copies vector payloads of at least QAP_copy_min
+   bytes using up to QAP_copy_threads threads (after the layout of the
+   whole object is done). Values below 2 disable parallel copy (the
+   default), it is only available if Rserve was built with threads */
+extern int    QAP_copy_threads;
+extern rlen_t QAP_copy_min;
+#define QAP_COPY_MAX_THREADS 64
+
+/* streaming encoder - emits the encoded SEXP in chunks of at most
+   buf_size bytes via the send callback instead of requiring a buffer
+   that can hold the entire encoded object. QAP_stream_size() computes
+   the exact size of the encoding (and records the size of each node
+   so that headers can be written ahead of their payload), it must be
+   called before QAP_stream_store() on the same object.
+   If a gather send callback is set via QAP_stream_sendv() then large
+   blocks (vector payloads) are not copied into the chunk buffer but
+   passed by reference, so they must stay valid until the next flush. */
+typedef ssize_t (*qap_send_fn_t)(void *ctx, const void *buf, size_t len);
+typedef ssize_t (*qap_sendv_fn_t)(void *ctx, struct iovec *iov, int iovcnt);
+
+/* max. number of segments per gather send */
+#define QAP_STREAM_IOVS 64
+/* blocks of at least this size are passed by reference in gather mode */
+#define QAP_STREAM_REF_MIN 65536
+
+/* node sent as a compact sequence */
+typedef struct qap_seq {
+    rlen_t slot;
+    double start, step;
+} qap_seq_t;
+
+/* sizes of the nodes of an object in the order of storage */
+typedef struct qap_sizes {
+    rlen_t *size;
+    rlen_t nodes, alloc, pos;
+    qap_seq_t *seq;  /* compact sequences found while sizing, by slot */
+    rlen_t seqs, seq_alloc, seq_pos;
+} qap_sizes_t;
+
+typedef struct qap_stream {
+    qap_send_fn_t send;  /* callback used to flush the chunk buffer */
+    qap_sendv_fn_t sendv;/* optional gather send callback */
+    void *ctx;           /* context passed to send */
+    char *buf;           /* chunk buffer */
+    rlen_t buf_size, fill;
+    rlen_t seg;          /* start of the buffer part not yet in iov */
+    struct iovec iov[QAP_STREAM_IOVS];
+    int iovs;
+    qap_sizes_t sz;      /* node sizes computed by QAP_stream_size() */
+    int err;
+} qap_stream_t;
+
+void   QAP_stream_init(qap_stream_t *qs, char *buf, rlen_t buf_size, qap_send_fn_t send, void *ctx);
+void   QAP_stream_sendv(qap_stream_t *qs, qap_sendv_fn_t sendv);
+rlen_t QAP_stream_size(qap_stream_t *qs, SEXP x);
+int    QAP_stream_put(qap_stream_t *qs, const void *data, rlen_t len);
+int    QAP_stream_store(qap_stream_t *qs, SEXP x);
+int    QAP_stream_flush(qap_stream_t *qs);
+void   QAP_stream_free(qap_stream_t *qs);
+
 #endif
@@ -0,0 +1,145 @@
+/* QAP codec micro-benchmark
+
+   Measures the throughput of QAP_getStorageSize()/QAP_storeSEXP()
+   (encode), QAP_decode() (decode) and both (round-trip) on a set of
+   representative objects using embedded R - no server or client is
+   involved. Build in src (after configure) with
+
+     make -f "`R RHOME`/etc/Makeconf" -f Makevars qapbench
+
+   and run as R CMD ./qapbench [-r <reps>] [-s <scale>] [-x <QAPX flags>]
+   [-t <copy threads>]. The best time of all repetitions is reported
+   as MB/s (of the encoded size) and ns per element. */
+
+#include <stdlib.h>
+
+/* this file is part of the package sources, but only used for the benchmark */
+#ifdef QAP_BENCHMARK
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define MAIN /* we need itop/fixdcpy on big-endian machines */
+#include "qap_encode.h"
+#include "qap_decode.h"
+
+#include <R_ext/Parse.h>
+
+extern int Rf_initEmbeddedR(int, char**);
+
+/* used by the codec - the benchmark always uses native encoding */
+cetype_t string_encoding = CE_NATIVE;
+
+typedef struct bench_case {
+	const char *name;
+	const char *expr;  /* R expression creating the object */
+	const char *elts;  /* R expression computing the number of elements from x */
+} bench_case_t;
+
+/* %d in the expressions is replaced by the scale */
+static bench_case_t cases[] = {
+	{ "long numeric", "runif(%d * 1e7)", "length(x)" },
+	{ "strings", "paste0('id', sample.int(1e5, %d * 1e6, TRUE))", "length(x)" },
+	{ "wide data.frame", "as.data.frame(matrix(runif(%d * 1e6), ncol = 1000))", "length(x) * nrow(x)" },
+	{ "deep list", "{ x <- 1; for (i in seq.int(%d * 10000)) x <- list(x, i); x }", "%d * 10000" },
+	{ "attributes", "lapply(seq.int(%d * 1e5), function(i) structure(i, names = 'a', class = 'foo', extra = c(u = 1)))", "length(x)" },
+	{ 0, 0, 0 }
+};
+
+static double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return ((double) tv.tv_sec) + ((double) tv.tv_usec) / 1000000.0;
+}
+
+static SEXP eval_str(const char *fmt, int scale, SEXP rho) {
+	char buf[512];
+	ParseStatus st;
+	SEXP ex, res;
+	snprintf(buf, sizeof(buf), fmt, scale);
+	ex = PROTECT(R_ParseVector(PROTECT(mkString(buf)), -1, &st, R_NilValue));
+	if (st != PARSE_OK || LENGTH(ex) < 1) {
+		fprintf(stderr, "ERROR: cannot parse '%s'\n", buf);
+		exit(1);
+	}
+	res = eval(VECTOR_ELT(ex, 0), rho);
+	UNPROTECT(2);
+	return res;
+}
+
+static void report(const char *what, double t, rlen_t bytes, double elts) {
+	printf("  %-10s %10.1f MB/s %10.2f ns/element\n", what,
+		   (t > 0) ? (((double) bytes) / t / 1048576.0) : 0.0, t * 1e9 / elts);
+}
+
+int main(int argc, char **argv) {
+	char *r_argv[] = { "R", "--no-save", "--silent", "--vanilla", 0 };
+	int reps = 5, scale = 1, i = 0;
+
+	while (++i < argc) {
+		if (argv[i][0] == '-' && argv[i][1] && !argv[i][2] && i + 1 < argc) {
+			int v = atoi(argv[++i]);
+			switch (argv[i - 1][1]) {
+			case 'r': reps = (v < 1) ? 1 : v; continue;
+			case 's': scale = (v < 1) ? 1 : v; continue;
+			case 'x': QAP_ext = v; continue;
+			case 't': QAP_copy_threads = v; continue;
+			}
+		}
+		fprintf(stderr, "Usage: %s [-r <reps>] [-s <scale>] [-x <QAPX flags>] [-t <copy threads>]\n", argv[0]);
+		return 1;
+	}
+
+	Rf_initEmbeddedR(4, r_argv);
+	printf("QAP codec benchmark, scale %d, %d repetitions, QAP extensions 0x%x, copy threads %d\n\n",
+		   scale, reps, QAP_ext, QAP_copy_threads);
+	eval_str("set.seed(1)", scale, R_GlobalEnv);
+
+	for (i = 0; cases[i].name; i++) {
+		SEXP x = PROTECT(eval_str(cases[i].expr, scale, R_GlobalEnv));
+		double elts, t_enc = -1, t_dec = -1, t_rt = -1;
+		rlen_t len = 0, alloc;
+		unsigned int *buf;
+		int rep;
+
+		defineVar(install("x"), x, R_GlobalEnv);
+		elts = asReal(eval_str(cases[i].elts, scale, R_GlobalEnv));
+		alloc = QAP_getStorageSize(x);
+		if (alloc < 0 || !(buf = (unsigned int*) malloc(alloc + 4096))) {
+			printf("%s: cannot encode\n", cases[i].name);
+			UNPROTECT(1);
+			continue;
+		}
+		for (rep = 0; rep < reps; rep++) {
+			double t0, t1, t2;
+			unsigned int *ptr = buf, *end;
+			SEXP y;
+			t0 = now();
+			end = QAP_storeSEXP(buf, x, QAP_getStorageSize(x));
+			t1 = now();
+			y = QAP_decode(&ptr);
+			t2 = now();
+			if (!end || !y) {
+				printf("%s: encoding or decoding failed\n", cases[i].name);
+				break;
+			}
+			len = ((char*) end) - ((char*) buf);
+			if (t_enc < 0 || t1 - t0 < t_enc) t_enc = t1 - t0;
+			if (t_dec < 0 || t2 - t1 < t_dec) t_dec = t2 - t1;
+			if (t_rt < 0 || t2 - t0 < t_rt) t_rt = t2 - t0;
+		}
+		free(buf);
+		if (rep == reps) {
+			printf("%s: %.0f elements, %.1f MB encoded\n", cases[i].name, elts, ((double) len) / 1048576.0);
+			report("encode", t_enc, len, elts);
+			report("decode", t_dec, len, elts);
+			report("round-trip", t_rt, len, elts);
+		}
+		UNPROTECT(1);
+		R_gc();
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,426 @@
+/* Mapped vectors and shared object store - see rsmap.h */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* memfd_create */
+#endif
+
+#include "config.h"
+#include "rsmap.h"
+
+#include <Rversion.h>
+#include <string.h>
+#include <errno.h>
+
+#if (R_VERSION >= R_Version(3,6,0)) && ! (defined DISABLE_ALTREP) && ! (defined WIN32)
+#define USE_RSMAP 1
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <R_ext/Altrep.h>
+#include <R_ext/Rdynload.h>
+
+/* data1 is an external pointer to the payload (its tag is the length
+   as a real scalar and it protects the owner of the mapping), data2
+   is R_NilValue or, once writable access was requested, an external
+   pointer to a private view of the payload (or a copy in the R heap) */
+static R_altrep_class_t map_int_class, map_real_class, map_lgl_class;
+static int map_ready; /* 0 = not initialized, 1 = ok, -1 = unavailable */
+
+/* segment created by RS_map_copy() or RS_share_copy(), the owner of its
+   mapped vectors is an external pointer to it tagged map_seg_tag */
+typedef struct map_seg {
+    void *addr;
+    size_t len;
+    int fd; /* backing file, used for private views */
+} map_seg_t;
+
+static SEXP map_seg_tag;
+
+/* size of an element of the types we can map, 0 = not supported */
+static size_t map_eltsize(int type) {
+    return (type == INTSXP || type == LGLSXP) ? sizeof(int) : ((type == REALSXP) ? sizeof(double) : 0);
+}
+
+static R_altrep_class_t map_class(int type) {
+    return (type == INTSXP) ? map_int_class : ((type == LGLSXP) ? map_lgl_class : map_real_class);
+}
+
+static R_xlen_t map_Length(SEXP x) {
+    return (R_xlen_t) REAL(R_ExternalPtrTag(R_altrep_data1(x)))[0];
+}
+
+/* finalizer of private views created by map_view() */
+static void map_view_fin(SEXP view) {
+    char *addr = (char*) R_ExternalPtrAddr(view);
+    if (addr) {
+	size_t delta = ((uintptr_t) addr) % (size_t) sysconf(_SC_PAGESIZE);
+	munmap(addr - delta, (size_t) REAL(R_ExternalPtrTag(view))[0]);
+	R_ClearExternalPtr(view);
+    }
+}
+
+/* maps the payload of x privately and writable from the file backing
+   its segment, so only the pages that are actually written to get
+   copied. Returns R_NilValue if x has no backing file or the mapping
+   failed */
+static SEXP map_view(SEXP x) {
+    SEXP data = R_altrep_data1(x), owner = R_ExternalPtrProtected(data), view;
+    map_seg_t *seg;
+    size_t off, delta, len;
+    char *m;
+    if (TYPEOF(owner) != EXTPTRSXP || R_ExternalPtrTag(owner) != map_seg_tag ||
+	!(seg = (map_seg_t*) R_ExternalPtrAddr(owner)) || seg->fd == -1)
+	return R_NilValue;
+    off = (char*) R_ExternalPtrAddr(data) - (char*) seg->addr;
+    delta = off % (size_t) sysconf(_SC_PAGESIZE);
+    len = map_Length(x) * map_eltsize(TYPEOF(x)) + delta;
+    view = PROTECT(R_MakeExternalPtr(0, PROTECT(ScalarReal((double) len)), R_NilValue));
+    R_RegisterCFinalizer(view, map_view_fin);
+    m = (char*) mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, seg->fd, (off_t) (off - delta));
+    UNPROTECT(2);
+    if (m == (char*) MAP_FAILED)
+	return R_NilValue;
+    R_SetExternalPtrAddr(view, m + delta);
+    return view;
+}
+
+static const void *map_Dataptr_or_null(SEXP x) {
+    SEXP copy = R_altrep_data2(x);
+    if (copy == R_NilValue)
+	return R_ExternalPtrAddr(R_altrep_data1(x));
+    if (TYPEOF(copy) == EXTPTRSXP)
+	return R_ExternalPtrAddr(copy);
+    return (TYPEOF(copy) == REALSXP) ? (const void*) REAL_RO(copy) : (const void*) INTEGER_RO(copy);
+}
+
+static void *map_Dataptr(SEXP x, Rboolean writeable) {
+    if (writeable && R_altrep_data2(x) == R_NilValue) {
+	/* the mapping is read-only, so we need a private view */
+	SEXP copy = map_view(x);
+	if (copy == R_NilValue) { /* not backed by a file, copy to the heap */
+	    R_xlen_t n = map_Length(x);
+	    copy = allocVector(TYPEOF(x), n);
+	    memcpy((TYPEOF(x) == REALSXP) ? (void*) REAL(copy) : (void*) INTEGER(copy),
+		   R_ExternalPtrAddr(R_altrep_data1(x)), n * map_eltsize(TYPEOF(x)));
+	}
+	R_set_altrep_data2(x, copy);
+    }
+    return (void*) map_Dataptr_or_null(x);
+}
+
+/* unmodified vectors are duplicated by referencing the same mapping,
+   returning NULL makes R use the regular duplication otherwise */
+static SEXP map_Duplicate(SEXP x, Rboolean deep) {
+    if (R_altrep_data2(x) != R_NilValue)
+	return NULL;
+    return R_new_altrep(map_class(TYPEOF(x)), R_altrep_data1(x), R_NilValue);
+}
+
+static Rboolean map_Inspect(SEXP x, int pre, int deep, int pvec,
+			    void (*inspect_subtree)(SEXP, int, int, int)) {
+    Rprintf(" Rserve mapped vector (%p)%s\n", R_ExternalPtrAddr(R_altrep_data1(x)),
+	    (R_altrep_data2(x) == R_NilValue) ? "" : " (private)");
+    return TRUE;
+}
+
+/* integer and logical vectors share the accessors */
+static int map_int_Elt(SEXP x, R_xlen_t i) {
+    return ((const int*) map_Dataptr_or_null(x))[i];
+}
+
+static R_xlen_t map_int_Get_region(SEXP x, R_xlen_t i, R_xlen_t n, int *buf) {
+    R_xlen_t len = map_Length(x);
+    if (i + n > len) n = len - i;
+    if (n > 0) memcpy(buf, ((const int*) map_Dataptr_or_null(x)) + i, n * sizeof(int));
+    return n;
+}
+
+static double map_real_Elt(SEXP x, R_xlen_t i) {
+    return ((const double*) map_Dataptr_or_null(x))[i];
+}
+
+static R_xlen_t map_real_Get_region(SEXP x, R_xlen_t i, R_xlen_t n, double *buf) {
+    R_xlen_t len = map_Length(x);
+    if (i + n > len) n = len - i;
+    if (n > 0) memcpy(buf, ((const double*) map_Dataptr_or_null(x)) + i, n * sizeof(double));
+    return n;
+}
+
+static void map_vec_methods(R_altrep_class_t cl) {
+    R_set_altrep_Length_method(cl, map_Length);
+    R_set_altrep_Inspect_method(cl, map_Inspect);
+    R_set_altrep_Duplicate_method(cl, map_Duplicate);
+    R_set_altvec_Dataptr_method(cl, map_Dataptr);
+    R_set_altvec_Dataptr_or_null_method(cl, map_Dataptr_or_null);
+}
+
+/* registers the ALTREP classes on first use */
+static int map_init(void) {
+    DllInfo *dll;
+    if (map_ready) return (map_ready > 0);
+#ifdef STANDALONE_RSERVE
+    dll = R_getEmbeddingDllInfo();
+#else
+    dll = R_getDllInfo("Rserve");
+#endif
+    if (!dll) {
+	map_ready = -1;
+	return 0;
+    }
+    map_seg_tag = install("Rserve.segment");
+    map_int_class = R_make_altinteger_class("rs_int_map", "Rserve", dll);
+    map_vec_methods(map_int_class);
+    R_set_altinteger_Elt_method(map_int_class, map_int_Elt);
+    R_set_altinteger_Get_region_method(map_int_class, map_int_Get_region);
+
+    map_real_class = R_make_altreal_class("rs_real_map", "Rserve", dll);
+    map_vec_methods(map_real_class);
+    R_set_altreal_Elt_method(map_real_class, map_real_Elt);
+    R_set_altreal_Get_region_method(map_real_class, map_real_Get_region);
+
+    map_lgl_class = R_make_altlogical_class("rs_lgl_map", "Rserve", dll);
+    map_vec_methods(map_lgl_class);
+    R_set_altlogical_Elt_method(map_lgl_class, map_int_Elt);
+    R_set_altlogical_Get_region_method(map_lgl_class, map_int_Get_region);
+    map_ready = 1;
+    return 1;
+}
+
+SEXP RS_map_vector(int type, const void *data, R_xlen_t n, SEXP owner) {
+    SEXP ptr, res;
+    if (!map_eltsize(type) || !map_init())
+	return 0;
+    ptr = PROTECT(R_MakeExternalPtr((void*) data, PROTECT(ScalarReal((double) n)), owner));
+    res = R_new_altrep(map_class(type), ptr, R_NilValue);
+    UNPROTECT(2);
+    return res;
+}
+
+int RS_is_mapped(SEXP x) {
+    return (map_ready > 0 && ALTREP(x) &&
+	    (R_altrep_inherits(x, map_int_class) || R_altrep_inherits(x, map_real_class) ||
+	     R_altrep_inherits(x, map_lgl_class)) &&
+	    R_altrep_data2(x) == R_NilValue) ? 1 : 0;
+}
+
+/* finalizer of segments created by RS_map_copy() and RS_share_copy() */
+static void map_fin(SEXP owner) {
+    map_seg_t *seg = (map_seg_t*) R_ExternalPtrAddr(owner);
+    if (seg) {
+	munmap(seg->addr, seg->len);
+	if (seg->fd != -1)
+	    close(seg->fd);
+	free(seg);
+	R_ClearExternalPtr(owner);
+    }
+}
+
+/* creates the owner of the segment of len bytes mapped at m with the
+   backing file fd. Releases the segment and returns NULL on error */
+static SEXP map_owner(void *m, size_t len, int fd) {
+    map_seg_t *seg = (map_seg_t*) malloc(sizeof(map_seg_t));
+    SEXP owner;
+    if (!seg) {
+	munmap(m, len);
+	close(fd);
+	errno = ENOMEM;
+	return 0;
+    }
+    seg->addr = m;
+    seg->len = len;
+    seg->fd = fd;
+    owner = PROTECT(R_MakeExternalPtr(seg, map_seg_tag, R_NilValue));
+    R_RegisterCFinalizer(owner, map_fin);
+    UNPROTECT(1);
+    return owner;
+}
+
+static void *map_segment(size_t len, int *fd);
+
+SEXP RS_map_copy(SEXP x, size_t min_size) {
+    SEXP owner, res;
+    size_t len;
+    void *m;
+    int fd;
+    if (!map_eltsize(TYPEOF(x)) || ALTREP(x) || !map_init())
+	return x;
+    len = XLENGTH(x) * map_eltsize(TYPEOF(x));
+    if (!len || len < min_size)
+	return x;
+    if (!(m = map_segment(len, &fd)))
+	return x;
+    memcpy(m, DATAPTR_RO(x), len);
+    if (mprotect(m, len, PROT_READ)) {
+	munmap(m, len);
+	close(fd);
+	return x;
+    }
+    if (!(owner = map_owner(m, len, fd)))
+	return x;
+    PROTECT(owner);
+    res = PROTECT(RS_map_vector(TYPEOF(x), m, XLENGTH(x), owner));
+    DUPLICATE_ATTRIB(res, x);
+    UNPROTECT(2);
+    return res;
+}
+
+/* --- shared objects --- */
+
+#define SHARE_MAX_DEPTH 16
+/* payloads are aligned to cache lines */
+#define SHARE_ALIGN(X) (((X) + 63) & ~((size_t) 63))
+
+/* number of bytes needed in the segment for x */
+static size_t share_size(SEXP x, int depth) {
+    if (TYPEOF(x) == VECSXP) {
+	R_xlen_t i, n = XLENGTH(x);
+	size_t len = 0;
+	if (depth < SHARE_MAX_DEPTH)
+	    for (i = 0; i < n; i++)
+		len += share_size(VECTOR_ELT(x, i), depth + 1);
+	return len;
+    }
+    if (!map_eltsize(TYPEOF(x))) /* NULL, functions, ... stay as they are */
+	return 0;
+    return SHARE_ALIGN(XLENGTH(x) * map_eltsize(TYPEOF(x)));
+}
+
+/* copies the payloads of x into the segment at base + *off and returns
+   the corresponding object of mapped vectors */
+static SEXP share_object(SEXP x, int depth, char *base, size_t *off, SEXP owner) {
+    size_t len;
+    SEXP res;
+    if (TYPEOF(x) == VECSXP) {
+	R_xlen_t i, n = XLENGTH(x);
+	if (depth >= SHARE_MAX_DEPTH)
+	    return x;
+	res = PROTECT(allocVector(VECSXP, n));
+	for (i = 0; i < n; i++)
+	    SET_VECTOR_ELT(res, i, share_object(VECTOR_ELT(x, i), depth + 1, base, off, owner));
+	DUPLICATE_ATTRIB(res, x);
+	UNPROTECT(1);
+	return res;
+    }
+    if (!map_eltsize(TYPEOF(x)) || !(len = XLENGTH(x) * map_eltsize(TYPEOF(x))))
+	return x;
+    memcpy(base + *off, DATAPTR_RO(x), len);
+    res = PROTECT(RS_map_vector(TYPEOF(x), base + *off, XLENGTH(x), owner));
+    DUPLICATE_ATTRIB(res, x);
+    *off += SHARE_ALIGN(len);
+    UNPROTECT(1);
+    return res;
+}
+
+/* maps a new shared segment of len bytes (writable). The segment is a
+   memfd if available, otherwise an unlinked file in the temporary
+   directory, so its pages are not part of the anonymous memory of the
+   process. The file is returned in fd, it is kept open to create
+   private views of the segment. Returns NULL on error (with errno set) */
+static void *map_segment(size_t len, int *fd) {
+    void *m;
+    int err;
+    *fd = -1;
+#ifdef HAVE_MEMFD_CREATE
+    *fd = memfd_create("Rserve-share", MFD_CLOEXEC);
+#endif
+    if (*fd == -1) {
+	const char *tmp = getenv("TMPDIR");
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/Rserve-shareXXXXXX", (tmp && *tmp) ? tmp : "/tmp");
+	if ((*fd = mkstemp(path)) == -1)
+	    return 0;
+	unlink(path);
+	fcntl(*fd, F_SETFD, FD_CLOEXEC);
+    }
+    if (ftruncate(*fd, len)) {
+	err = errno;
+	close(*fd);
+	errno = err;
+	return 0;
+    }
+    m = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (m == MAP_FAILED) {
+	err = errno;
+	close(*fd);
+	errno = err;
+	return 0;
+    }
+    return m;
+}
+
+SEXP RS_share_copy(SEXP x) {
+    SEXP owner, res;
+    size_t len, off = 0;
+    void *m;
+    int fd;
+    if (!map_init() || !(len = share_size(x, 0)))
+	return x;
+    if (!(m = map_segment(len, &fd)) || !(owner = map_owner(m, len, fd)))
+	return 0;
+    PROTECT(owner);
+    res = PROTECT(share_object(x, 0, (char*) m, &off, owner));
+    /* from now on nobody can modify the payloads */
+    if (mprotect(m, len, PROT_READ)) {
+	UNPROTECT(2);
+	return 0;
+    }
+    UNPROTECT(2);
+    return res;
+}
+
+#else
+
+SEXP RS_map_copy(SEXP x, size_t min_size) { return x; }
+SEXP RS_map_vector(int type, const void *data, R_xlen_t n, SEXP owner) { return 0; }
+int RS_is_mapped(SEXP x) { return 0; }
+SEXP RS_share_copy(SEXP x) { return x; }
+
+#endif
+
+/* registry of shared objects (by name), inherited by forked children */
+static SEXP share_env;
+
+static SEXP share_sym(SEXP sName) {
+    if (TYPEOF(sName) != STRSXP || LENGTH(sName) != 1 || STRING_ELT(sName, 0) == NA_STRING)
+	Rf_error("Invalid name, must be a string");
+    return install(CHAR(STRING_ELT(sName, 0)));
+}
+
+/* R API: publishes a shared copy of sObj as sName, returns the copy */
+SEXP Rserve_share(SEXP sName, SEXP sObj) {
+    SEXP sym = share_sym(sName), res;
+    if (!share_env) {
+	SEXP env = eval(PROTECT(lang3(install("new.env"), ScalarLogical(TRUE), R_EmptyEnv)), R_GlobalEnv);
+	UNPROTECT(1);
+	if (TYPEOF(env) != ENVSXP)
+	    Rf_error("Cannot create shared object registry");
+	R_PreserveObject(share_env = env);
+    }
+    if (sObj == R_NilValue) { /* remove the entry */
+	if (findVarInFrame(share_env, sym) != R_UnboundValue) {
+	    SEXP call = PROTECT(lang3(install("rm"), ScalarString(PRINTNAME(sym)), share_env));
+	    SET_TAG(CDR(call), install("list"));
+	    SET_TAG(CDDR(call), install("envir"));
+	    eval(call, R_GlobalEnv);
+	    UNPROTECT(1);
+	}
+	return R_NilValue;
+    }
+    if (!(res = RS_share_copy(sObj)))
+	Rf_error("Cannot create shared memory segment: %s", strerror(errno));
+    PROTECT(res);
+    defineVar(sym, res, share_env);
+    UNPROTECT(1);
+    return res;
+}
+
+/* R API: returns the shared object sName or NULL */
+SEXP Rserve_shared(SEXP sName) {
+    SEXP sym = share_sym(sName), res;
+    if (!share_env)
+	return R_NilValue;
+    res = findVarInFrame(share_env, sym);
+    return (res == R_UnboundValue) ? R_NilValue : res;
+}
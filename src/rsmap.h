@@ -0,0 +1,48 @@
+#ifndef RSMAP_H__
+#define RSMAP_H__
+
+#include <stdlib.h>
+#include <Rinternals.h>
+
+/* Mapped vectors
+
+   Integer, real and logical vectors whose payload lives in a read-only
+   memory mapping outside of the R heap (ALTREP, requires R 3.6.0 or higher).
+   Neither the garbage collector nor R code ever writes to the payload,
+   so processes forked after the vector was created keep sharing its
+   pages. Writable access to the data (e.g., in-place modification)
+   gives the vector a private copy-on-write mapping of its payload
+   which is used from then on, so only the pages written to are
+   copied (vectors with other owners than the functions below get a
+   copy in the R heap instead). Duplicates reference the same
+   mapping. */
+
+/* returns a mapped copy of x (including its attributes) if x is a
+   regular integer, real or logical vector with a payload of at least
+   min_size bytes, otherwise (or if mapped vectors are not supported) x
+   itself. The copy lives in its own segment (see RS_share_copy), which
+   keeps a file descriptor open as long as the copy is alive */
+SEXP RS_map_copy(SEXP x, size_t min_size);
+
+/* creates a mapped vector of n elements of type INTSXP, REALSXP or
+   LGLSXP referencing data which must stay valid (and unchanged) as long as
+   owner is alive. Returns NULL if the type or mapped vectors are not
+   supported */
+SEXP RS_map_vector(int type, const void *data, R_xlen_t n, SEXP owner);
+
+/* returns 1 if x is a mapped vector that has not been copied to the heap */
+int RS_is_mapped(SEXP x);
+
+/* returns a copy of x where all vectors that can be mapped (x itself or
+   elements of lists, recursively) are mapped vectors over one shared
+   memory segment (memfd or an unlinked temporary file), other objects
+   are referenced as they are. Returns x if there is nothing to share or
+   mapped vectors are not supported, NULL if the segment could not be
+   created (errno is set) */
+SEXP RS_share_copy(SEXP x);
+
+/* R API: shared object registry */
+SEXP Rserve_share(SEXP sName, SEXP sObj);
+SEXP Rserve_shared(SEXP sName);
+
+#endif
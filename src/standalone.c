@@ -231,6 +231,11 @@ int main(int argc, char **argv)
 			{"Rserve_oc_register", (DL_FUNC) &Rserve_oc_register, 2},
 			{"Rserve_oc_resolve", (DL_FUNC) &Rserve_oc_resolve, 1},
 			{"Rserve_ulog", (DL_FUNC) &Rserve_ulog, 1},
+			{"Rserve_server_stats", (DL_FUNC) &Rserve_server_stats, 0},
+			{"Rserve_memory_stats", (DL_FUNC) &Rserve_memory_stats, 0},
+			{"Rserve_parse_stats", (DL_FUNC) &Rserve_parse_stats, 0},
+			{"Rserve_share", (DL_FUNC) &Rserve_share, 2},
+			{"Rserve_shared", (DL_FUNC) &Rserve_shared, 1},
 			{"Rserve_fork_compute", (DL_FUNC) &Rserve_fork_compute, 1},
 			{"Rserve_kill_compute", (DL_FUNC) &Rserve_kill_compute, 1},
 			{"Rserve_forward_stdio", (DL_FUNC) &Rserve_forward_stdio, 0},
@@ -279,6 +284,13 @@ int main(int argc, char **argv)
 		return ex(1);
 	}
 
+#ifdef unix
+	if (mux_port > 0 && !create_Rserve_QAP1_mux(global_srv_flags)) {
+		fprintf(stderr, "ERROR: unable to start multiplexed Rserve server\n");
+		return ex(1);
+	}
+#endif
+
 	http_flags = global_srv_flags;
 	if (ws_upgrade) {
 		http_flags = global_srv_flags | (enable_ws_qap ? WS_PROT_QAP : 0) | (enable_ws_text ? WS_PROT_TEXT : 0) | (ws_qap_oc ? SRV_QAP_OC : 0);
@@ -79,9 +79,29 @@ static ssize_t tls_send(args_t *c, const void *buf, size_t len) {
     return SSL_write(c->ssl, buf, len);
 }
 
+/* SSL has no gather write, so small leading segments are coalesced
+   into one record and large ones are written directly. Like writev()
+   this may send only a part of the data. */
+static ssize_t tls_sendv(args_t *c, const struct iovec *iov, int iovcnt) {
+    char buf[16384]; /* max. TLS record payload */
+    size_t n = 0, len;
+    int i = 0;
+    while (i < iovcnt && n + iov[i].iov_len <= sizeof(buf)) {
+	memcpy(buf + n, iov[i].iov_base, iov[i].iov_len);
+	n += iov[i].iov_len;
+	i++;
+    }
+    if (n || !iovcnt)
+	return SSL_write(c->ssl, buf, n);
+    len = iov->iov_len;
+    if (len > 0x40000000) len = 0x40000000; /* SSL_write() takes int */
+    return SSL_write(c->ssl, iov->iov_base, len);
+}
+
 int add_tls(args_t *c, tls_t *tls, int server) {
     c->ssl = SSL_new(tls->ctx);
     c->srv->send = tls_send;
+    c->srv->sendv = tls_sendv;
     c->srv->recv = tls_recv;
     SSL_set_fd(c->ssl, c->s);
     if (server) 
@@ -94,6 +114,7 @@ void copy_tls(args_t *src, args_t *dst) {
     dst->ssl = src->ssl;
     dst->s   = src->s;
     dst->srv->send = src->srv->send;
+    dst->srv->sendv = src->srv->sendv;
     dst->srv->recv = src->srv->recv;
 }
 